@@ -0,0 +1,67 @@
+#ifndef _SDACCT_H
+#define _SDACCT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Contabilidad de escrituras en la SD, para saber cuándo cambiar la
+   tarjeta en vez de hacerlo a ciegas. Por motivo se cuentan los bytes
+   lógicos (lo que se quería guardar: para APPEND la carga útil de los
+   registros, para el resto lo que pide cada escritura) y los físicos
+   (sectores de SDACCT_SECTOR que toca cada write(), reescrituras del
+   sector final incluidas). La amplificación es físicos totales / lógicos
+   de APPEND: lo que cuesta en la tarjeta cada byte de eventos.
+
+   Los totales son de la tarjeta y viven en ella (SDACCT_FILE en la raíz,
+   con CRC). Lo de esta sesión se suma al abrirla y se guarda cada
+   SDACCT_SAVE_S desde doHousekeeping y al apagar/dormir; lo que pase
+   antes de montar (errores de montaje) se le suma al abrir. */
+
+#ifndef SDACCT_FILE
+#define SDACCT_FILE "STORACCT.BIN"
+#endif
+#ifndef SDACCT_SAVE_S
+#define SDACCT_SAVE_S 600 // lo más que se pierde con un corte
+#endif
+#ifndef SDACCT_SECTOR
+#define SDACCT_SECTOR 512
+#endif
+
+typedef enum {
+  SDACCT_APPEND,   // segmento activo, CSV y log del sistema
+  SDACCT_PURGE,    // cabeza y reescritura de segmentos consumidos
+  SDACCT_COMPACT,  // compresión de sellados, compactado del log heredado
+  SDACCT_SANITIZE, // copias saneadas y trozos del uploader
+  SDACCT_CURSOR,   // cursores, manifiesto y esta contabilidad
+  SDACCT_REASONS
+} sdacct_reason_t;
+
+typedef struct {
+  uint64_t logical[SDACCT_REASONS];
+  uint64_t physical[SDACCT_REASONS];
+  uint32_t writes[SDACCT_REASONS]; // operaciones de escritura
+  uint32_t fsyncs;
+  uint32_t errors;  // escrituras, fsync o montajes que fallaron
+  uint32_t mounts;  // veces que se montó esta tarjeta
+  uint32_t card_id; // número de serie del CID
+  uint32_t since;   // epoch de la primera vez que se vio (0 = sin hora)
+} sdacct_totals_t;
+
+// Tras montar: carga los totales de 'mount'/SDACCT_FILE (o empieza de cero
+// si son de otra tarjeta) y les suma lo de esta sesión
+bool sdacct_open(const char *mount, uint32_t card_id);
+void sdacct_close(void); // guarda y deja de guardar (desmontaje)
+
+void sdacct_logical(sdacct_reason_t why, size_t n);
+// write() de 'n' bytes en el offset 'off' del fichero
+void sdacct_physical(sdacct_reason_t why, uint32_t off, size_t n);
+// Las dos cosas: escritura de datos nuevos (ficheros escritos enteros)
+void sdacct_write(sdacct_reason_t why, uint32_t off, size_t n);
+int sdacct_fsync(int fd); // fsync() contado (y su error)
+void sdacct_error(void);
+
+bool sdacct_save(bool force); // sin force: solo si pasó SDACCT_SAVE_S
+void sdacct_get(sdacct_totals_t *out);
+uint32_t sdacct_waf_x100(const sdacct_totals_t *t); // 0 = sin datos
+
+#endif
@@ -8,6 +8,8 @@
 #include <SPI.h>
 #include "esp_vfs_fat.h"
 #include "sdmmc_cmd.h"
+#include "sdsegment.h"
+#include "sdrtc.h"
 
 #define MOUNT_POINT "/sdcard"
 
@@ -54,27 +56,202 @@
 #ifndef SDCARD_MACLOG_BASENAME
 #define SDCARD_MACLOG_BASENAME "mac_events"
 #endif
-#ifndef SDJSON_QUEUE_LEN
-#define SDJSON_QUEUE_LEN 64
+#ifndef SDJSON_RING_SIZE
+#define SDJSON_RING_SIZE 8192 // anillo de registros para la writer (bytes)
 #endif
-#ifndef SDJSON_FLUSH_EVERY
-#define SDJSON_FLUSH_EVERY 10
+// El anillo es el escalón de RAM delante de la SD: en placas con PSRAM se
+// reserva allí y mucho más grande (si falla, el de SDJSON_RING_SIZE en el
+// heap interno). La writer no lo vacía con cada registro: espera a que pase
+// de STAGE_FLUSH_PCT o a que lo más antiguo cumpla el plazo, que se acorta
+// según se llena. Lo vaciado por plazo se escribe con fsync, así que un
+// registro no pasa más de STAGE_DEADLINE_MS sin llegar a la tarjeta. Las
+// peticiones síncronas, los sellados y el desbordamiento vacían en el acto.
+#ifndef SDJSON_STAGE_PSRAM_SIZE
+#define SDJSON_STAGE_PSRAM_SIZE (256UL * 1024UL) // potencia de 2
 #endif
+#ifndef SDJSON_STAGE_FLUSH_PCT
+#define SDJSON_STAGE_FLUSH_PCT 25 // < SDJSON_SAMPLE_PCT
+#endif
+#ifndef SDJSON_STAGE_DEADLINE_MS
+#define SDJSON_STAGE_DEADLINE_MS 2000 // 0 = vaciar con cada registro
+#endif
+#ifndef SDJSON_SPILL_SIZE
+#define SDJSON_SPILL_SIZE 2048 // desbordamiento solo para registros críticos
+#endif
+// Con el anillo por encima de SAMPLE_PCT solo 1 de cada SAMPLE_EVERY eventos
+// MAC se guarda tal cual; por encima de AGG_PCT ninguno. Los que no se
+// guardan se resumen en un registro {"t":<seg>,"agg":<n>} por segundo.
+#ifndef SDJSON_SAMPLE_PCT
+#define SDJSON_SAMPLE_PCT 50
+#endif
+#ifndef SDJSON_AGG_PCT
+#define SDJSON_AGG_PCT 85
+#endif
+#ifndef SDJSON_SAMPLE_EVERY
+#define SDJSON_SAMPLE_EVERY 4
+#endif
+// Eventos MAC seguidos idénticos salvo en "t" (un móvil sondeando en
+// ráfaga) se guardan una vez: el primero con "rep":<n> y "t_last":<t del
+// último> añadidos. La racha se corta al cerrar la línea o el segmento, con
+// otro registro y al pasar DEDUP_SPAN_S desde el primero. Mientras, el
+// primero espera en RAM, pero nunca más que STAGE_DEADLINE_MS desde que
+// entró en el anillo: llega a la tarjeta en el mismo plazo que el resto.
+// En el backlog la racha cuenta sus "rep" eventos.
+#ifndef SDJSON_DEDUP
+#define SDJSON_DEDUP 1
+#endif
+#ifndef SDJSON_DEDUP_SPAN_S
+#define SDJSON_DEDUP_SPAN_S 60
+#endif
+
+// Otros flujos de la writer, cada uno con su fichero, anillo y fsync
+#ifndef SDCARD_CSV
+#define SDCARD_CSV 0 // fichero <clientId>.csv con una fila por envío
+#endif
+#ifndef SDJSON_CSV_RING_SIZE
+#define SDJSON_CSV_RING_SIZE 1024
+#endif
+#ifndef SDJSON_CSV_SYNC_MS
+#define SDJSON_CSV_SYNC_MS 0 // una fila por ciclo: fsync cada vez
+#endif
+#ifndef SDJSON_SYSLOG_RING_SIZE
+#define SDJSON_SYSLOG_RING_SIZE 4096
+#endif
+#ifndef SDJSON_SYSLOG_SYNC_MS
+#define SDJSON_SYSLOG_SYNC_MS 5000
+#endif
+#ifndef SDJSON_SYSLOG_LINE_MAX
+#define SDJSON_SYSLOG_LINE_MAX 160 // lo que pase se recorta
+#endif
+
+typedef enum {
+  SDJSON_STREAM_CSV,    // sdcardWriteData()
+  SDJSON_STREAM_SYSLOG, // salida de ESP_LOGx (SDLOGGING)
+  SDJSON_STREAMS
+} sdjson_stream_t;
+
+typedef struct {
+  uint64_t bytes;  // escritos en su fichero
+  uint32_t syncs;  // fsync()
+  uint32_t drops;  // escrituras perdidas con su anillo lleno
+} sdjson_stream_stats_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// compat: desde libpax.cpp
+// compat: desde libpax.cpp (eventos MAC: se degradan si no hay sitio)
 void sdcard_append_jsonl(const char *line);
+// registros que nunca se degradan (recuentos {t,w}); usan el desbordamiento
+void sdcard_append_jsonl_critical(const char *line);
+
+// Posición en el log: segmento y offset (seq 0 = ninguno)
+typedef struct {
+  uint32_t seq;
+  uint32_t off;
+} sdjson_pos_t;
+
+// Líneas completas de un segmento: bytes [off, off + len) del fichero, en
+// su formato según 'flags' (los de su cabecera al leerlo: NDJSON, frames o
+// packs; ver sdseg_read_hdr / sdrec_reader). Si el segmento está cifrado
+// hay que leerlo con sdseg_fopen(). 'lines' = 0 solo en la cola ilegible de
+// un sellado.
+typedef struct {
+  uint32_t seq;
+  uint32_t off;
+  uint32_t len;
+  uint32_t lines;
+  uint32_t flags;
+} sdjson_span_t;
+
+// Segmentos que mira cada llamada a sdjson_read_spans (en la pila)
+#ifndef SDJSON_SPAN_SEGS
+#define SDJSON_SPAN_SEGS 32
+#endif
+
+// Lector sin copias para el uploader: rellena 'spans' (uno por segmento)
+// desde 'from' (seq 0 = el más antiguo) hasta max_lines / max_bytes de
+// fichero y deja 'from' tras el último. 'buf' (>= SDREC_FRAME_MAX) es para
+// las lecturas en bloque. No para la writer: del activo solo se devuelve
+// hasta su final estable. Un sellado puede comprimirse después (cambian los
+// offsets) salvo que se fije con sdseg_pin().
+size_t sdjson_read_spans(sdjson_pos_t *from,
+                         size_t max_lines,
+                         size_t max_bytes,
+                         uint8_t *buf, size_t buf_size,
+                         sdjson_span_t *spans, size_t max_spans);
+
+// Acuse de lo enviado: consume 'seq' hasta 'off' (fin de un span). Con el
+// segmento activo espera a la writer como mucho 'timeout_ms'.
+bool sdjson_consume(uint32_t seq, uint32_t off, uint32_t timeout_ms);
+
+// cierra la línea y espera a que esté en la tarjeta; 'pos' puede ser NULL
+void sdcard_newline(void);
+bool sdcard_newline_sync(uint32_t timeout_ms);
+bool sdcard_newline_sync_at(uint32_t timeout_ms, sdjson_pos_t *pos);
 
-// batch helpers para wifi_post.cpp
-bool sdjson_read_batch(String &outEventsArray,
-                       size_t max_lines,
-                       size_t max_bytes,
-                       size_t &out_lines_read);
+// sella el segmento activo y espera a la writer (para el uploader)
+bool sdjson_rotate_sync(uint32_t timeout_ms);
 
-bool sdjson_delete_first_lines(size_t n);
+// Antes de deep sleep / esp_restart(): no admite más registros, vacía la
+// writer y sella con fsync. false (y un aviso con lo perdido) si se agota
+// el tiempo.
+#ifndef SDJSON_SHUTDOWN_MS
+#define SDJSON_SHUTDOWN_MS 3000
+#endif
+bool sdjson_shutdown(uint32_t budget_ms);
+
+// Instrumentación de la writer. Histogramas log2 en µs: el cubo b cuenta
+// duraciones en [2^(b-1), 2^b) (b = 0: < 1 µs); el último acumula el resto.
+#define SDJSON_LAT_BUCKETS 20
+typedef enum {
+  SDJSON_LAT_APPEND,  // codificar + añadir al frame (y commit si toca)
+  SDJSON_LAT_NEWLINE, // fin de línea (+ fsync si era síncrono)
+  SDJSON_LAT_ROTATE,  // sellado del segmento
+  SDJSON_LAT_PURGE,   // retención
+  SDJSON_LAT_COMMIT,  // commit + fsync por intervalo
+  SDJSON_LAT_OPS
+} sdjson_lat_op_t;
+
+typedef struct {
+  uint32_t drops_task; // registros perdidos con el anillo lleno (tareas)
+  uint32_t drops_isr;  // idem desde ISR
+  uint32_t degraded;       // eventos MAC resumidos en vez de guardados
+  uint32_t summaries;      // registros {"t","agg"} encolados
+  uint32_t lost_bulk;      // eventos MAC perdidos del todo
+  uint32_t spilled;        // registros críticos que fueron al desbordamiento
+  uint32_t lost_critical;  // críticos perdidos (desbordamiento lleno)
+  uint32_t events;         // eventos MAC que llegaron a la writer
+  uint32_t collapsed;      // de ellos, repeticiones absorbidas en otro
+  uint32_t ring_hwm;   // máximo de bytes ocupados en el anillo
+  uint32_t ring_size;
+  bool ring_psram;     // el anillo está en PSRAM
+  uint8_t mount_state;      // sdcard_mount_state_t
+  uint32_t mount_ms;        // arranque -> tarjeta montada
+  uint32_t first_event_ms;  // arranque -> primer evento del sniffer
+  uint32_t premount_events; // eventos guardados en RAM antes de montar
+  uint32_t stage_fill;     // vaciados del anillo por llenado (o urgentes)
+  uint32_t stage_deadline; // vaciados por plazo (con fsync)
+  uint64_t bytes_in;   // bytes JSON aceptados por la writer
+  uint64_t bytes_card; // bytes de datos escritos en la tarjeta
+  uint32_t lat[SDJSON_LAT_OPS][SDJSON_LAT_BUCKETS];
+  uint32_t lat_max_us[SDJSON_LAT_OPS];
+  sdjson_stream_stats_t streams[SDJSON_STREAMS];
+} sdjson_stats_t;
+
+void sdjson_get_stats(sdjson_stats_t *out);
+
+// Lo pendiente de enviar, en O(1): contadores que la writer mantiene al
+// escribir (cabeceras de segmento, manifiesto y trozos de flash). Para el
+// uploader, la purga, la pantalla y doHousekeeping; no lee la tarjeta.
+typedef struct {
+  sdseg_backlog_t seg; // segmentos sellados + activo
+  uint32_t flash_chunks;
+  uint32_t flash_lines;
+  uint32_t flash_bytes;
+} sdjson_backlog_t;
+void sdjson_get_backlog(sdjson_backlog_t *out);
+void sdjson_log_stats(void); // resumen para doHousekeeping (incluye B/s)
 
 #ifdef __cplusplus
 }
@@ -82,7 +259,36 @@ bool sdjson_delete_first_lines(size_t n);
 
 // API clásica
 bool sdcard_init(bool create = true);
-void sdcard_flush(void);
+
+// Montaje en segundo plano para no retrasar el arranque: los eventos MAC
+// se guardan en el anillo mientras tanto y la writer se engancha al montar.
+// Pasado el timeout se pasa a la flash (la tarjeta se usa si monta luego).
+// Sin tarjeta los eventos van a la flash interna (sdflash.h) y el montaje
+// se reintenta cada SDCARD_REMOUNT_MS (0 = nunca); al montar, lo de la
+// flash pasa a la SD.
+#ifndef SDCARD_MOUNT_TIMEOUT_MS
+#define SDCARD_MOUNT_TIMEOUT_MS 5000
+#endif
+#ifndef SDCARD_REMOUNT_MS
+#define SDCARD_REMOUNT_MS 60000
+#endif
+typedef enum {
+  SDCARD_MOUNT_IDLE,
+  SDCARD_MOUNTING,
+  SDCARD_MOUNTED,
+  SDCARD_MOUNT_FAILED,
+  SDCARD_MOUNT_TIMEOUT,
+  SDCARD_MOUNT_DEFERRED, // despertar de SLEEPCYCLE: se monta solo si hace falta
+} sdcard_mount_state_t;
+bool sdcard_init_async(uint32_t timeout_ms = SDCARD_MOUNT_TIMEOUT_MS);
+sdcard_mount_state_t sdcard_mount_state(void);
+// Arranca el montaje aplazado y espera como mucho 'wait_ms' a que acabe;
+// true si la tarjeta está montada
+bool sdcard_mount_now(uint32_t wait_ms);
+// Recuentos del anillo RTC (sdrtc.h) a la writer como líneas {t,w}
+size_t sdjson_flush_rtc(void);
+void sdcard_flush(void); // lo hace la writer: no espera a la tarjeta
+bool sdcard_flush_sync(uint32_t timeout_ms); // y espera a que esté hecho
 void sdcard_close(void);
 void sdcardWriteData(uint16_t, uint16_t, uint16_t = 0);
 
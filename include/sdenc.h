@@ -0,0 +1,46 @@
+#ifndef _SDENC_H
+#define _SDENC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Cifrado en reposo de los segmentos: AES-256 en modo CTR con el offset
+   del fichero como contador (bloque = off / 16). Como cada byte se cifra
+   según su posición, se puede escribir por commits sueltos, reescribir el
+   sector final y leer desde cualquier offset sin tocar nada más; la
+   cabecera del segmento queda en claro.
+
+   La clave es distinta por placa: HMAC-SHA256(SDENC_SECRET, "PXSG" + MAC
+   de eFuse). Sin SDENC_SECRET no se cifra lo nuevo (ni se puede leer lo
+   cifrado). En el ESP32 mbedtls usa el motor AES por hardware.
+
+   Cada fichero nuevo lleva su propio nonce aleatorio (SDENC_IV_LEN bytes):
+   un mismo offset nunca se cifra con el mismo flujo para datos distintos,
+   salvo la cola cortada que se pisa al sellar tras un reset. No hay MAC:
+   la integridad la siguen dando los CRC de los frames. */
+
+#define SDENC_IV_LEN 8
+
+typedef struct {
+  uint64_t bytes;  // bytes cifrados/descifrados
+  uint64_t cpu_us; // tiempo en AES
+} sdenc_stats_t;
+
+bool sdenc_init(void);  // deriva la clave de la placa (una vez)
+bool sdenc_ready(void); // hay clave: se cifra lo nuevo
+uint32_t sdenc_key_id(void); // comprobación de clave (0 = sin clave)
+void sdenc_new_iv(uint8_t iv[SDENC_IV_LEN]);
+
+// Cifra/descifra en el sitio 'n' bytes que están en 'off' del fichero
+void sdenc_xor(const uint8_t iv[SDENC_IV_LEN], uint32_t off, uint8_t *buf,
+               size_t n);
+
+// Abre 'path' para leer descifrando a partir de 'plain' (lo anterior, la
+// cabecera, sale tal cual). Admite fseek/ftell; no se puede escribir.
+FILE *sdenc_fopen(const char *path, const uint8_t iv[SDENC_IV_LEN],
+                  uint32_t plain);
+
+void sdenc_get_stats(sdenc_stats_t *out);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef _SDFLASH_H
+#define _SDFLASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Segundo nivel de almacenamiento en la flash interna (LittleFS sobre la
+   partición de datos) para cuando la SD no está o no monta:
+   /flash/flog/00000001.FLG, 00000002.FLG, ...
+   Cada trozo es NDJSON como el log heredado ("obj,obj,...\n" por línea) y
+   solo se cierra en fin de línea, así que el uploader lo puede mandar tal
+   cual con post_chunk() y la writer lo vuelca a la SD cuando aparece.
+
+   Cuidado con el desgaste: los trozos solo crecen por el final y nunca se
+   reescriben; las escrituras se agrupan en RAM (SDFLASH_BUF_SIZE o
+   SDFLASH_SYNC_MS) y el anillo da la vuelta borrando el trozo más antiguo
+   entero. Se usa como mucho SDFLASH_MAX_BYTES y nunca más de 3/4 de la
+   partición, para que LittleFS tenga bloques libres que rotar. */
+
+#ifndef SDFLASH_PARTITION
+#define SDFLASH_PARTITION "spiffs" // etiqueta en min_spiffs.csv
+#endif
+#ifndef SDFLASH_MOUNT
+#define SDFLASH_MOUNT "/flash"
+#endif
+#ifndef SDFLASH_MAX_BYTES
+#define SDFLASH_MAX_BYTES (96UL * 1024UL)
+#endif
+#ifndef SDFLASH_CHUNK_BYTES
+#define SDFLASH_CHUNK_BYTES (8UL * 1024UL) // se cierra al pasar de aquí
+#endif
+#ifndef SDFLASH_BUF_SIZE
+#define SDFLASH_BUF_SIZE 2048 // escritura agrupada (múltiplo de página)
+#endif
+#ifndef SDFLASH_SYNC_MS
+#define SDFLASH_SYNC_MS 30000 // lo más que espera un dato en RAM
+#endif
+// Líneas y bytes de cada trozo en RAM (se cuentan al escribir; al arrancar
+// se leen los trozos una vez). También limita los trozos en la flash.
+#ifndef SDFLASH_MAX_CHUNKS
+#define SDFLASH_MAX_CHUNKS 64
+#endif
+
+typedef struct {
+  uint32_t bytes;    // bytes escritos en la flash
+  uint32_t syncs;    // fsync()
+  uint32_t wrapped;  // trozos borrados al dar la vuelta (datos perdidos)
+  uint32_t lost;     // bytes descartados (líneas enteras; trozo más antiguo fijado)
+  uint32_t migrated; // trozos volcados a la SD
+  uint32_t sent;     // trozos enviados directamente por el uploader
+  uint32_t used;     // bytes ocupados ahora
+  uint32_t cap;
+  uint32_t chunks;   // trozos en la flash (abierto incluido)
+  uint32_t lines;    // líneas en la flash
+} sdflash_stats_t;
+
+bool sdflash_init(void); // monta LittleFS y recupera los trozos
+bool sdflash_ready(void);
+
+// Escritura (solo la tarea writer)
+bool sdflash_append(const char *obj, size_t len);
+void sdflash_end_line(void);
+void sdflash_sync(bool force);  // sin force: solo si venció SDFLASH_SYNC_MS
+uint32_t sdflash_due_ms(void);  // UINT32_MAX = nada en RAM
+void sdflash_seal(void);        // cierra el trozo abierto
+
+// Lectura / consumo (uploader y migración a la SD)
+bool sdflash_pending(void);           // hay trozos (abierto incluido)
+bool sdflash_oldest(uint32_t *id);    // trozo cerrado más antiguo
+void sdflash_path(uint32_t id, char *out, size_t n);
+bool sdflash_remove(uint32_t id, bool migrated);
+// Líneas y bytes JSON (sin los '\n') de un trozo, sin leerlo
+bool sdflash_chunk_stats(uint32_t id, uint32_t *lines, uint32_t *bytes);
+void sdflash_pin(uint32_t id);        // 0 = ninguno; no se borra al dar la vuelta
+void sdflash_get_stats(sdflash_stats_t *out);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _SDLZ_H
+#define _SDLZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Compresor LZ77 en streaming con ventana pequeña para los segmentos
+   sellados. La salida es DEFLATE (RFC 1951) con bloques de Huffman fijo:
+   un trozo comprimido se puede enviar tal cual dentro de un gzip
+   (RFC 1952) con Content-Encoding: gzip. Como el compresor nunca
+   referencia más de SDLZ_WINDOW bytes hacia atrás, el descompresor de aquí
+   tampoco necesita más ventana.
+
+   Cada "pack" es independiente: empieza sin historia y acaba con un bloque
+   stored vacío (sync flush), alineado a byte y sin BFINAL, así que se puede
+   encadenar con otros bloques dentro de un mismo gzip.
+
+   RAM: compresor ~10 KB (ventana doble + hash + cadenas), descompresor
+   ~2 KB (ventana). */
+
+#ifndef SDLZ_WINDOW
+#define SDLZ_WINDOW 2048 // potencia de 2, <= 32 KB
+#endif
+#ifndef SDLZ_HASH_BITS
+#define SDLZ_HASH_BITS 10
+#endif
+#ifndef SDLZ_CHAIN
+#define SDLZ_CHAIN 8 // candidatos máximos por posición
+#endif
+#define SDLZ_MIN_MATCH 3
+#define SDLZ_MAX_MATCH 258
+
+#define SDLZ_GZIP_HDR 10    // cabecera gzip mínima
+#define SDLZ_GZIP_TRAILER 8 // crc32 + isize
+#define SDLZ_STORED_HDR 5   // cabecera de bloque stored (alineado a byte)
+
+// Salida del compresor / entrada del descompresor
+typedef bool (*sdlz_write_fn)(void *ctx, const uint8_t *p, size_t n);
+typedef int (*sdlz_read_fn)(void *ctx); // siguiente byte o -1
+
+typedef struct {
+  uint8_t win[2 * SDLZ_WINDOW];
+  uint16_t head[1 << SDLZ_HASH_BITS]; // posición + 1 (0 = vacío)
+  uint16_t prev[SDLZ_WINDOW];
+  uint32_t fill;  // bytes válidos en win
+  uint32_t pos;   // siguiente byte a codificar
+  uint32_t bits;  // acumulador de bits (LSB primero)
+  uint8_t nbits;
+  bool in_pack;
+  bool error;
+  uint8_t out[256];
+  size_t olen;
+  sdlz_write_fn write;
+  void *ctx;
+  // Del pack en curso (o del último cerrado)
+  uint32_t in_len;
+  uint32_t out_len;
+  uint32_t crc; // crc32 gzip de la entrada
+} sdlz_enc_t;
+
+void sdlz_enc_init(sdlz_enc_t *e, sdlz_write_fn write, void *ctx);
+bool sdlz_enc_write(sdlz_enc_t *e, const void *data, size_t n);
+// Codifica lo pendiente, cierra el pack (sync flush) y olvida la historia.
+// in_len/out_len/crc quedan con los valores del pack hasta el siguiente write.
+bool sdlz_enc_end_pack(sdlz_enc_t *e);
+
+typedef struct {
+  uint8_t win[SDLZ_WINDOW];
+  uint32_t total; // bytes producidos en el pack
+  uint32_t bits;
+  uint8_t nbits;
+  uint8_t state;
+  bool final;
+  uint16_t stored_left;
+  uint16_t copy_len, copy_dist;
+  sdlz_read_fn read;
+  void *ctx;
+} sdlz_dec_t;
+
+void sdlz_dec_init(sdlz_dec_t *d, sdlz_read_fn read, void *ctx);
+// Devuelve bytes descomprimidos (> 0), 0 al acabar el pack o -1 si el
+// flujo no es válido (o usa Huffman dinámico, que aquí no se genera).
+int sdlz_dec_read(sdlz_dec_t *d, uint8_t *out, size_t cap);
+
+// Envoltorio gzip para mandar un pack con Content-Encoding: gzip
+size_t sdlz_gzip_header(uint8_t *out);
+size_t sdlz_stored_hdr(uint8_t *out, uint16_t len, bool final);
+size_t sdlz_gzip_trailer(uint8_t *out, uint32_t crc, uint32_t isize);
+// crc32 de A||B a partir de crc(A), crc(B) y len(B) (como zlib)
+uint32_t sdlz_crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _SDRECORD_H
+#define _SDRECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Formato binario de los eventos en los segmentos (SDSEG_VERSION >= 2).
+   Cada objeto JSON se guarda como un registro con longitud prefijada:
+
+     0x0A                      fin de línea (equivale al '\n' del NDJSON)
+     0x01 <varint len> <campos> objeto plano codificado
+     0x02 <varint len> <texto>  objeto JSON tal cual (lo que no sabemos codificar)
+
+   Campos: un byte (tipo << 4 | clave) seguido del valor. La clave es un
+   índice en una tabla local a la línea; 0x0F introduce una clave nueva
+   (u8 len + bytes) que se añade a la tabla. "t" se guarda como delta zigzag
+   respecto al anterior "t" de la línea. La tabla y el delta se reinician en
+   cada fin de línea, así que se puede empezar a leer en cualquier línea.
+
+   El decodificador reproduce byte a byte el texto original: el codificador
+   solo acepta JSON compacto (sin espacios) y si no, usa el registro crudo.
+
+   Desde SDSEG_VERSION 3 los registros van agrupados en frames:
+
+     0xA5 <u16 len|flags> <len bytes de registros> <crc32>
+
+   El CRC cubre len y los registros; su valor inicial ('seed') es la sal
+   del segmento (versión 4), así un frame viejo de otro fichero nunca
+   valida. Un frame se cierra en cada fin de línea (que siempre es su
+   último registro), al llegar a ~1 sector o en cada commit; un registro
+   nunca se parte entre frames. Con el CRC, el
+   arranque solo mira la cola del segmento para saber dónde cortar. */
+
+#define SDREC_EOL 0x0A
+#define SDREC_OBJ 0x01
+#define SDREC_RAW 0x02
+
+#define SDREC_MAX_KEYS 15  // índices 0..14, 15 = clave nueva
+#define SDREC_KEY_MAX 31
+#define SDREC_PAYLOAD_MAX 1024 // = SDJSON_REC_MAXLEN
+#define SDREC_REC_MAX (SDREC_PAYLOAD_MAX + 4)
+#define SDREC_JSON_MAX (SDREC_PAYLOAD_MAX + 1)
+
+#define SDREC_SYNC 0xA5
+#define SDREC_FRAME_HDR 3                     // sync + u16
+#define SDREC_FRAME_OVH (SDREC_FRAME_HDR + 4) // + crc32
+#define SDREC_FRAME_LEN_MASK 0x3FFF
+#define SDREC_FRAME_LINE_START 0x8000 // el frame empieza línea
+#define SDREC_FRAME_LINE_END 0x4000   // el frame acaba en fin de línea
+// Tamaño habitual (un sector); un registro grande puede ir solo hasta
+// SDREC_REC_MAX
+#define SDREC_FRAME_TARGET (512 - SDREC_FRAME_OVH)
+#define SDREC_FRAME_MAX (SDREC_REC_MAX + SDREC_FRAME_OVH)
+
+uint32_t sdrec_crc32(uint32_t crc, const uint8_t *p, size_t n);
+
+// 'frame' tiene los registros en frame[SDREC_FRAME_HDR..]; rellena cabecera
+// y CRC. Devuelve el tamaño total del frame.
+size_t sdrec_frame_seal(uint8_t *frame, size_t payload_len, uint16_t flags,
+                        uint32_t seed);
+
+// Valida un frame completo en p[0..avail). Devuelve su tamaño total o 0.
+size_t sdrec_frame_check(const uint8_t *p, size_t avail, uint16_t *flags,
+                         uint32_t seed);
+
+// Eventos en los registros recs[0..len) de un frame: cada objeto cuenta 1,
+// o <n> si lleva "rep":<n> (racha colapsada por la writer). 'ev' sigue qué
+// índice tiene la clave "rep" en la línea y vuelve a cero en cada fin de
+// línea; empezando a media línea, una "rep" ya vista antes cuenta 1.
+typedef struct {
+  uint8_t nkeys;
+  int8_t rep_key; // -1 = aún no ha salido
+} sdrec_evscan_t;
+
+void sdrec_evscan_reset(sdrec_evscan_t *ev);
+size_t sdrec_count_events(sdrec_evscan_t *ev, const uint8_t *recs, size_t len);
+
+// Lo mismo para un objeto JSON en texto: <n> si tiene "rep":<n>, si no 1
+uint32_t sdrec_json_events(const char *json, size_t len);
+
+// Busca hacia atrás en buf[0..n) el último frame válido. Devuelve el offset
+// de su final (0 si no hay ninguno) y sus flags.
+size_t sdrec_find_tail(const uint8_t *buf, size_t n, uint16_t *flags,
+                       uint32_t seed);
+
+// Estado compartido por codificador y decodificador dentro de una línea
+typedef struct {
+  char keys[SDREC_MAX_KEYS][SDREC_KEY_MAX + 1];
+  uint8_t klen[SDREC_MAX_KEYS];
+  uint8_t nkeys;
+  uint64_t last_t;
+} sdrec_ctx_t;
+
+void sdrec_ctx_reset(sdrec_ctx_t *ctx);
+
+// Codifica un objeto JSON en 'out' (registro completo). Devuelve los bytes
+// escritos o 0 si no cabe. 'out' debe tener al menos SDREC_REC_MAX bytes.
+size_t sdrec_encode(sdrec_ctx_t *ctx, const char *json, size_t len,
+                    uint8_t *out, size_t cap);
+
+// Lector secuencial de registros de un fichero (un segmento)
+typedef struct {
+  FILE *f;
+  bool framed;       // frames con CRC (versión >= 3) o registros sueltos (2)
+  uint32_t seed;     // valor inicial del CRC de los frames
+  uint32_t pos;      // offset del frame con el siguiente registro
+  uint32_t end;      // no se lee más allá (0 = hasta EOF)
+  uint32_t next_pos; // offset tras el frame cargado
+  uint32_t skipped;  // bytes descartados por frames corruptos
+  sdrec_ctx_t ctx;
+  uint8_t rec[SDREC_REC_MAX]; // registros del frame cargado
+  size_t rec_len, rec_off;
+  char json[SDREC_JSON_MAX]; // último objeto decodificado
+  size_t json_len;
+} sdrec_reader_t;
+
+enum {
+  SDREC_R_BAD = -1, // registro/frame truncado en 'pos' (cola cortada)
+  SDREC_R_END = 0,  // fin de datos
+  SDREC_R_LINE = 1, // fin de línea
+  SDREC_R_JSON = 2, // objeto en r->json / r->json_len
+};
+
+bool sdrec_reader_init(sdrec_reader_t *r, FILE *f, uint32_t start,
+                       uint32_t end, bool framed, uint32_t seed);
+int sdrec_next(sdrec_reader_t *r);
+
+#endif
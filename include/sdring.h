@@ -0,0 +1,41 @@
+#ifndef _SDRING_H
+#define _SDRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+
+/* Anillo de bytes con registros de longitud variable para la writer SD.
+   - Consumidor único (la tarea writer) sin bloqueos: lee en sitio y libera.
+   - Productores (tareas o ISR) serializados por un spinlock muy corto: solo
+     reservan hueco y copian su payload, nunca esperan a la SD.
+   Cada registro ocupa align4(4 + len) bytes; si no cabe al final del buffer
+   se deja un relleno y se continúa desde el principio. */
+
+typedef struct {
+  uint8_t *buf;
+  uint32_t size;          // potencia de 2
+  volatile uint32_t head; // escribe el productor (monótono)
+  volatile uint32_t tail; // escribe el consumidor (monótono)
+  portMUX_TYPE lock;      // serializa productores
+  uint32_t hwm;           // máximo de bytes ocupados visto (bajo 'lock')
+} sdring_t;
+
+typedef struct {
+  uint8_t op;
+  uint16_t len;
+  const uint8_t *data; // apunta dentro del anillo hasta sdring_pop()
+  uint32_t span;       // bytes que libera sdring_pop()
+} sdring_rec_t;
+
+#define SDRING_HDR_SIZE 4
+#define SDRING_MAX_PAYLOAD 0xFFFEu
+
+bool sdring_init(sdring_t *r, uint8_t *buf, uint32_t size);
+bool sdring_push(sdring_t *r, uint8_t op, const void *data, size_t len);
+bool sdring_peek(sdring_t *r, sdring_rec_t *out);
+void sdring_pop(sdring_t *r, const sdring_rec_t *rec);
+uint32_t sdring_used(const sdring_t *r);
+
+#endif
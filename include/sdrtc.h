@@ -0,0 +1,54 @@
+#ifndef _SDRTC_H
+#define _SDRTC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Anillo de recuentos {t,w} en la memoria lenta del RTC para SLEEPCYCLE.
+   Con ciclos de sueño profundo cada despertar montaba la SD para escribir
+   una sola línea: aquí los recuentos se acumulan entre despertares y solo
+   se vuelcan a la SD cada SDRTC_FLUSH_CYCLES sueños o al pasar de
+   SDRTC_FULL_PCT. Mientras no toca, el montaje se aplaza (ver
+   sdcard_init_async) y la tarjeta solo se enciende si hay otra cosa que
+   escribir o que enviar.
+
+   Va en RTC_NOINIT_ATTR con magic y CRC: sobrevive al sueño y también a
+   esp_restart(); tras un corte de corriente el CRC no cuadra y se empieza
+   de cero. */
+
+#ifndef SDRTC_SLOTS
+#define SDRTC_SLOTS 128 // 8 B cada uno: 1 KB de los 8 KB de RTC lenta
+#endif
+#ifndef SDRTC_FLUSH_CYCLES
+#define SDRTC_FLUSH_CYCLES 12 // sueños entre volcados a la SD
+#endif
+#ifndef SDRTC_FULL_PCT
+#define SDRTC_FULL_PCT 75 // se vuelca antes si pasa de aquí
+#endif
+
+typedef struct {
+  uint32_t t; // epoch del envío
+  uint32_t w; // recuento WiFi
+} sdrtc_rec_t;
+
+typedef struct {
+  uint32_t used;    // recuentos en el anillo
+  uint32_t cycles;  // sueños desde el último volcado
+  uint32_t kept;    // recuentos guardados en RTC (total)
+  uint32_t flushed; // recuentos pasados a la SD
+  uint32_t flushes;
+  uint32_t lost;    // pisados con el anillo lleno
+} sdrtc_stats_t;
+
+void sdrtc_boot(void);   // valida el anillo tras el arranque
+bool sdrtc_defer(void);  // despertar de un ciclo sin volcado pendiente
+void sdrtc_sleep(bool armed); // antes de esp_deep_sleep_start()
+
+bool sdrtc_push(uint32_t t, uint32_t w); // false: pisó el más antiguo
+bool sdrtc_due(void);
+size_t sdrtc_pending(void);
+bool sdrtc_peek(sdrtc_rec_t *out); // el más antiguo
+void sdrtc_pop(void);
+void sdrtc_get_stats(sdrtc_stats_t *out);
+
+#endif
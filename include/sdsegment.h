@@ -0,0 +1,275 @@
+#ifndef _SDSEGMENT_H
+#define _SDSEGMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Log de eventos MAC segmentado por tiempo y particionado por día UTC:
+   /sdcard/maclog/20250314/0A660001.SEG, 0A660002.SEG, ...
+   Cada segmento empieza con una cabecera fija (sdseg_hdr_t) seguida de los
+   eventos (registros binarios de sdrecord.h; NDJSON en los de versión 1). La retención borra segmentos enteros (unlink), nunca
+   reescribe el log vivo.
+
+   El número de segmento lleva el día en los bits altos, así que la carpeta
+   sale del número sin leer nada. /sdcard/maclog/MANIFEST resume cada
+   partición (líneas, bytes, rango de tiempo y estado de envío): el uploader
+   y la purga trabajan sobre particiones enteras sin recorrer directorios. */
+
+#ifndef SDSEG_DIR
+#define SDSEG_DIR "maclog"
+#endif
+// Rutas: raíz ("/sdcard/maclog", < SDSEG_ROOT_MAX) + "/YYYYMMDD" +
+// "/0000002A.SEG". Cualquier buffer de ruta de segmento es SDSEG_PATH_MAX.
+#ifndef SDSEG_ROOT_MAX
+#define SDSEG_ROOT_MAX 48
+#endif
+#define SDSEG_DIR_MAX (SDSEG_ROOT_MAX + 9)  // carpeta de día
+#define SDSEG_PATH_MAX (SDSEG_DIR_MAX + 13) // fichero 8.3 de la carpeta
+
+#ifndef SDSEG_SPAN_SEC
+#define SDSEG_SPAN_SEC 3600 // duración de un segmento (1 por hora)
+#endif
+#ifndef SDSEG_MAX_BYTES
+#define SDSEG_MAX_BYTES (4UL * 1024UL * 1024UL) // rota antes si crece más
+#endif
+
+// Escritura por bloques alineados a sector (group commit)
+#ifndef SDSEG_SECTOR
+#define SDSEG_SECTOR 512
+#endif
+#ifndef SDSEG_WBUF_SIZE
+#define SDSEG_WBUF_SIZE 4096 // múltiplo de SDSEG_SECTOR
+#endif
+
+// Cuándo se hace commit + fsync (además de al llenarse el buffer)
+typedef enum {
+  SDSEG_DUR_RECORD,   // tras cada registro
+  SDSEG_DUR_LINE,     // al cerrar cada línea
+  SDSEG_DUR_INTERVAL, // como mucho SDSEG_COMMIT_INTERVAL_MS tras el primer dato
+  SDSEG_DUR_SEAL,     // solo al sellar el segmento
+} sdseg_durability_t;
+
+#ifndef SDSEG_DURABILITY_DEFAULT
+#define SDSEG_DURABILITY_DEFAULT SDSEG_DUR_INTERVAL
+#endif
+#ifndef SDSEG_COMMIT_INTERVAL_MS
+#define SDSEG_COMMIT_INTERVAL_MS 1000
+#endif
+
+typedef struct {
+  uint32_t commits;    // write() del buffer
+  uint32_t syncs;      // fsync()
+  uint64_t bytes;      // bytes nuevos de datos escritos
+  uint64_t phys_bytes; // bytes escritos incluyendo sectores reescritos
+} sdseg_commit_stats_t;
+
+#define SDSEG_MAGIC 0x47535850UL // "PXSG"
+// 1 = NDJSON texto, 2 = registros binarios, 3 = registros en frames con CRC,
+// 4 = frames con CRC salado y fichero preasignado
+#define SDSEG_VERSION 4
+#define SDSEG_HDR_SIZE 64
+
+#define SDSEG_FLAG_SEALED 0x0001
+#define SDSEG_FLAG_MIDLINE 0x0002 // al escribir la cabecera había una línea abierta
+#define SDSEG_FLAG_LZ 0x0004      // datos = packs comprimidos (ver sdlz.h)
+#define SDSEG_FLAG_ENC 0x0008     // datos cifrados con AES-CTR (ver sdenc.h)
+
+// Segmento comprimido: tras la cabecera van packs independientes, cada uno
+// con su cabecera y un flujo DEFLATE del texto "obj,obj,..." (lo que va
+// entre corchetes en el POST) de varias líneas completas.
+#ifndef SDSEG_COMPRESS
+#define SDSEG_COMPRESS 1 // comprimir los segmentos al sellarlos
+#endif
+#ifndef SDSEG_LZ_POLL_MS
+#define SDSEG_LZ_POLL_MS (10UL * 60UL * 1000UL) // reintento sin avisos
+#endif
+#ifndef SDSEG_LZ_PACK_BYTES
+#define SDSEG_LZ_PACK_BYTES (16UL * 1024UL) // JSON por pack (= por POST)
+#endif
+#define SDSEG_PACK_MAGIC 0x4B50585AUL // "ZXPK"
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint32_t comp_len; // bytes DEFLATE tras esta cabecera
+  uint32_t json_len; // bytes de texto descomprimido
+  uint32_t objs;     // eventos (ver sdrec_count_events)
+  uint32_t lines;
+  uint32_t crc;      // crc32 (gzip) del texto
+} sdseg_pack_t;
+
+typedef struct {
+  uint32_t segments;
+  uint64_t raw_bytes;  // datos binarios de los segmentos originales
+  uint64_t json_bytes; // texto JSON equivalente
+  uint64_t comp_bytes; // packs resultantes (con cabeceras)
+  uint64_t cpu_us;     // tiempo de compresión
+} sdseg_lz_stats_t;
+
+// El activo se preasigna por extensiones para no asignar clusters en cada
+// escritura; al sellar se recorta al final lógico (data_len)
+#ifndef SDSEG_PREALLOC_BYTES
+#define SDSEG_PREALLOC_BYTES (1024UL * 1024UL)
+#endif
+
+// Consumo por cabeza: borrar las primeras líneas solo avanza head_off en la
+// cabecera. El segmento se reescribe desde la cabeza cuando esta pasa de
+// este porcentaje de los datos (y se borra entero al consumirlo del todo).
+#ifndef SDSEG_RECLAIM_PCT
+#define SDSEG_RECLAIM_PCT 50
+#endif
+#ifndef SDSEG_LIST_MAX
+#define SDSEG_LIST_MAX 64 // segmentos por llamada a sdseg_list (en la pila)
+#endif
+#define SDSEG_SCAN_BUF 2048 // buffer de sdseg_scan_lines (>= SDREC_FRAME_MAX)
+
+// Particiones: seq = (día UTC desde 1970 << SDSEG_DAY_SHIFT) | contador.
+// Los segmentos abiertos sin hora real van al día del último conocido
+// (o al 19700101 si nunca la hubo).
+#define SDSEG_DAY_SHIFT 17
+#ifndef SDSEG_PARTS_MAX
+#define SDSEG_PARTS_MAX 64 // particiones en el manifiesto (días)
+#endif
+
+typedef enum {
+  SDSEG_PART_PENDING, // nada enviado
+  SDSEG_PART_PARTIAL, // enviado en parte
+  SDSEG_PART_SENT,    // todo enviado (queda la entrada hasta la retención)
+} sdseg_part_state_t;
+
+typedef struct {
+  uint32_t day;      // días UTC desde 1970 (seq >> SDSEG_DAY_SHIFT)
+  uint32_t segments; // sellados en la carpeta
+  uint32_t lines;    // líneas sin consumir
+  uint32_t events;   // eventos sin consumir (sdseg_live_objs)
+  uint32_t bytes;    // tamaño en la tarjeta
+  uint32_t first_t;  // rango de "t" de los segmentos (0 = sin hora)
+  uint32_t last_t;
+  uint8_t state;     // sdseg_part_state_t
+} sdseg_part_t;
+
+// Totales del backlog (particiones + activo hasta su último fsync). Salen
+// de las cabeceras y del manifiesto, que la writer mantiene al escribir:
+// consultarlos no lee la tarjeta.
+typedef struct {
+  uint32_t segments; // sellados (el activo no cuenta)
+  uint32_t lines;
+  uint32_t events;
+  uint64_t bytes;
+  uint32_t first_t;  // 0 = sin hora real
+  uint32_t last_t;
+} sdseg_backlog_t;
+
+static inline uint32_t sdseg_seq_day(uint32_t seq) { return seq >> SDSEG_DAY_SHIFT; }
+
+// Epoch mínimo que consideramos "hora real" (2020-01-01)
+#define SDSEG_MIN_VALID_T 1577836800UL
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t hdr_size;
+  uint32_t seq;
+  uint32_t flags;
+  uint32_t first_t;  // primer "t" visto (0 = aún sin hora)
+  uint32_t last_t;   // último "t" visto
+  uint32_t lines;    // líneas cerradas (SDREC_EOL o '\n')
+  uint32_t data_len; // bytes de datos tras la cabecera (final lógico)
+  uint32_t salt;     // seed del CRC de los frames (versión >= 4)
+  uint32_t head_off;   // primera línea sin consumir (< HDR_SIZE = ninguna)
+  uint32_t head_lines; // líneas consumidas antes de head_off
+  uint32_t objs;       // eventos escritos, con los "rep" de las rachas
+                       // colapsadas (0 en segmentos anteriores)
+  uint32_t head_objs;  // eventos consumidos antes de head_off
+  uint8_t iv[8];       // nonce AES-CTR del fichero (SDSEG_FLAG_ENC)
+  uint32_t key_id;     // sdenc_key_id() con el que se cifró
+} sdseg_hdr_t;
+
+static inline bool sdseg_is_binary(const sdseg_hdr_t *h) { return h->version >= 2; }
+static inline bool sdseg_is_framed(const sdseg_hdr_t *h) { return h->version >= 3; }
+static inline uint32_t sdseg_crc_seed(const sdseg_hdr_t *h) { return h->version >= 4 ? h->salt : 0; }
+static inline bool sdseg_is_lz(const sdseg_hdr_t *h) { return (h->flags & SDSEG_FLAG_LZ) != 0; }
+static inline bool sdseg_is_enc(const sdseg_hdr_t *h) { return (h->flags & SDSEG_FLAG_ENC) != 0; }
+static inline uint32_t sdseg_data_start(const sdseg_hdr_t *h) {
+  return h->head_off > SDSEG_HDR_SIZE ? h->head_off : SDSEG_HDR_SIZE;
+}
+static inline uint32_t sdseg_live_lines(const sdseg_hdr_t *h) {
+  return h->lines > h->head_lines ? h->lines - h->head_lines : 0;
+}
+static inline uint32_t sdseg_live_objs(const sdseg_hdr_t *h) {
+  return h->objs > h->head_objs ? h->objs - h->head_objs : 0;
+}
+
+// Montaje / inventario
+bool sdseg_init(const char *mount_point);
+void sdseg_path(uint32_t seq, char *out, size_t n);
+void sdseg_idx_path(uint32_t seq, char *out, size_t n); // índice temporal
+size_t sdseg_list(uint32_t *seqs, size_t max); // ascendente, sin el activo
+bool sdseg_read_hdr(uint32_t seq, sdseg_hdr_t *hdr);
+// Para leer los datos: los cifrados se descifran al vuelo. NULL si no está
+// o si está cifrado con otra clave (ver sdseg_readable). 'hdr' puede ser NULL.
+FILE *sdseg_fopen(uint32_t seq, sdseg_hdr_t *hdr);
+bool sdseg_readable(const sdseg_hdr_t *hdr);
+bool sdseg_remove(uint32_t seq); // enviado/consumido
+
+// Manifiesto de particiones (ascendente por día)
+size_t sdseg_parts(sdseg_part_t *out, size_t max);
+void sdseg_backlog(sdseg_backlog_t *out); // O(1), desde cualquier tarea
+void sdseg_part_dir(uint32_t day, char *out, size_t n); // ".../maclog/YYYYMMDD"
+
+// Segmento activo (solo desde la tarea writer)
+bool sdseg_open_active(void);
+bool sdseg_active_pos(uint32_t *seq, uint32_t *off); // offset = fin de datos
+// Desde cualquier tarea: segmento activo y fin de su última línea ya en la
+// tarjeta (fsync). false si no hay activo.
+bool sdseg_stable_end(uint32_t *seq, uint32_t *end);
+bool sdseg_append(const char *data, size_t len);
+void sdseg_note_ts(uint32_t t);
+// Un objeto más en la línea, con su "t" y los eventos que resume ("rep")
+void sdseg_note_obj(uint32_t t, uint32_t events);
+void sdseg_end_line(void);
+void sdseg_flush_active(bool sync);
+bool sdseg_should_rotate(time_t now);
+bool sdseg_seal_active(void);
+
+// Durabilidad: la writer llama a commit_point tras cada registro y duerme
+// como mucho commit_due_ms antes de llamar a commit_tick.
+void sdseg_set_durability(sdseg_durability_t d, uint32_t interval_ms);
+void sdseg_commit_point(bool line_end);
+uint32_t sdseg_commit_due_ms(void); // UINT32_MAX = nada pendiente
+void sdseg_commit_tick(void);
+void sdseg_get_commit_stats(sdseg_commit_stats_t *out);
+
+// Retención y consumo por cabeza. La purga borra carpetas de día enteras;
+// solo mira segmento a segmento la partición que cruza 'cutoff', y del
+// segmento que lo cruza consume la cabeza anterior (índice .IDX).
+size_t sdseg_purge_older_than(time_t cutoff);
+// Acuse del uploader: consume lo anterior a 'off' (fin de una línea o de
+// un pack) avanzando la cabeza; desde el final de los datos se borra el
+// segmento. No vale para el activo.
+bool sdseg_consume(uint32_t seq, uint32_t off);
+// Lo mismo para el activo, desde la writer: 'off' no puede pasar del final
+// estable y solo se reescribe la cabecera. Al sellarlo consumido, se borra.
+bool sdseg_consume_active(uint32_t off);
+
+// Recorre [start, end) con lecturas en bloque sobre 'buf' (al menos
+// SDREC_FRAME_MAX bytes) y devuelve el offset tras la última línea completa
+// que cabe en max_lines / max_bytes (bytes del fichero; la primera línea se
+// toma siempre). En los comprimidos la unidad es el pack.
+uint32_t sdseg_scan_lines(FILE *f, const sdseg_hdr_t *hdr, uint32_t start,
+                          uint32_t end, uint8_t *buf, size_t cap,
+                          size_t max_lines, size_t max_bytes, size_t *lines);
+
+// Compresión de segmentos sellados (tarea de baja prioridad). El uploader
+// fija con sdseg_pin() el segmento que está enviando para que no cambie.
+bool sdseg_compress(uint32_t seq);
+bool sdseg_compress_next(void); // el más antiguo sin comprimir; false si no hay
+void sdseg_get_lz_stats(sdseg_lz_stats_t *out);
+void sdseg_pin(uint32_t seq); // 0 = ninguno
+bool sdseg_read_pack(FILE *f, uint32_t off, sdseg_pack_t *pk);
+
+// Extrae "t":<num> de un objeto JSON de 'len' bytes (0 si no hay)
+uint32_t sdseg_json_ts(const char *obj, size_t len);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _SDTINDEX_H
+#define _SDTINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Índice temporal de un segmento: fichero "0000002A.IDX" junto al .SEG.
+   Cada entrada cubre las líneas que empiezan en un bloque de
+   SDTIDX_BLOCK bytes: offset de la primera de ellas y min/max de "t".
+   La última entrada es un terminador {fin de datos, 0, 0}; sin él el
+   índice se considera incompleto y se reconstruye al usarlo. En los
+   segmentos comprimidos lo escribe la compresión y las entradas empiezan
+   en un pack (ese no se puede reconstruir). */
+
+#ifndef SDTIDX_BLOCK
+#define SDTIDX_BLOCK 4096
+#endif
+
+typedef struct __attribute__((packed)) {
+  uint32_t off;   // offset de inicio de línea en el segmento
+  uint32_t min_t; // 0 = bloque sin hora real
+  uint32_t max_t;
+} sdtidx_entry_t;
+
+// Construcción incremental (tarea writer)
+typedef struct {
+  FILE *f;
+  sdtidx_entry_t cur;
+  bool have;          // hay entrada abierta en 'cur'
+  uint32_t next_blk;  // offset a partir del cual empieza otra entrada
+} sdtidx_writer_t;
+
+bool sdtidx_writer_open(sdtidx_writer_t *w, const char *path);
+void sdtidx_line_start(sdtidx_writer_t *w, uint32_t off);
+void sdtidx_note_ts(sdtidx_writer_t *w, uint32_t t);
+void sdtidx_writer_close(sdtidx_writer_t *w, uint32_t data_end);
+void sdtidx_writer_abort(sdtidx_writer_t *w);
+
+// Reconstruye el índice leyendo el segmento entero
+bool sdtidx_build(FILE *seg, bool framed, uint32_t seed, uint32_t data_start,
+                  uint32_t data_end, const char *path);
+
+// Primer inicio de línea cuyo bloque puede tener "t" >= t (búsqueda
+// binaria sobre max_t). false si el índice falta o no termina en data_end;
+// *off = data_end si todo es anterior.
+bool sdtidx_lookup(const char *path, uint32_t data_end, uint32_t t,
+                   uint32_t *off);
+
+#endif
@@ -81,7 +81,7 @@ env.Replace(UPLOAD_SPEED=myuploadspeed)
 print('\033[94m' + "Target board: " + myboard + " @ " + myuploadspeed + "bps" + '\033[0m')
 
 # re-set partition table
-mypartitiontable = config.get("env", "board_build.partitions")
+mypartitiontable = config.get("esp32", "board_build.partitions")
 board = env.BoardConfig(myboard)
 board.manifest['build']['partitions'] = mypartitiontable
 print('\033[94m' + "Partition table: " + mypartitiontable + '\033[0m')
@@ -114,6 +114,9 @@ void doHousekeeping() {
              "Memory full, counter cleared (heap low water mark = %d Bytes / "
              "free heap = %d bytes)",
              ESP.getMinFreeHeap(), ESP.getFreeHeap());
+#if (HAS_SDCARD)
+             sdjson_shutdown(SDJSON_SHUTDOWN_MS);
+#endif
              esp_restart();
     //do_reset(true); // memory leak, reset device
   }
@@ -122,6 +125,9 @@ void doHousekeeping() {
 #ifdef BOARD_HAS_PSRAM
   if (ESP.getMinFreePsram() <= MEM_LOW) {
     ESP_LOGW(TAG, "PSRAM full, counter cleared");
+#if (HAS_SDCARD)
+    sdjson_shutdown(SDJSON_SHUTDOWN_MS);
+#endif
     esp_restart();
     //do_reset(true); // memory leak, reset device
   }
@@ -137,6 +143,7 @@ void doHousekeeping() {
 
 #if (HAS_SDCARD)
   sdcard_flush();
+  sdjson_log_stats();
 #endif
 } // doHousekeeping()
 
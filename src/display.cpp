@@ -264,6 +264,16 @@ void dp_refresh(bool nextPage) {
     dp_setFont(MY_FONT_SMALL, !cfg.adrmode);
     dp->printf("%-4s", getSfName(updr2rps(LMIC.datarate)));
     dp_setFont(MY_FONT_SMALL, 0);
+#elif (HAS_SDCARD)
+    // SD backlog pending upload (live counters, no card access)
+    // SD:abcdef ln abcdefKB
+    {
+      sdjson_backlog_t bl;
+      sdjson_get_backlog(&bl);
+      dp->printf("SD:%-6u ln %6uKB",
+                 (unsigned)(bl.seg.lines + bl.flash_lines),
+                 (unsigned)((bl.seg.bytes + bl.flash_bytes) / 1024));
+    }
 #endif // HAS_LORA
 
     dp_dump();
@@ -22,6 +22,9 @@ void resetSystemTimeToEpoch0() {
 void onNormalReset() {
   if (WiFi.status() == WL_CONNECTED) {
     Serial.println("Reinicio periódico: Wi-Fi OK → reiniciando.");
+#if (HAS_SDCARD)
+    sdjson_shutdown(SDJSON_SHUTDOWN_MS); // vacía la writer y sella el log
+#endif
     esp_restart();
   } else {
     Serial.println("Reinicio periódico: sin Wi-Fi, se pospone hasta el próximo ciclo.");
@@ -55,8 +58,10 @@ void setup() {
 #endif
 
 #if (HAS_SDCARD)
-  if (sdcard_init())
-    strcat_P(features, " SD");
+  // El montaje sigue en segundo plano: lo que detecte el sniffer mientras
+  // tanto espera en RAM
+  strcat_P(features, " SD");
+  sdcard_init_async();
 #endif
 
   do_after_reset();
@@ -57,6 +57,9 @@ void do_reset(bool warmstart) {
     reset_rtc_vars();
     ESP_LOGI(TAG, "restarting device (coldstart)");
   }
+#if (HAS_SDCARD)
+  sdjson_shutdown(SDJSON_SHUTDOWN_MS);
+#endif
   esp_restart();
 }
 
@@ -133,6 +136,11 @@ void enter_deepsleep(uint32_t wakeup_sec, gpio_num_t wakeup_gpio) {
     vTaskDelay(pdMS_TO_TICKS(1000));
   }
 
+// drain the SD writer and seal the event log (MAC processing is stopped)
+#if (HAS_SDCARD)
+  sdjson_shutdown(SDJSON_SHUTDOWN_MS);
+#endif
+
 // wait up to 100secs until LMIC is idle
 #if (HAS_LORA)
   lora_waitforidle(100);
@@ -199,9 +207,10 @@ void enter_deepsleep(uint32_t wakeup_sec, gpio_num_t wakeup_gpio) {
   RTC_millis += esp_timer_get_time() / 1000LL;
   ESP_LOGI(TAG, "Going to sleep, good bye.");
 
-// flush & close sd card, if we have
+// flush & close sd card, if we have; count the cycle for the RTC ring
 #if (HAS_SDCARD)
   sdcard_close();
+  sdrtc_sleep(cfg.sleepcycle && wakeup_sec);
 #endif
 
   esp_deep_sleep_start();
@@ -0,0 +1,215 @@
+#ifdef HAS_SDCARD
+
+#include "sdacct.h"
+#include "sdrecord.h"  // sdrec_crc32
+#include "sdsegment.h" // SDSEG_MIN_VALID_T
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/unistd.h>
+
+#ifndef TAG
+#define TAG "sdacct"
+#endif
+
+#define SDACCT_MAGIC 0x54434153UL // "SACT"
+#define SDACCT_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; // sizeof(sdacct_totals_t)
+  sdacct_totals_t t;
+  uint32_t crc;  // de todo lo anterior
+} acct_file_t;
+
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static sdacct_totals_t s_base; // lo guardado en la tarjeta
+static sdacct_totals_t s_run;  // desde el arranque o el último guardado
+static char s_path[64] = "";   // "" = sin tarjeta abierta
+static uint32_t s_saved_ms = 0;
+
+static inline uint32_t now_ms(void) {
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void totals_add(sdacct_totals_t *a, const sdacct_totals_t *b) {
+  for (int i = 0; i < SDACCT_REASONS; i++) {
+    a->logical[i] += b->logical[i];
+    a->physical[i] += b->physical[i];
+    a->writes[i] += b->writes[i];
+  }
+  a->fsyncs += b->fsyncs;
+  a->errors += b->errors;
+  a->mounts += b->mounts;
+}
+
+static void totals_sub(sdacct_totals_t *a, const sdacct_totals_t *b) {
+  for (int i = 0; i < SDACCT_REASONS; i++) {
+    a->logical[i] -= b->logical[i];
+    a->physical[i] -= b->physical[i];
+    a->writes[i] -= b->writes[i];
+  }
+  a->fsyncs -= b->fsyncs;
+  a->errors -= b->errors;
+  a->mounts -= b->mounts;
+}
+
+static uint64_t physical_total(const sdacct_totals_t *t) {
+  uint64_t n = 0;
+  for (int i = 0; i < SDACCT_REASONS; i++) n += t->physical[i];
+  return n;
+}
+
+static inline uint32_t file_crc(const acct_file_t *f) {
+  return sdrec_crc32(0, (const uint8_t *)f, offsetof(acct_file_t, crc));
+}
+
+static bool load(const char *path, sdacct_totals_t *out) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  acct_file_t af;
+  bool ok = fread(&af, 1, sizeof(af), f) == sizeof(af) &&
+            af.magic == SDACCT_MAGIC && af.version == SDACCT_VERSION &&
+            af.size == sizeof(sdacct_totals_t) && af.crc == file_crc(&af);
+  fclose(f);
+  if (ok) *out = af.t;
+  return ok;
+}
+
+bool sdacct_open(const char *mount, uint32_t card_id) {
+  char path[sizeof(s_path)];
+  snprintf(path, sizeof(path), "%s/%s", mount, SDACCT_FILE);
+  sdacct_totals_t base;
+  memset(&base, 0, sizeof(base));
+  bool have = load(path, &base);
+  if (have && base.card_id != card_id) {
+    ESP_LOGW(TAG, "sdacct: %s is from card %08lX, starting over for %08lX",
+             path, (unsigned long)base.card_id, (unsigned long)card_id);
+    memset(&base, 0, sizeof(base));
+    have = false;
+  }
+  base.card_id = card_id;
+  uint32_t now = (uint32_t)time(NULL);
+  if (!base.since && now >= SDSEG_MIN_VALID_T) base.since = now;
+
+  portENTER_CRITICAL(&s_mux);
+  s_base = base;
+  s_run.mounts++;
+  strcpy(s_path, path);
+  s_saved_ms = now_ms();
+  portEXIT_CRITICAL(&s_mux);
+
+  if (have)
+    ESP_LOGI(TAG, "sdacct: card %08lX, %u mount(s), %llu KB written",
+             (unsigned long)card_id, (unsigned)(base.mounts + 1),
+             (unsigned long long)(physical_total(&base) / 1024));
+  return sdacct_save(true);
+}
+
+void sdacct_close(void) {
+  sdacct_save(true);
+  portENTER_CRITICAL(&s_mux);
+  s_path[0] = '\0';
+  portEXIT_CRITICAL(&s_mux);
+}
+
+void sdacct_logical(sdacct_reason_t why, size_t n) {
+  portENTER_CRITICAL_SAFE(&s_mux);
+  s_run.logical[why] += n;
+  portEXIT_CRITICAL_SAFE(&s_mux);
+}
+
+void sdacct_physical(sdacct_reason_t why, uint32_t off, size_t n) {
+  if (n == 0) return;
+  // Sectores que toca [off, off + n): uno a medias se escribe entero
+  uint64_t first = off / SDACCT_SECTOR;
+  uint64_t last = ((uint64_t)off + n - 1) / SDACCT_SECTOR;
+  portENTER_CRITICAL_SAFE(&s_mux);
+  s_run.physical[why] += (last - first + 1) * SDACCT_SECTOR;
+  s_run.writes[why]++;
+  portEXIT_CRITICAL_SAFE(&s_mux);
+}
+
+void sdacct_write(sdacct_reason_t why, uint32_t off, size_t n) {
+  sdacct_logical(why, n);
+  sdacct_physical(why, off, n);
+}
+
+int sdacct_fsync(int fd) {
+  int r = fsync(fd);
+  portENTER_CRITICAL_SAFE(&s_mux);
+  s_run.fsyncs++;
+  if (r != 0) s_run.errors++;
+  portEXIT_CRITICAL_SAFE(&s_mux);
+  return r;
+}
+
+void sdacct_error(void) {
+  portENTER_CRITICAL_SAFE(&s_mux);
+  s_run.errors++;
+  portEXIT_CRITICAL_SAFE(&s_mux);
+}
+
+// Se escribe en el sitio (un sector y fsync): un corte a medias lo deja
+// con el CRC mal y se empieza de cero, que es lo mismo que perder la tarjeta
+bool sdacct_save(bool force) {
+  char path[sizeof(s_path)];
+  acct_file_t af;
+  sdacct_totals_t snap;
+  portENTER_CRITICAL(&s_mux);
+  bool due = s_path[0] &&
+             (force || now_ms() - s_saved_ms >= SDACCT_SAVE_S * 1000UL);
+  if (due) {
+    strcpy(path, s_path);
+    snap = s_run;
+    af.t = s_base;
+    totals_add(&af.t, &snap);
+    s_saved_ms = now_ms();
+  }
+  portEXIT_CRITICAL(&s_mux);
+  if (!due) return false;
+
+  af.magic = SDACCT_MAGIC;
+  af.version = SDACCT_VERSION;
+  af.size = sizeof(sdacct_totals_t);
+  af.crc = file_crc(&af);
+  int fd = open(path, O_WRONLY | O_CREAT, 0666);
+  bool ok = fd >= 0 && write(fd, &af, sizeof(af)) == (ssize_t)sizeof(af);
+  if (fd >= 0) {
+    ok = sdacct_fsync(fd) == 0 && ok;
+    close(fd);
+  }
+  if (!ok) {
+    sdacct_error();
+    ESP_LOGW(TAG, "sdacct: can't write %s", path);
+    return false;
+  }
+  sdacct_write(SDACCT_CURSOR, 0, sizeof(af));
+
+  portENTER_CRITICAL(&s_mux);
+  s_base = af.t;
+  totals_sub(&s_run, &snap);
+  portEXIT_CRITICAL(&s_mux);
+  return true;
+}
+
+void sdacct_get(sdacct_totals_t *out) {
+  portENTER_CRITICAL(&s_mux);
+  *out = s_base;
+  totals_add(out, &s_run);
+  portEXIT_CRITICAL(&s_mux);
+}
+
+uint32_t sdacct_waf_x100(const sdacct_totals_t *t) {
+  if (!t->logical[SDACCT_APPEND]) return 0;
+  return (uint32_t)(physical_total(t) * 100 / t->logical[SDACCT_APPEND]);
+}
+
+#endif // HAS_SDCARD
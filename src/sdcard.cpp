@@ -5,9 +5,19 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
 #include "freertos/portmacro.h"   // xPortInIsrContext()
-
-#include <Arduino.h>         // String
+#include "sdring.h"
+#include "sdrecord.h"
+#include "sdflash.h"
+#include "sdrtc.h"
+#include "sdenc.h"    // estadísticas de cifrado
+#include "sdacct.h"   // contabilidad de escrituras de la tarjeta
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include <Arduino.h>
+#include <Ticker.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,460 +33,1334 @@
 sdmmc_card_t *card;
 
 const char mount_point[] = MOUNT_POINT;
-static bool useSDCard = false;
-
-// Archivo CSV clásico
-static FILE *data_file = nullptr;
-
-#if (SDLOGGING)
-static FILE *log_file = nullptr;
-static FILE *uart_stdout = stdout;
-
-int print_to_sd_card(const char *fmt, va_list args) {
-  static bool static_fatal_error = false;
-  static const uint32_t WRITE_CACHE_CYCLE = 5;
-  static uint32_t counter_write = 0;
-  int iresult;
-
-  if (log_file == NULL) {
-    printf("%s() ABORT. file handle log_file is NULL\n", __FUNCTION__);
-    return -1;
-  }
-  if (!static_fatal_error) {
-    iresult = vfprintf(log_file, fmt, args);
-    if (iresult < 0) {
-      printf("%s() ABORT. failed vfprintf() -> logging disabled \n", __FUNCTION__);
-      static_fatal_error = true;
-      return iresult;
-    }
-    if (counter_write++ % WRITE_CACHE_CYCLE == 0)
-      fsync(fileno(log_file));
-  }
-  return vprintf(fmt, args);
-}
-#endif
-
-static bool openFile(FILE **fd, const char *filename) {
-  char _filename[128];
-  snprintf(_filename, sizeof(_filename), "%s%s", MOUNT_POINT, filename);
-  *fd = fopen(_filename, "a");
-  if (*fd == NULL) {
-    ESP_LOGE(TAG, "file <%s> open error", _filename);
-    return false;
-  } else {
-    ESP_LOGI(TAG, "file <%s> opened", _filename);
-    return true;
-  }
-}
+static volatile bool useSDCard = false;
+
+// Montaje en segundo plano (sdcard_init_async) y tiempos de arranque
+static volatile sdcard_mount_state_t s_mount_state = SDCARD_MOUNT_IDLE;
+static TaskHandle_t s_mount_task = NULL;
+static Ticker s_mount_timer;
+static int64_t s_mount_us = 0;       // desde el arranque hasta montada
+static volatile int64_t s_first_event_us = 0; // primer evento MAC del sniffer
+static volatile uint32_t s_premount_events = 0;
+static portMUX_TYPE s_mount_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t s_tier_mutex = NULL; // ver tier_setup()
+static bool s_fallback_tried = false;
+static bool mount_sync(void);
 
 /*========================
- *  LOGGER NDJSON con cola
+ *  LOGGER NDJSON con anillo
  *========================*/
 
 #ifndef SDCARD_MACLOG_BASENAME
 #define SDCARD_MACLOG_BASENAME "mac_events"   // /sdcard/mac_events.jsonl
 #endif
-#ifndef SDJSON_QUEUE_LEN
-#define SDJSON_QUEUE_LEN 64
-#endif
-#ifndef SDJSON_FLUSH_EVERY
-#define SDJSON_FLUSH_EVERY 10
-#endif
-#ifndef SDJSON_RAW_MAXLEN
-// Deja holgura para un objeto grande
-#define SDJSON_RAW_MAXLEN  128
+#ifndef SDJSON_REC_MAXLEN
+// Objeto más largo que aceptamos (antes se truncaba a 128)
+#define SDJSON_REC_MAXLEN  1024
 #endif
 
-// Operaciones para el writer: appends sin salto, cierre de línea, ping/ack, purga
+// Operaciones para el writer: appends sin salto, cierre de línea, purga y
+// sellado del segmento activo
 typedef enum {
   LOG_OP_APPEND = 0,
   LOG_OP_NEWLINE = 1,
-  LOG_OP_PING = 2,
-  LOG_OP_PURGE = 3   // NUEVO: purgar primeras líneas con edad > X
+  LOG_OP_EVENT = 2,  // evento MAC: como APPEND, pero se puede colapsar
+  LOG_OP_PURGE = 3,  // purgar segmentos con edad > X
+  LOG_OP_ROTATE = 4, // sellar el segmento activo (lo pide el uploader)
+  LOG_OP_FLUSH = 5,  // commit + fsync de todo (sdcard_flush)
+  LOG_OP_SHUTDOWN = 6, // último registro antes de dormir/reiniciar: sella
+  LOG_OP_CONSUME = 7 // acuse del uploader sobre el segmento activo
 } logop_t;
 
-typedef struct {
-  logop_t op;
-  char    raw[SDJSON_RAW_MAXLEN]; // APPEND: payload; PURGE: "max_age_sec"
-} logrec_t;
-
-static QueueHandle_t s_log_queue   = NULL;
+// Registros de longitud variable: APPEND y EVENT llevan el objeto tal cual
+// (sin '\0'), PURGE un uint32_t con max_age_sec. NEWLINE y ROTATE van vacíos
+// o con un ticket uint32_t si alguien espera a que terminen; CONSUME lleva
+// el ticket seguido de seq y offset.
+static sdring_t      s_log_ring;
+static uint8_t*      s_log_ring_buf = NULL;
+static bool          s_ring_psram = false;
+// Escalón de RAM: ms del primer registro sin vaciar (0 = vacío) y aviso de
+// que hay algo que no puede esperar al plazo
+static volatile uint32_t s_stage_since = 0;
+static volatile bool s_stage_urgent = false;
+// s_stage_since del vaciado en curso (solo la writer): de ahí cuenta el plazo
+// de una racha colapsada que empiece en él
+static uint32_t s_drain_since = 0;
+// Desbordamiento para recuentos, fines de línea y sellados. Mientras tenga
+// algo, todo lo crítico va aquí (y los eventos MAC se resumen) para que la
+// writer, que vacía primero el anillo principal, mantenga el orden.
+static sdring_t      s_spill_ring;
+static uint8_t*      s_spill_buf = NULL;
+static volatile bool s_log_ring_ready = false;
+static volatile bool s_closing = false; // sdjson_shutdown(): productores fuera
 static TaskHandle_t  s_log_task    = NULL;
-static FILE*         maclog_file   = NULL;
 
 // Estado interno: ¿ya se escribió algo en la línea actual?
 static bool s_line_has_items = false;
-// ACK para la versión síncrona del salto de línea (compartido también con PING)
-static volatile uint32_t s_newline_ack_counter = 0;
-
-static bool open_maclog_file(void) {
-  if (maclog_file) return true;
-  char path[64];
-  snprintf(path, sizeof(path), "/%s.jsonl", SDCARD_MACLOG_BASENAME);
-  if (!openFile(&maclog_file, path)) {
-    ESP_LOGE(TAG, "sdjson: can't open %s", path);
-    return false;
+static sdrec_ctx_t s_enc;                   // tabla de claves / delta de "t" de la línea
+static uint8_t s_enc_buf[SDREC_REC_MAX];    // registro codificado
+
+// Peticiones síncronas: cada una ocupa un hueco con su bit en s_done_ev. El
+// ticket lleva hueco + generación; si quien espera se fue por timeout, la
+// generación ya cambió y la writer no toca el hueco.
+#define SDJSON_WAITERS 8
+typedef struct {
+  bool busy;
+  uint32_t gen;
+  sdjson_pos_t pos;
+} sdjson_waiter_t;
+static sdjson_waiter_t s_waiters[SDJSON_WAITERS];
+static EventGroupHandle_t s_done_ev = NULL;
+static portMUX_TYPE s_waiter_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t ticket_slot(uint32_t ticket) { return ticket & 0xFF; }
+static inline uint32_t ticket_gen(uint32_t ticket) { return ticket >> 8; }
+static inline EventBits_t slot_bit(uint32_t i) { return (EventBits_t)1 << i; }
+
+// Parada de la writer: no se borra desde fuera (podría tener el mutex de
+// sdseg); sale ella sola entre registros y avisa con este bit
+#ifndef SDJSON_STOP_WAIT_MS
+#define SDJSON_STOP_WAIT_MS 1000
+#endif
+#define WRITER_EXIT_BIT slot_bit(SDJSON_WAITERS)
+static volatile bool s_stop_req = false;
+
+// Devuelve false si no hay hueco libre
+static bool waiter_acquire(uint32_t *ticket) {
+  bool ok = false;
+  portENTER_CRITICAL(&s_waiter_mux);
+  for (uint32_t i = 0; i < SDJSON_WAITERS; i++) {
+    if (s_waiters[i].busy) continue;
+    s_waiters[i].busy = true;
+    s_waiters[i].gen = (s_waiters[i].gen + 1) & 0xFFFFFF;
+    *ticket = s_waiters[i].gen << 8 | i;
+    ok = true;
+    break;
   }
-  return true;
+  portEXIT_CRITICAL(&s_waiter_mux);
+  if (ok) xEventGroupClearBits(s_done_ev, slot_bit(ticket_slot(*ticket)));
+  return ok;
 }
 
-/* ========= Helpers de PURGA (ejecutan dentro de la writer) ========== */
+static void waiter_release(uint32_t ticket, sdjson_pos_t *pos) {
+  sdjson_waiter_t &w = s_waiters[ticket_slot(ticket)];
+  portENTER_CRITICAL(&s_waiter_mux);
+  if (pos) *pos = w.pos;
+  w.busy = false;
+  w.gen = (w.gen + 1) & 0xFFFFFF;
+  portEXIT_CRITICAL(&s_waiter_mux);
+}
 
-// Leer primera línea y extraer el campo "t" (epoch). Devuelve true si OK.
-static bool get_first_line_ts(time_t &out_ts) {
-  char fullpath[96];
-  snprintf(fullpath, sizeof(fullpath), "%s/%s.jsonl", mount_point, SDCARD_MACLOG_BASENAME);
-  FILE* f = fopen(fullpath, "r");
-  if (!f) return false;
-
-  char buf[256];
-  size_t i = 0;
-  int c;
-  bool any = false;
-  while ((c = fgetc(f)) != EOF && c != '\n') {
-    if (c == '\r') continue;
-    if (i < sizeof(buf) - 1) buf[i++] = (char)c;
-    any = true;
-  }
-  fclose(f);
-  if (!any) return false;
-  buf[i] = '\0';
-
-  // Busca "t":<numero>
-  const char *p = strstr(buf, "\"t\"");
-  if (!p) p = strstr(buf, "t");
-  if (!p) return false;
-  p = strchr(p, ':');
-  if (!p) return false;
-  p++;
-  while (*p == ' ' || *p == '\t') p++;
+// Writer: completa la petición del registro 'r' (si la tiene)
+static void waiter_complete(const sdring_rec_t &r, const sdjson_pos_t &pos) {
+  if (r.len < sizeof(uint32_t)) return;
+  uint32_t ticket;
+  memcpy(&ticket, r.data, sizeof(ticket));
+  uint32_t i = ticket_slot(ticket);
+  if (i >= SDJSON_WAITERS) return;
+  bool live;
+  portENTER_CRITICAL(&s_waiter_mux);
+  live = s_waiters[i].busy && s_waiters[i].gen == ticket_gen(ticket);
+  if (live) s_waiters[i].pos = pos;
+  portEXIT_CRITICAL(&s_waiter_mux);
+  if (live) xEventGroupSetBits(s_done_ev, slot_bit(i));
+}
 
-  unsigned long v = 0;
-  bool has = false;
-  while (*p >= '0' && *p <= '9') {
-    has = true;
-    v = (v * 10ul) + (unsigned)(*p - '0');
-    p++;
-  }
-  if (!has) return false;
-  out_ts = (time_t)v;
-  return true;
+static sdjson_pos_t active_pos(void) {
+  sdjson_pos_t pos = {0, 0};
+  sdseg_active_pos(&pos.seq, &pos.off);
+  return pos;
 }
 
-// Borrar N primeras líneas (versión sin parar cola; la writer cierra/reabre FILE).
-static bool sdjson_delete_first_lines_nolock(size_t n) {
-  if (n == 0) return true;
+/* ========= Instrumentación ========== */
 
-  char fullpath[96];
-  snprintf(fullpath, sizeof(fullpath), "%s/%s.jsonl", mount_point, SDCARD_MACLOG_BASENAME);
-  char tmppath[96];
-  snprintf(tmppath,  sizeof(tmppath),  "%s/%s.tmp",   mount_point, SDCARD_MACLOG_BASENAME);
+// Los histogramas solo los escribe la writer; los drops pueden venir de
+// cualquier core o ISR, por eso van bajo spinlock.
+static sdjson_stats_t s_stats;
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
 
-  FILE* fin = fopen(fullpath, "r");
-  if (!fin) return true; // no hay nada que borrar
+static inline uint32_t lat_bucket(uint32_t us) {
+  uint32_t b = us ? 32 - __builtin_clz(us) : 0;
+  return (b < SDJSON_LAT_BUCKETS) ? b : SDJSON_LAT_BUCKETS - 1;
+}
+
+static void lat_note(sdjson_lat_op_t op, int64_t t0) {
+  uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+  s_stats.lat[op][lat_bucket(us)]++;
+  if (us > s_stats.lat_max_us[op]) s_stats.lat_max_us[op] = us;
+}
+
+static void note_drop(bool isr, bool critical) {
+  portENTER_CRITICAL_SAFE(&s_stats_mux);
+  if (isr) s_stats.drops_isr++;
+  else s_stats.drops_task++;
+  if (critical) s_stats.lost_critical++;
+  else s_stats.lost_bulk++;
+  portEXIT_CRITICAL_SAFE(&s_stats_mux);
+}
 
-  FILE* ftmp = fopen(tmppath, "w");
-  if (!ftmp) { fclose(fin); return false; }
+/* ========= Helpers de PURGA (ejecutan dentro de la writer) ========== */
+
+// Retención por segmentos: borrar un segmento entero es un unlink, así que
+// la writer no deja de vaciar la cola aunque el backlog sea de días.
+static void do_purge_older_than(uint32_t max_age_sec) {
+  time_t now = time(NULL);
+  if ((uint32_t)now < SDSEG_MIN_VALID_T) return; // sin hora real no purgamos
+  size_t n = sdseg_purge_older_than(now - (time_t)max_age_sec);
+  if (n) ESP_LOGI(TAG, "sdjson: purged %u segment(s)", (unsigned)n);
+}
 
-  size_t to_skip = n;
-  int c;
-  bool saw_any = false;
-  bool last_was_nl = true;
+/* ============ Flujos de texto: CSV y log del sistema ============ */
 
-  // 1) Saltar exactamente N líneas completas (cuenta '\n')
-  while (to_skip > 0 && (c = fgetc(fin)) != EOF) {
-    saw_any = true;
-    if (c == '\r') continue;
-    last_was_nl = (c == '\n');
-    if (last_was_nl) to_skip--;
+// Cada flujo tiene su anillo, su fichero y su política de fsync; solo la
+// writer toca el fichero, así que quien escribe nunca espera a la SD
+typedef struct {
+  sdring_t ring;
+  uint8_t *buf;      // NULL = flujo cerrado
+  FILE *f;
+  uint32_t sync_ms;  // 0 = fsync tras cada vaciado
+  uint32_t dirty_since; // ms del primer byte sin fsync (0 = nada)
+  uint32_t synced_off;  // tamaño del fichero en el último fsync
+} text_stream_t;
+
+static text_stream_t s_streams[SDJSON_STREAMS];
+
+static inline uint32_t ms_now(void) {
+  return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
+
+// Abre 'path' en modo append y reserva su anillo (antes de arrancar la writer)
+static bool stream_open(sdjson_stream_t id, const char *path, uint32_t ring_size,
+                        uint32_t sync_ms, const char *header) {
+  text_stream_t *s = &s_streams[id];
+  if (s->buf) return true;
+  FILE *f = fopen(path, "a");
+  if (!f) {
+    ESP_LOGE(TAG, "file <%s> open error", path);
+    return false;
   }
-  // Si EOF y última no tenía '\n' pero vimos algo, considérala línea
-  if (to_skip > 0 && saw_any && !last_was_nl) {
-    to_skip--;
+  uint8_t *buf = (uint8_t *)malloc(ring_size);
+  if (!buf || !sdring_init(&s->ring, buf, ring_size)) {
+    free(buf);
+    fclose(f);
+    return false;
   }
+  setvbuf(f, NULL, _IOFBF, SDSEG_SECTOR); // fwrite por sectores, no por byte
+  s->synced_off = (uint32_t)ftell(f);
+  if (header && s->synced_off == 0) fprintf(f, "%s\n", header);
+  s->f = f;
+  s->sync_ms = sync_ms;
+  s->dirty_since = 0;
+  s->buf = buf;
+  ESP_LOGI(TAG, "file <%s> opened", path);
+  return true;
+}
 
-  // 2) Copiar el resto tal cual
-  if (to_skip == 0) {
-    while ((c = fgetc(fin)) != EOF) {
-      fputc(c, ftmp);
+static void stream_sync(sdjson_stream_t id) {
+  text_stream_t *s = &s_streams[id];
+  if (!s->f || !s->dirty_since) return;
+  fflush(s->f);
+  // Lo escrito desde el último fsync, con el sector que quedó a medias
+  uint32_t end = (uint32_t)ftell(s->f);
+  if (end > s->synced_off)
+    sdacct_physical(SDACCT_APPEND, s->synced_off, end - s->synced_off);
+  s->synced_off = end;
+  sdacct_fsync(fileno(s->f));
+  s->dirty_since = 0;
+  s_stats.streams[id].syncs++;
+}
+
+// Vacía el anillo del flujo en su fichero (solo la writer)
+static void stream_drain(sdjson_stream_t id) {
+  text_stream_t *s = &s_streams[id];
+  if (!s->buf) return;
+  sdring_rec_t r;
+  while (sdring_peek(&s->ring, &r)) {
+    if (useSDCard && s->f) {
+      if (fwrite(r.data, 1, r.len, s->f) == r.len) {
+        s_stats.streams[id].bytes += r.len;
+        sdacct_logical(SDACCT_APPEND, r.len);
+        if (!s->dirty_since) s->dirty_since = ms_now() | 1;
+      } else {
+        sdacct_error();
+      }
     }
+    sdring_pop(&s->ring, &r);
   }
+  if (s->dirty_since && (s->sync_ms == 0 || ms_now() - s->dirty_since >= s->sync_ms))
+    stream_sync(id);
+}
+
+// Cuánto puede dormir la writer antes de que toque un fsync de algún flujo
+static uint32_t streams_due_ms(void) {
+  uint32_t due = UINT32_MAX;
+  for (int i = 0; i < SDJSON_STREAMS; i++) {
+    const text_stream_t *s = &s_streams[i];
+    if (!s->buf || !s->dirty_since) continue;
+    uint32_t age = ms_now() - s->dirty_since;
+    uint32_t left = (age >= s->sync_ms) ? 0 : s->sync_ms - age;
+    if (left < due) due = left;
+  }
+  return due;
+}
+
+static void stream_close(sdjson_stream_t id) {
+  text_stream_t *s = &s_streams[id];
+  if (!s->f) return;
+  stream_sync(id);
+  fclose(s->f);
+  s->f = NULL; // el anillo se queda: un productor nunca ve memoria liberada
+}
+
+/* ============ Compresión de segmentos sellados ============ */
 
-  fflush(ftmp); fsync(fileno(ftmp));
-  fclose(ftmp);
-  fclose(fin);
+#if SDSEG_COMPRESS
+static TaskHandle_t s_lz_task = NULL;
 
-  // 3) Reemplazo atómico
-  remove(fullpath);
-  rename(tmppath, fullpath);
+// Baja prioridad: comprime los sellados mientras la writer sigue a lo suyo
+static void maclog_lz_task(void *arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SDSEG_LZ_POLL_MS));
+    while (useSDCard && sdseg_compress_next()) vTaskDelay(1);
+  }
+}
 
+static inline void lz_kick(void) {
+  if (s_lz_task) xTaskNotifyGive(s_lz_task);
+}
+#else
+static inline void lz_kick(void) {}
+#endif
+
+/* =================== TAREA WRITER =================== */
+
+// Un objeto JSON al segmento activo, en binario (el JSON se regenera al subir)
+static bool seg_append_obj(const uint8_t *data, size_t len) {
+  if (!sdseg_open_active()) return false;
+  if (!s_line_has_items) sdrec_ctx_reset(&s_enc);
+  size_t n = sdrec_encode(&s_enc, (const char *)data, len, s_enc_buf,
+                          sizeof(s_enc_buf));
+  if (n == 0) return false;
+  sdseg_append((const char *)s_enc_buf, n);
+  s_line_has_items = true;
+
+  // Una racha colapsada ("rep":<n>) cuenta sus n eventos en el backlog
+  uint32_t t = sdseg_json_ts((const char *)data, len);
+  sdseg_note_obj(t ? t : (uint32_t)time(NULL),
+                 sdrec_json_events((const char *)data, len));
+  sdseg_commit_point(false);
   return true;
 }
 
-// Ejecuta purga hasta que la primera línea esté < max_age_sec (24h)
-// Cierra maclog_file, borra lo viejo, y vuelve a abrir en APPEND.
-static void do_purge_older_than(uint32_t max_age_sec) {
-  // Asegurar que los datos en FILE actual están en disco
-  if (maclog_file) {
-    fflush(maclog_file);
-    fsync(fileno(maclog_file));
-    fclose(maclog_file);
-    maclog_file = NULL;
-  }
+/* ---- Nivel de respaldo en flash (sin SD) ---- */
 
-  time_t now = time(NULL);
+static bool s_line_on_flash = false; // nivel de la línea abierta
 
-  for (;;) {
-    time_t first_ts = 0;
-    if (!get_first_line_ts(first_ts)) break;      // no hay líneas
-    if (first_ts > now) break;                    // timestamp futuro: no purgar
-    if ((uint32_t)(now - first_ts) > max_age_sec) {
-      (void)sdjson_delete_first_lines_nolock(1);  // borra 1ª línea y reevalúa
-      continue;
+// Cierra la línea abierta en el nivel donde se empezó
+static void line_close(void) {
+  if (!s_line_has_items) return;
+  if (s_line_on_flash) sdflash_end_line();
+  else sdseg_end_line();
+  s_line_has_items = false;
+}
+
+// Al cambiar de nivel la línea abierta se cierra donde se empezó
+static void tier_switch(bool flash) {
+  if (flash == s_line_on_flash) return;
+  line_close();
+  s_line_on_flash = flash;
+}
+
+// Sin tarjeta la writer escribe en la flash interna; lo que no es una línea
+// de eventos solo se confirma a quien espera
+static void flash_handle(const sdring_rec_t &r) {
+  sdjson_pos_t none = {0, 0};
+  if (r.op == LOG_OP_APPEND) {
+    if (sdflash_append((const char *)r.data, r.len)) {
+      s_line_has_items = true;
+      s_stats.bytes_in += r.len;
     }
-    break; // la primera línea es reciente (< max_age_sec)
-  }
+  } else if (r.op == LOG_OP_NEWLINE) {
+    if (s_line_has_items) sdflash_end_line();
+    s_line_has_items = false;
+    if (r.len) sdflash_sync(true);
+    waiter_complete(r, none);
+  } else if (r.op == LOG_OP_ROTATE || r.op == LOG_OP_SHUTDOWN) {
+    if (s_line_has_items) sdflash_end_line();
+    s_line_has_items = false;
+    sdflash_seal(); // cerrado: el uploader ya lo puede mandar
+    waiter_complete(r, none);
+  } else if (r.op == LOG_OP_FLUSH) {
+    sdflash_sync(true);
+    waiter_complete(r, none);
+  } else if (r.op == LOG_OP_CONSUME) {
+    waiter_complete(r, none); // sin tarjeta no hay segmento que consumir
+  } // PURGE: el propio anillo de la flash limita lo que se guarda
+}
 
-  // Reabrir fichero para seguir escribiendo
-  (void)open_maclog_file();
-  s_line_has_items = false; // nueva línea empezará sin coma
+/* ---- Colapso de eventos MAC repetidos ---- */
+
+// El primer evento de una racha se retiene en RAM; los siguientes iguales
+// salvo en "t" solo suben el contador. Al cortarse la racha se escribe el
+// primero tal cual (n = 1) o con ,"rep":<n>,"t_last":<t> antes de la '}'
+// final. Se pierden los "t" intermedios, no el número de eventos.
+#define DUP_EXTRA 48 // lo que se añade como mucho
+
+typedef struct {
+  uint8_t obj[SDJSON_REC_MAXLEN]; // primer evento de la racha
+  size_t len;
+  size_t t_off, t_len; // cifras de "t" dentro de obj
+  char t_last[21];     // cifras de "t" del último
+  uint32_t first_t;    // segundos (sdseg_json_ts)
+  uint32_t count;      // eventos de la racha (0 = nada retenido)
+  uint32_t since_ms;   // cuándo entró el primero en el anillo (cota)
+} dup_run_t;
+static dup_run_t s_dup;
+static uint8_t s_dup_out[SDJSON_REC_MAXLEN];
+
+static inline uint32_t dup_now_ms(void) {
+  return (uint32_t)(esp_timer_get_time() / 1000);
 }
 
-/* === Saneado del backlog NDJSON al arrancar ===
-   - Elimina líneas vacías o obviamente corruptas (no empiezan por '{' o no acaban en '}').
-   - Si hay "t":<num>, valida rango (no futuro y no prehistórico) y normaliza ms/seg al comparar.
-   - Reescribe el archivo con solo líneas válidas y fuerza '\n' final.
-   - No usa la cola: se ejecuta antes de arrancar el writer. */
-static void sdjson_sanity_check_on_boot(void) {
-  if (!useSDCard) return;
+// Posición y longitud de las cifras del valor de "t"; false si no tiene
+static bool json_t_digits(const uint8_t *obj, size_t len, size_t *off,
+                          size_t *n) {
+  const char *b = (const char *)obj, *end = b + len, *p = b;
+  for (; p + 3 <= end; p++)
+    if (p[0] == '"' && p[1] == 't' && p[2] == '"') break;
+  if (p + 3 > end) return false;
+  p += 3;
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  if (p >= end || *p != ':') return false;
+  p++;
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  const char *d = p;
+  while (p < end && *p >= '0' && *p <= '9') p++;
+  if (p == d || p - d >= (ptrdiff_t)sizeof(s_dup.t_last)) return false;
+  *off = (size_t)(d - b);
+  *n = (size_t)(p - d);
+  return true;
+}
 
-  char fullpath[96];
-  snprintf(fullpath, sizeof(fullpath), "%s/%s.jsonl", mount_point, SDCARD_MACLOG_BASENAME);
+// Un objeto al nivel de la línea abierta
+static bool tier_append(const uint8_t *data, size_t len) {
+  if (!s_line_on_flash) return seg_append_obj(data, len);
+  if (!sdflash_append((const char *)data, len)) return false;
+  s_line_has_items = true;
+  return true;
+}
 
-  FILE* fin = fopen(fullpath, "r");
-  if (!fin) {
-    ESP_LOGI(TAG, "sdjson: no backlog to check on boot");
-    return;
+// ¿Es 'r' una repetición del evento retenido? Si lo es, queda contado
+static bool dup_absorb(const sdring_rec_t &r) {
+  if (!s_dup.count) return false;
+  size_t off, n;
+  if (!json_t_digits(r.data, r.len, &off, &n) || off != s_dup.t_off) return false;
+  size_t tail = s_dup.len - s_dup.t_off - s_dup.t_len;
+  if (r.len - off - n != tail || memcmp(r.data, s_dup.obj, off) != 0 ||
+      memcmp(r.data + off + n, s_dup.obj + s_dup.t_off + s_dup.t_len, tail) != 0)
+    return false;
+  uint32_t t = sdseg_json_ts((const char *)r.data, r.len);
+  if (t < s_dup.first_t || t - s_dup.first_t > SDJSON_DEDUP_SPAN_S) return false;
+  memcpy(s_dup.t_last, r.data + off, n);
+  s_dup.t_last[n] = '\0';
+  s_dup.count++;
+  return true;
+}
+
+// Escribe la racha retenida (si la hay) en el nivel de la línea abierta
+static void dup_flush(void) {
+  if (!s_dup.count) return;
+  const uint8_t *obj = s_dup.obj;
+  size_t n = s_dup.len;
+  if (s_dup.count > 1) {
+    size_t head = s_dup.len - 1; // sin la '}' final
+    memcpy(s_dup_out, s_dup.obj, head);
+    int k = snprintf((char *)s_dup_out + head, sizeof(s_dup_out) - head,
+                     ",\"rep\":%lu,\"t_last\":%s}",
+                     (unsigned long)s_dup.count, s_dup.t_last);
+    obj = s_dup_out;
+    n = head + (size_t)k;
   }
+  s_dup.count = 0;
+  int64_t t0 = esp_timer_get_time();
+  if (tier_append(obj, n) && !s_line_on_flash) lat_note(SDJSON_LAT_APPEND, t0);
+}
 
-  char tmppath[96];
-  snprintf(tmppath, sizeof(tmppath), "%s/%s.sane", mount_point, SDCARD_MACLOG_BASENAME);
-  FILE* ftmp = fopen(tmppath, "w");
-  if (!ftmp) {
-    ESP_LOGW(TAG, "sdjson: can't create tmp for sanity; skipping");
-    fclose(fin);
+// Retiene 'r' como principio de racha; lo que no se puede colapsar (sin "t",
+// sin sitio para lo añadido o SDJSON_DEDUP a 0) se escribe ya
+static void dup_hold(const sdring_rec_t &r) {
+  size_t off, n;
+  if (!SDJSON_DEDUP || (size_t)r.len + DUP_EXTRA > sizeof(s_dup.obj) ||
+      r.data[r.len - 1] != '}' || !json_t_digits(r.data, r.len, &off, &n)) {
+    int64_t t0 = esp_timer_get_time();
+    if (tier_append(r.data, r.len) && !s_line_on_flash)
+      lat_note(SDJSON_LAT_APPEND, t0);
     return;
   }
+  memcpy(s_dup.obj, r.data, r.len);
+  s_dup.len = r.len;
+  s_dup.t_off = off;
+  s_dup.t_len = n;
+  memcpy(s_dup.t_last, r.data + off, n);
+  s_dup.t_last[n] = '\0';
+  s_dup.first_t = sdseg_json_ts((const char *)r.data, r.len);
+  s_dup.since_ms = s_drain_since ? s_drain_since : dup_now_ms();
+  s_dup.count = 1;
+}
+
+// ms hasta cortar por tiempo la racha retenida (UINT32_MAX = ninguna). El
+// primero sigue en RAM como si estuviera en el anillo, así que no espera
+// más de SDJSON_STAGE_DEADLINE_MS desde que entró en él.
+static uint32_t dup_due_ms(void) {
+  if (!s_dup.count) return UINT32_MAX;
+  uint32_t age = dup_now_ms() - s_dup.since_ms;
+  uint32_t span = SDJSON_DEDUP_SPAN_S * 1000UL;
+  if (span > SDJSON_STAGE_DEADLINE_MS) span = SDJSON_STAGE_DEADLINE_MS;
+  return age >= span ? 0 : span - age;
+}
 
-  // Umbrales de tiempo
-  const time_t now = time(NULL);
-  const bool   now_ok = (now > 1577836800);     // >= 2020-01-01
-  const time_t min_ok = 1483228800;             // 2017-01-01
-  const time_t max_future = now_ok ? (now + 86400) : (time_t)4102444800; // +1 día si hay hora, si no laxo
-
-  size_t kept = 0, dropped = 0;
-
-  String line;
-  line.reserve(256);
-  int c;
-
-  auto process_line = [&](String& s) {
-    while (s.length() && (s[s.length()-1] == '\r' || s[s.length()-1] == '\n' || s[s.length()-1] == ' ' || s[s.length()-1] == '\t'))
-      s.remove(s.length()-1);
-    int start = 0;
-    while (start < (int)s.length() && (s[start] == ' ' || s[start] == '\t')) start++;
-
-    if (start >= (int)s.length()) { dropped++; return; }
-    if (s[start] != '{') { dropped++; return; }
-    if (s[s.length()-1] != '}') { dropped++; return; }
-
-    // Si hay campo t, validar
-    time_t tval = 0;
-    bool have_t = false;
-    int idx_t = s.indexOf("\"t\"", start);
-    if (idx_t < 0) idx_t = s.indexOf('t', start); // tolerante
-    if (idx_t >= 0) {
-      int colon = s.indexOf(':', idx_t);
-      if (colon > 0) {
-        int p = colon + 1;
-        while (p < (int)s.length() && (s[p] == ' ' || s[p] == '\t')) p++;
-        unsigned long long val = 0ULL;
-        bool any = false;
-        while (p < (int)s.length() && s[p] >= '0' && s[p] <= '9') {
-          any = true;
-          val = val * 10ULL + (unsigned)(s[p] - '0');
-          p++;
-        }
-        if (any) {
-          if (val > 100000000000ULL) { // ms
-            tval = (time_t)(val / 1000ULL);
-          } else {
-            tval = (time_t)val;
-          }
-          have_t = true;
-        }
+// Objetos de un trozo NDJSON ("obj,obj,...\n"): se cortan en las comas de
+// nivel 0 fuera de cadenas
+typedef struct {
+  uint8_t obj[SDJSON_REC_MAXLEN];
+  size_t len;
+  int depth;
+  bool in_str, esc, too_long;
+} flash_splitter_t;
+
+// Vuelca los trozos de la flash a la SD, del más antiguo al más nuevo, antes
+// que lo que espera en el anillo (que es posterior)
+static void flash_migrate(void) {
+  tier_switch(false); // la línea a medias se cierra en la flash
+  sdflash_seal();
+  static flash_splitter_t sp;
+  uint32_t id, chunks = 0, objs = 0;
+  char path[48];
+  while (sdflash_oldest(&id)) {
+    sdflash_path(id, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      sdflash_remove(id, true);
+      continue;
+    }
+    memset(&sp, 0, sizeof(sp));
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+      bool cut = !sp.in_str && sp.depth == 0 && (c == ',' || c == '\n');
+      if (!cut) {
+        if (sp.len < sizeof(sp.obj)) sp.obj[sp.len++] = (uint8_t)c;
+        else sp.too_long = true;
+        if (sp.in_str) {
+          if (sp.esc) sp.esc = false;
+          else if (c == '\\') sp.esc = true;
+          else if (c == '"') sp.in_str = false;
+        } else if (c == '"') sp.in_str = true;
+        else if (c == '{' || c == '[') sp.depth++;
+        else if ((c == '}' || c == ']') && sp.depth > 0) sp.depth--;
+        continue;
+      }
+      if (sp.len && !sp.too_long && seg_append_obj(sp.obj, sp.len)) objs++;
+      sp.len = 0;
+      sp.too_long = false;
+      if (c == '\n' && s_line_has_items) {
+        sdseg_end_line();
+        s_line_has_items = false;
       }
     }
+    fclose(f);
+    if (s_line_has_items) { // trozo sin '\n' final
+      sdseg_end_line();
+      s_line_has_items = false;
+    }
+    sdseg_flush_active(true); // en la SD antes de borrarlo de la flash
+    sdflash_remove(id, true);
+    chunks++;
+  }
+  if (chunks)
+    ESP_LOGI(TAG, "sdjson: migrated %u flash chunk(s), %u event(s) to SD",
+             (unsigned)chunks, (unsigned)objs);
+}
 
-    if (have_t) {
-      if (tval < min_ok) { dropped++; return; }
-      if (tval > max_future) { dropped++; return; }
+// Acuse del uploader: {ticket, seq, off}. Si el segmento se selló entre
+// medias ya es un sellado más. Se confirma con la posición, o {0,0}.
+static void consume_handle(const sdring_rec_t &r) {
+  sdjson_pos_t pos = {0, 0};
+  uint32_t a[3];
+  if (r.len == sizeof(a)) {
+    memcpy(a, r.data, sizeof(a));
+    sdjson_pos_t act = active_pos();
+    bool ok = (a[1] == act.seq) ? sdseg_consume_active(a[2])
+                                : sdseg_consume(a[1], a[2]);
+    if (ok) {
+      pos.seq = a[1];
+      pos.off = a[2];
     }
+  }
+  waiter_complete(r, pos);
+}
 
-    fwrite(s.c_str(), 1, s.length(), ftmp);
-    fputc('\n', ftmp);
-    kept++;
-  };
+static void agg_flush(void); // ver bulk_admit()
 
-  while ((c = fgetc(fin)) != EOF) {
-    if (c == '\r') continue;
-    if (c == '\n') {
-      if (line.length()) process_line(line);
-      line = "";
-      continue;
+static void maclog_handle(const sdring_rec_t &r) {
+  int64_t t0 = esp_timer_get_time();
+  // No toca la línea abierta: no corta rachas ni cambia de nivel
+  if (r.op == LOG_OP_CONSUME && useSDCard) {
+    consume_handle(r);
+    return;
+  }
+  if (r.op == LOG_OP_EVENT) {
+    s_stats.events++;
+    s_stats.bytes_in += r.len;
+    if (dup_absorb(r)) {
+      s_stats.collapsed++;
+      return;
+    }
+  }
+  // Cualquier otro registro corta la racha; si cambió de nivel, lo retenido
+  // abre línea en el nuevo
+  tier_switch(!useSDCard);
+  dup_flush();
+  if (r.op == LOG_OP_EVENT) {
+    dup_hold(r);
+    return;
+  }
+  // Al sellar para dormir/reiniciar, lo último resumido va en esta línea
+  if (r.op == LOG_OP_SHUTDOWN) agg_flush();
+  if (!useSDCard) {
+    flash_handle(r);
+    return;
+  }
+  if (r.op == LOG_OP_APPEND) {
+    if (!seg_append_obj(r.data, r.len)) return;
+    s_stats.bytes_in += r.len;
+    lat_note(SDJSON_LAT_APPEND, t0);
+
+  } else if (r.op == LOG_OP_NEWLINE) {
+    sdseg_end_line();
+    s_line_has_items = false; // nueva línea: tabla de claves vacía
+    // Quien espera quiere el '\n' en la tarjeta, sea cual sea la política
+    if (r.len) sdseg_flush_active(true);
+    else sdseg_commit_point(true);
+
+    sdjson_pos_t pos = active_pos();
+    waiter_complete(r, pos);
+    lat_note(SDJSON_LAT_NEWLINE, t0);
+    ESP_LOGI(TAG, "sdjson: NEWLINE escrito en %08lX:%lu",
+             (unsigned long)pos.seq, (unsigned long)pos.off);
+
+    // Frontera de línea: momento de rotar si cambió la franja horaria
+    if (sdseg_should_rotate(time(NULL)) && sdseg_seal_active()) lz_kick();
+
+  } else if (r.op == LOG_OP_ROTATE) {
+    if (s_line_has_items) {
+      sdseg_end_line();
+      s_line_has_items = false;
+    }
+    // Posición final del segmento que se sella ({0,0} si no había)
+    sdjson_pos_t pos = active_pos();
+    if (sdseg_seal_active()) lz_kick();
+    else pos.seq = pos.off = 0;
+    lat_note(SDJSON_LAT_ROTATE, t0);
+    waiter_complete(r, pos);
+
+  } else if (r.op == LOG_OP_PURGE) {
+    uint32_t max_age = 86400; // por defecto 24h
+    if (r.len == sizeof(uint32_t)) {
+      uint32_t v;
+      memcpy(&v, r.data, sizeof(v));
+      if (v > 0) max_age = v;
+    }
+    ESP_LOGI(TAG, "sdjson: PURGE older than %u s (offline)", (unsigned)max_age);
+    do_purge_older_than(max_age);
+    lat_note(SDJSON_LAT_PURGE, t0);
+
+  } else if (r.op == LOG_OP_FLUSH) {
+    for (int i = 0; i < SDJSON_STREAMS; i++) {
+      stream_drain((sdjson_stream_t)i);
+      stream_sync((sdjson_stream_t)i);
+    }
+    sdseg_flush_active(true);
+    lat_note(SDJSON_LAT_COMMIT, t0);
+    waiter_complete(r, active_pos());
+
+  } else if (r.op == LOG_OP_SHUTDOWN) {
+    // Todo lo anterior ya está escrito: cierra la línea, vacía los flujos y
+    // sella (cabecera SEALED + fsync) para arrancar sin recuperación
+    if (s_line_has_items) {
+      sdseg_end_line();
+      s_line_has_items = false;
     }
-    line += (char)c;
-    if (line.length() > 8192) {
-      process_line(line);
-      line = "";
+    for (int i = 0; i < SDJSON_STREAMS; i++) {
+      stream_drain((sdjson_stream_t)i);
+      stream_sync((sdjson_stream_t)i);
     }
+    sdjson_pos_t pos = active_pos();
+    if (!sdseg_seal_active()) pos.seq = pos.off = 0;
+    lat_note(SDJSON_LAT_ROTATE, t0);
+    waiter_complete(r, pos);
   }
-  if (line.length()) process_line(line);
+}
 
-  fflush(ftmp); fsync(fileno(ftmp));
-  fclose(ftmp);
-  fclose(fin);
+static inline bool spill_pending(void) {
+  return sdring_used(&s_spill_ring) != 0;
+}
 
-  remove(fullpath);
-  rename(tmppath, fullpath);
+static inline uint32_t stage_now_ms(void) {
+  uint32_t ms = (uint32_t)(esp_timer_get_time() / 1000);
+  return ms ? ms : 1; // 0 = escalón vacío
+}
 
-  ESP_LOGI(TAG, "sdjson: sanity on boot -> kept=%u dropped=%u", (unsigned)kept, (unsigned)dropped);
+static inline uint32_t stage_pct(uint32_t used) {
+  return used * 100 / s_log_ring.size;
 }
 
-/* =================== TAREA WRITER =================== */
+// ms hasta el próximo vaciado del anillo (UINT32_MAX = vacío). El plazo
+// baja en línea recta con el llenado: entero con el anillo vacío, 0 al
+// llegar a SDJSON_STAGE_FLUSH_PCT.
+static uint32_t stage_due_ms(void) {
+  uint32_t since = s_stage_since;
+  if (!since) return UINT32_MAX;
+  uint32_t pct = stage_pct(sdring_used(&s_log_ring));
+  if (SDJSON_STAGE_DEADLINE_MS == 0 || pct >= SDJSON_STAGE_FLUSH_PCT) return 0;
+  uint32_t wait = SDJSON_STAGE_DEADLINE_MS * (SDJSON_STAGE_FLUSH_PCT - pct) /
+                  SDJSON_STAGE_FLUSH_PCT;
+  uint32_t age = stage_now_ms() - since;
+  return age >= wait ? 0 : wait - age;
+}
+
+static void stage_drain(void) {
+  // Lo que llegue mientras se vacía vuelve a fijar el plazo
+  s_drain_since = s_stage_since ? s_stage_since : stage_now_ms();
+  s_stage_since = 0;
+  // Primero el anillo principal: lo desbordado siempre es posterior
+  sdring_rec_t r;
+  bool store = useSDCard || sdflash_ready();
+  while (!s_stop_req && sdring_peek(&s_log_ring, &r)) {
+    if (store) maclog_handle(r);
+    sdring_pop(&s_log_ring, &r);
+  }
+  while (!s_stop_req && sdring_peek(&s_spill_ring, &r)) {
+    if (store) maclog_handle(r);
+    sdring_pop(&s_spill_ring, &r);
+  }
+  s_drain_since = 0;
+}
 
 static void maclog_writer_task(void* arg) {
-  logrec_t r;
-  int n_since_flush = 0;
   for (;;) {
-    if (xQueueReceive(s_log_queue, &r, portMAX_DELAY) != pdTRUE) continue;
-    if (!useSDCard) continue;
-    if (!maclog_file && !open_maclog_file()) continue;
-
-    if (r.op == LOG_OP_APPEND) {
-      // Si ya hay datos en la línea, anteponemos coma
-      if (s_line_has_items) fputc(',', maclog_file);
-      fputs(r.raw, maclog_file);
-      s_line_has_items = true;
-
-    } else if (r.op == LOG_OP_NEWLINE) {
-      fputc('\n', maclog_file);
-      s_line_has_items = false; // nueva línea empezará sin coma
-      fflush(maclog_file);
-      s_newline_ack_counter++;  // ACK: notificar a quien espera
-
-      long pos = ftell(maclog_file);
-      ESP_LOGI(TAG, "sdjson: NEWLINE escrito (pos=%ld, ack=%u)",
-               pos, (unsigned)s_newline_ack_counter);
-
-    } else if (r.op == LOG_OP_PURGE) {
-      uint32_t max_age = 86400; // por defecto 24h
-      if (r.raw[0]) {
-        unsigned long v = strtoul(r.raw, NULL, 10);
-        if (v > 0) max_age = (uint32_t)v;
+    // Dormimos hasta que un productor avise o venza algún plazo (escalón,
+    // commit por intervalo o flujos de texto)
+    uint32_t due = sdseg_commit_due_ms();
+    uint32_t sdue = streams_due_ms();
+    if (sdue < due) due = sdue;
+    sdue = stage_due_ms();
+    if (sdue < due) due = sdue;
+    sdue = sdflash_due_ms();
+    if (sdue < due) due = sdue;
+    sdue = dup_due_ms();
+    if (sdue < due) due = sdue;
+    ulTaskNotifyTake(pdTRUE, (due == UINT32_MAX) ? portMAX_DELAY
+                                                 : pdMS_TO_TICKS(due) + 1);
+    if (s_stop_req) break;
+
+    // Ha aparecido la tarjeta: lo guardado en la flash va antes que el anillo
+    if (useSDCard && sdflash_pending()) flash_migrate();
+
+    bool urgent = s_stage_urgent || spill_pending();
+    s_stage_urgent = false;
+    uint32_t pct = stage_pct(sdring_used(&s_log_ring));
+    if (urgent || stage_due_ms() == 0) {
+      bool by_deadline = !urgent && pct < SDJSON_STAGE_FLUSH_PCT;
+      stage_drain();
+      // Plazo vencido: lo vaciado va ya a la tarjeta con fsync
+      if (by_deadline && SDJSON_STAGE_DEADLINE_MS && useSDCard) {
+        int64_t t0 = esp_timer_get_time();
+        sdseg_flush_active(true);
+        lat_note(SDJSON_LAT_COMMIT, t0);
       }
-      ESP_LOGI(TAG, "sdjson: PURGE older than %u s (offline)", (unsigned)max_age);
-      do_purge_older_than(max_age);
-
-    } else { // LOG_OP_PING
-      // No escribimos nada; sirve para asegurar que está viva
-      s_newline_ack_counter++;  // Reutilizamos el contador para ping/ack
+      portENTER_CRITICAL(&s_stats_mux);
+      if (by_deadline) s_stats.stage_deadline++;
+      else s_stats.stage_fill++;
+      portEXIT_CRITICAL(&s_stats_mux);
+    }
+    // Racha retenida hasta su plazo sin que nada la corte: a la tarjeta
+    // con fsync, como lo vaciado por plazo
+    if (dup_due_ms() == 0) {
+      tier_switch(!useSDCard);
+      dup_flush();
+      if (SDJSON_STAGE_DEADLINE_MS && useSDCard) sdseg_flush_active(true);
     }
+    // CSV y log del sistema, cada uno con su fichero y su fsync
+    for (int i = 0; i < SDJSON_STREAMS; i++) stream_drain((sdjson_stream_t)i);
+    if (useSDCard && sdseg_commit_due_ms() == 0) {
+      int64_t t0 = esp_timer_get_time();
+      sdseg_commit_tick();
+      lat_note(SDJSON_LAT_COMMIT, t0);
+    }
+    if (!useSDCard && sdflash_due_ms() == 0) sdflash_sync(false);
+  }
+  // Aquí no se tiene ningún mutex: sdjson_logger_stop() sigue desde aquí
+  s_log_task = NULL;
+  xEventGroupSetBits(s_done_ev, WRITER_EXIT_BIT);
+  vTaskDelete(NULL);
+}
 
-    if (++n_since_flush >= SDJSON_FLUSH_EVERY) {
-      fflush(maclog_file);
-      n_since_flush = 0;
+// Anillos y eventos de la writer. No necesita la tarjeta: se llama antes de
+// montarla para guardar en RAM lo que llegue mientras tanto.
+static bool stage_start(void) {
+  if (!s_log_ring_buf) {
+    uint32_t size = SDJSON_RING_SIZE;
+#ifdef BOARD_HAS_PSRAM
+    s_log_ring_buf = (uint8_t *)heap_caps_malloc(SDJSON_STAGE_PSRAM_SIZE,
+                                                 MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (s_log_ring_buf) size = SDJSON_STAGE_PSRAM_SIZE;
+    else ESP_LOGW(TAG, "sdjson: no PSRAM for the staging ring, using heap");
+#endif
+    s_ring_psram = s_log_ring_buf != NULL;
+    if (!s_log_ring_buf) s_log_ring_buf = (uint8_t *)malloc(size);
+    if (!s_log_ring_buf || !sdring_init(&s_log_ring, s_log_ring_buf, size)) {
+      free(s_log_ring_buf);
+      s_log_ring_buf = NULL;
+      return false;
     }
+    ESP_LOGI(TAG, "sdjson: staging ring %u KB in %s", (unsigned)(size / 1024),
+             s_ring_psram ? "PSRAM" : "heap");
   }
+  if (!s_spill_buf) {
+    s_spill_buf = (uint8_t *)malloc(SDJSON_SPILL_SIZE);
+    if (!s_spill_buf || !sdring_init(&s_spill_ring, s_spill_buf, SDJSON_SPILL_SIZE)) {
+      free(s_spill_buf);
+      s_spill_buf = NULL;
+      return false;
+    }
+  }
+  if (!s_done_ev && !(s_done_ev = xEventGroupCreate())) return false;
+  return true;
 }
 
 bool sdjson_logger_start(void) {
-  if (!useSDCard) return false;
-  if (!s_log_queue) s_log_queue = xQueueCreate(SDJSON_QUEUE_LEN, sizeof(logrec_t));
-  if (!s_log_queue) return false;
+  if ((!useSDCard && !sdflash_ready()) || !stage_start()) return false;
   if (!s_log_task) {
     s_line_has_items = false;
+    s_stop_req = false;
     xTaskCreatePinnedToCore(maclog_writer_task, "maclog_writer", 4096, NULL, 1, &s_log_task, 1);
   }
+#if SDSEG_COMPRESS
+  // No se borra en sdjson_logger_stop(): podría quedarse con el mutex de sdseg
+  if (!s_lz_task)
+    xTaskCreatePinnedToCore(maclog_lz_task, "maclog_lz", 4096, NULL, 0, &s_lz_task, 1);
+#endif
+  s_log_ring_ready = true;
+  // Lo que se encoló con la writer parada se escribe ya
+  s_stage_urgent = true;
+  if (s_log_task) xTaskNotifyGive(s_log_task);
   return true;
 }
 
-void sdjson_logger_stop(void) {
-  if (s_log_task)   { vTaskDelete(s_log_task);   s_log_task = NULL; }
-  if (s_log_queue)  { vQueueDelete(s_log_queue); s_log_queue = NULL; }
-  if (maclog_file)  { fflush(maclog_file); fclose(maclog_file); maclog_file = NULL; }
+// false si la writer no paró a tiempo: entonces no se toca nada de la
+// tarjeta (sigue siendo suya) y el activo se recupera al arrancar
+bool sdjson_logger_stop(void) {
+  // El anillo no se libera: un productor concurrente nunca ve memoria liberada
+  s_log_ring_ready = false;
+  TaskHandle_t task = s_log_task;
+  if (task) {
+    xEventGroupClearBits(s_done_ev, WRITER_EXIT_BIT);
+    s_stop_req = true;
+    xTaskNotifyGive(task);
+    EventBits_t bits = xEventGroupWaitBits(s_done_ev, WRITER_EXIT_BIT, pdTRUE, pdTRUE,
+                                           pdMS_TO_TICKS(SDJSON_STOP_WAIT_MS));
+    if (!(bits & WRITER_EXIT_BIT)) {
+      ESP_LOGW(TAG, "sdjson: writer still busy after %u ms, active segment left unsealed",
+               (unsigned)SDJSON_STOP_WAIT_MS);
+      return false;
+    }
+  }
+  dup_flush();
+  agg_flush();
+  line_close();
+  sdseg_seal_active();
+  sdflash_seal(); // sin tarjeta, el trozo abierto queda listo para subir
+  // Sin writer: lo que quede en los anillos se escribe aquí mismo
+  for (int i = 0; i < SDJSON_STREAMS; i++) {
+    stream_drain((sdjson_stream_t)i);
+    stream_close((sdjson_stream_t)i);
+  }
+  return true;
 }
 
-/* compat: usado por libpax.cpp y wifi_post.cpp directamente */
-extern "C" void sdcard_append_jsonl(const char *chunk) {
-  if (!chunk || !s_log_queue) return;
-  logrec_t r = {};
-  r.op = LOG_OP_APPEND;
-  strncpy(r.raw, chunk, sizeof(r.raw)-1);
-  r.raw[sizeof(r.raw)-1] = '\0';
-
+static void wake_writer(void) {
+  TaskHandle_t task = s_log_task;
+  if (!task) return; // se escribirá al rearrancar la writer
   if (xPortInIsrContext()) {
     BaseType_t hpw = pdFALSE;
-    (void) xQueueSendFromISR(s_log_queue, &r, &hpw);
+    vTaskNotifyGiveFromISR(task, &hpw);
     if (hpw) portYIELD_FROM_ISR();
   } else {
-    (void) xQueueSend(s_log_queue, &r, 0);
+    xTaskNotifyGive(task);
   }
 }
 
+// Tramo de llenado (cuartos de SDJSON_STAGE_FLUSH_PCT): la writer se
+// despierta al cambiar de tramo para recalcular el plazo
+static inline uint32_t stage_step(uint32_t used) {
+  uint32_t step = stage_pct(used) * 4 / SDJSON_STAGE_FLUSH_PCT;
+  return step < 4 ? step : 4;
+}
+
+// Encola un registro en el escalón. Lo crítico usa el desbordamiento si el
+// anillo principal está lleno o ya se desbordó. Solo se despierta a la
+// writer (tarea o ISR) para lo que no puede esperar al plazo, con el primer
+// registro (arma el plazo) y al cambiar de tramo de llenado.
+static bool enqueue(logop_t op, const void *data, size_t len, bool critical) {
+  if (!s_log_ring_ready || (s_closing && op != LOG_OP_SHUTDOWN)) return false;
+  // Peticiones con ticket, sellados, purgas y flush: ya
+  bool urgent = op != LOG_OP_APPEND && op != LOG_OP_EVENT &&
+                !(op == LOG_OP_NEWLINE && len == 0);
+  uint32_t before = sdring_used(&s_log_ring);
+  bool ok = !(critical && spill_pending()) &&
+            sdring_push(&s_log_ring, (uint8_t)op, data, len);
+  if (!ok && critical) {
+    ok = sdring_push(&s_spill_ring, (uint8_t)op, data, len);
+    if (ok) {
+      urgent = true;
+      portENTER_CRITICAL_SAFE(&s_stats_mux);
+      s_stats.spilled++;
+      portEXIT_CRITICAL_SAFE(&s_stats_mux);
+    }
+  }
+  if (!ok) return false;
+  bool first = s_stage_since == 0;
+  if (first) s_stage_since = stage_now_ms();
+  if (urgent) s_stage_urgent = true;
+  if (urgent || first || SDJSON_STAGE_DEADLINE_MS == 0 ||
+      stage_step(before) != stage_step(sdring_used(&s_log_ring)))
+    wake_writer();
+  // Montaje aplazado (SLEEPCYCLE): la tarjeta se enciende cuando el
+  // escalón tiene bastante que escribir
+  if (s_mount_state == SDCARD_MOUNT_DEFERRED && !xPortInIsrContext() &&
+      stage_pct(sdring_used(&s_log_ring)) >= SDJSON_STAGE_FLUSH_PCT)
+    sdcard_mount_now(0);
+  return true;
+}
+
+// Texto para un flujo; si su anillo está lleno se pierde y se cuenta
+static bool stream_push(sdjson_stream_t id, const char *text, size_t len) {
+  text_stream_t *s = &s_streams[id];
+  if (!s->buf || !s->f || len == 0) return false;
+  if (s_closing || !sdring_push(&s->ring, 0, text, len)) {
+    portENTER_CRITICAL_SAFE(&s_stats_mux);
+    s_stats.streams[id].drops++;
+    portEXIT_CRITICAL_SAFE(&s_stats_mux);
+    return false;
+  }
+  wake_writer();
+  return true;
+}
+
+#if (SDLOGGING)
+// Salida de ESP_LOGx: a la UART como siempre y una copia al flujo de log
+static int print_to_sd_card(const char *fmt, va_list args) {
+  char line[SDJSON_SYSLOG_LINE_MAX];
+  va_list copy;
+  va_copy(copy, args);
+  int n = vsnprintf(line, sizeof(line), fmt, copy);
+  va_end(copy);
+  if (n > 0) {
+    size_t len = ((size_t)n < sizeof(line)) ? (size_t)n : sizeof(line) - 1;
+    if ((size_t)n >= sizeof(line)) line[len - 1] = '\n'; // recortada
+    stream_push(SDJSON_STREAM_SYSLOG, line, len);
+  }
+  return vprintf(fmt, args);
+}
+#endif
+
+static bool log_push(logop_t op, const void *data, size_t len, bool critical) {
+  if (enqueue(op, data, len, critical)) return true;
+  note_drop(xPortInIsrContext(), critical);
+  return false;
+}
+
+/* ---- Degradación de eventos MAC bajo presión ---- */
+
+static uint32_t s_agg_sec = 0;   // segundo que se está resumiendo
+static uint32_t s_agg_count = 0; // eventos resumidos en ese segundo
+static uint32_t s_sample_seq = 0;
+
+static inline size_t agg_format(char *line, size_t cap, uint32_t sec,
+                                uint32_t count) {
+  int n = snprintf(line, cap, "{\"t\":%lu,\"agg\":%lu}", (unsigned long)sec,
+                   (unsigned long)count);
+  return (n > 0 && (size_t)n < cap) ? (size_t)n : 0;
+}
+
+static void agg_count(bool stored, uint32_t count) {
+  portENTER_CRITICAL(&s_stats_mux);
+  if (stored) s_stats.summaries++;
+  else s_stats.lost_bulk += count;
+  portEXIT_CRITICAL(&s_stats_mux);
+}
+
+// Encola el resumen {"t","agg"} de lo acumulado (fuera del spinlock)
+static void agg_emit(uint32_t sec, uint32_t count) {
+  if (count == 0) return;
+  char line[48];
+  size_t n = agg_format(line, sizeof(line), sec, count);
+  agg_count(enqueue(LOG_OP_APPEND, line, n, false), count);
+}
+
+// Desde la writer, al cerrar: el resumen que aún acumulan los productores
+// no saldría hasta el siguiente evento, que ya no llega. Se escribe
+// directamente en el nivel de la línea abierta.
+static void agg_flush(void) {
+  portENTER_CRITICAL(&s_stats_mux);
+  uint32_t sec = s_agg_sec, count = s_agg_count;
+  s_agg_count = 0;
+  portEXIT_CRITICAL(&s_stats_mux);
+  if (count == 0) return;
+  char line[48];
+  size_t n = agg_format(line, sizeof(line), sec, count);
+  agg_count(tier_append((const uint8_t *)line, n), count);
+}
+
+// Decide si un evento MAC se guarda tal cual. Si no, se cuenta en el
+// resumen de su segundo; el resumen anterior sale al cambiar de segundo o
+// cuando vuelve a haber sitio.
+static bool bulk_admit(void) {
+  uint32_t pct = sdring_used(&s_log_ring) * 100 / s_log_ring.size;
+  uint32_t now = (uint32_t)time(NULL);
+  bool admit;
+  uint32_t emit_sec = 0, emit_count = 0;
+
+  portENTER_CRITICAL(&s_stats_mux);
+  if (spill_pending() || pct >= SDJSON_AGG_PCT) admit = false;
+  else if (pct >= SDJSON_SAMPLE_PCT) admit = (s_sample_seq++ % SDJSON_SAMPLE_EVERY) == 0;
+  else admit = true;
+
+  if (s_agg_count && (admit || now != s_agg_sec)) {
+    emit_sec = s_agg_sec;
+    emit_count = s_agg_count;
+    s_agg_count = 0;
+  }
+  if (!admit) {
+    s_agg_sec = now;
+    s_agg_count++;
+    s_stats.degraded++;
+  }
+  portEXIT_CRITICAL(&s_stats_mux);
+
+  agg_emit(emit_sec, emit_count);
+  return admit;
+}
+
+/* compat: usado por libpax.cpp; eventos MAC (prioridad baja) */
+extern "C" void sdcard_append_jsonl(const char *chunk) {
+  if (!s_first_event_us) s_first_event_us = esp_timer_get_time();
+  if (!chunk || !s_log_ring_ready) return;
+  if (!useSDCard) s_premount_events++; // en RAM hasta que monte la tarjeta
+  size_t len = strnlen(chunk, SDJSON_REC_MAXLEN + 1);
+  if (len == 0 || len > SDJSON_REC_MAXLEN) return; // nunca truncamos un objeto
+  // Desde ISR no hay time(): sin degradación, solo se cuenta si no cabe
+  if (!xPortInIsrContext() && !bulk_admit()) return;
+  (void) log_push(LOG_OP_EVENT, chunk, len, false);
+}
+
+/* Recuentos {t,w} de wifi_post.cpp: nunca se degradan */
+extern "C" void sdcard_append_jsonl_critical(const char *chunk) {
+  if (!chunk) return;
+  size_t len = strnlen(chunk, SDJSON_REC_MAXLEN + 1);
+  if (len == 0 || len > SDJSON_REC_MAXLEN) return;
+  (void) log_push(LOG_OP_APPEND, chunk, len, true);
+}
+
 /* Cerrar la línea actual (asíncrono) */
 extern "C" void sdcard_newline(void) {
-  if (!s_log_queue) return;
-  logrec_t r = {};
-  r.op = LOG_OP_NEWLINE;
+  (void) log_push(LOG_OP_NEWLINE, NULL, 0, true);
+}
 
-  if (xPortInIsrContext()) {
-    BaseType_t hpw = pdFALSE;
-    (void) xQueueSendFromISR(s_log_queue, &r, &hpw);
-    if (hpw) portYIELD_FROM_ISR();
-  } else {
-    (void) xQueueSend(s_log_queue, &r, 0);
+/* Encola 'op' con un ticket (y 'arg' detrás) y espera a que la writer lo
+   complete. El anillo lleno se reintenta cada tick hasta el timeout. */
+static bool log_request_sync(logop_t op, uint32_t timeout_ms, sdjson_pos_t *pos,
+                             const void *arg = NULL, size_t arg_len = 0) {
+  if (!s_log_ring_ready || !s_done_ev) return false;
+  uint8_t req[sizeof(uint32_t) + 8];
+  if (arg_len > sizeof(req) - sizeof(uint32_t)) return false;
+  uint32_t ticket;
+  if (!waiter_acquire(&ticket)) return false;
+  memcpy(req, &ticket, sizeof(ticket));
+  if (arg_len) memcpy(req + sizeof(ticket), arg, arg_len);
+
+  TickType_t start = xTaskGetTickCount();
+  TickType_t limit = pdMS_TO_TICKS(timeout_ms);
+  bool ok;
+  while (!(ok = enqueue(op, req, sizeof(ticket) + arg_len, true)) &&
+         xTaskGetTickCount() - start < limit)
+    vTaskDelay(1);
+  if (!ok) note_drop(false, true);
+
+  if (ok) {
+    TickType_t spent = xTaskGetTickCount() - start;
+    EventBits_t bit = slot_bit(ticket_slot(ticket));
+    ok = (xEventGroupWaitBits(s_done_ev, bit, pdTRUE, pdTRUE,
+                              spent < limit ? limit - spent : 0) & bit) != 0;
   }
+  waiter_release(ticket, ok ? pos : NULL);
+  return ok;
 }
 
-/* Ping simple a la tarea writer (para confirmar que está viva) */
-static void sdcard_ping_async(void) {
-  if (!s_log_queue) return;
-  logrec_t r = {};
-  r.op = LOG_OP_PING;
-  (void) xQueueSend(s_log_queue, &r, 0);
+/* Cerrar la línea actual y ESPERAR a que el '\n' esté en la tarjeta (fsync).
+   'pos' recibe el segmento y el offset justo tras el fin de línea. */
+extern "C" bool sdcard_newline_sync_at(uint32_t timeout_ms, sdjson_pos_t *pos) {
+  return log_request_sync(LOG_OP_NEWLINE, timeout_ms, pos);
 }
 
-/* Cerrar la línea actual y ESPERAR a que el '\n' esté realmente escrito */
 extern "C" bool sdcard_newline_sync(uint32_t timeout_ms) {
-  if (!s_log_queue) return false;
-  uint32_t start_ack = s_newline_ack_counter;
+  return sdcard_newline_sync_at(timeout_ms, NULL);
+}
 
-  // Enviamos la orden de salto de línea
-  sdcard_newline();
+/* commit + fsync de todos los flujos, hecho por la writer (no bloquea) */
+void sdcard_flush(void) {
+  (void) log_push(LOG_OP_FLUSH, NULL, 0, true);
+}
 
-  // Espera activa simple (ticks de FreeRTOS)
-  uint32_t waited = 0;
-  const uint32_t step = 5; // ms
-  while (waited < timeout_ms) {
-    if (s_newline_ack_counter != start_ack) return true; // se procesó
-    vTaskDelay(pdMS_TO_TICKS(step));
-    waited += step;
+/* Lo mismo, esperando a la writer: al volver, todo lo encolado antes está
+   en la tarjeta y el final estable del activo (sdseg_stable_end) lo cubre */
+bool sdcard_flush_sync(uint32_t timeout_ms) {
+  return log_request_sync(LOG_OP_FLUSH, timeout_ms, NULL);
+}
 
-    // por si la cola estaba llena y no avanzó, intentamos un ping
-    sdcard_ping_async();
+/* Antes de dormir o reiniciar: corta a los productores, espera como mucho
+   'budget_ms' a que la writer vacíe los anillos y selle el segmento activo
+   con fsync. Si no le da tiempo, dice cuánto se queda sin escribir. */
+extern "C" bool sdjson_shutdown(uint32_t budget_ms) {
+  if (s_mount_state == SDCARD_MOUNT_DEFERRED && s_log_ring_ready) {
+    // Ciclo sin montar: solo se enciende la tarjeta si quedó algo en RAM
+    s_closing = true;
+    if (sdring_used(&s_log_ring) == 0 && sdring_used(&s_spill_ring) == 0) {
+      ESP_LOGI(TAG, "sdjson: nothing to write, SD not mounted this cycle");
+      return true;
+    }
+    if (!mount_sync() && !sdflash_ready()) {
+      ESP_LOGW(TAG, "sdjson: SD mount failed, %u B events, %u B critical not written",
+               (unsigned)sdring_used(&s_log_ring), (unsigned)sdring_used(&s_spill_ring));
+      return false;
+    }
+  }
+  if ((!useSDCard && !sdflash_ready()) || !s_log_ring_ready) return true;
+  s_closing = true;
+  int64_t t0 = esp_timer_get_time();
+
+  bool ok;
+  if (s_log_task) {
+    ok = log_request_sync(LOG_OP_SHUTDOWN, budget_ms, NULL);
+  } else {
+    // Writer parada: se escribe desde aquí (ya no hay productores)
+    sdring_rec_t r;
+    while (sdring_peek(&s_log_ring, &r)) { maclog_handle(r); sdring_pop(&s_log_ring, &r); }
+    while (sdring_peek(&s_spill_ring, &r)) { maclog_handle(r); sdring_pop(&s_spill_ring, &r); }
+    sdring_rec_t end = {LOG_OP_SHUTDOWN, 0, NULL, 0};
+    maclog_handle(end);
+    ok = true;
+  }
+
+  if (useSDCard) sdacct_save(true); // lo que se llevaba de esta sesión
+  uint32_t ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+  if (ok) {
+    ESP_LOGI(TAG, "sdjson: shutdown drained and sealed in %u ms", (unsigned)ms);
+    return true;
+  }
+  uint32_t text = 0;
+  for (int i = 0; i < SDJSON_STREAMS; i++)
+    if (s_streams[i].buf) text += sdring_used(&s_streams[i].ring);
+  ESP_LOGW(TAG, "sdjson: shutdown budget (%u ms) expired: %u B events, %u B critical, "
+                "%u B csv/log not written",
+           (unsigned)budget_ms, (unsigned)sdring_used(&s_log_ring),
+           (unsigned)sdring_used(&s_spill_ring), (unsigned)text);
+  return false;
+}
+
+/* Sellar el segmento activo y ESPERAR a que la writer lo cierre.
+   Tras esto, todo lo escrito hasta ahora está en segmentos sellados. */
+extern "C" bool sdjson_rotate_sync(uint32_t timeout_ms) {
+  return log_request_sync(LOG_OP_ROTATE, timeout_ms, NULL);
+}
+
+/*========================
+ *  Estadísticas de la writer
+ *========================*/
+
+void sdjson_get_backlog(sdjson_backlog_t *out) {
+  memset(out, 0, sizeof(*out));
+  if (useSDCard) sdseg_backlog(&out->seg);
+  if (sdflash_ready()) {
+    sdflash_stats_t fs;
+    sdflash_get_stats(&fs);
+    out->flash_chunks = fs.chunks;
+    out->flash_lines = fs.lines;
+    out->flash_bytes = fs.used;
+  }
+}
+
+void sdjson_get_stats(sdjson_stats_t *out) {
+  portENTER_CRITICAL(&s_stats_mux);
+  *out = s_stats;
+  portEXIT_CRITICAL(&s_stats_mux);
+  out->ring_size = s_log_ring_buf ? s_log_ring.size : 0;
+  out->ring_hwm = s_log_ring_buf ? s_log_ring.hwm : 0;
+  out->ring_psram = s_ring_psram;
+  out->mount_state = s_mount_state;
+  out->mount_ms = (uint32_t)(s_mount_us / 1000);
+  out->first_event_ms = (uint32_t)(s_first_event_us / 1000);
+  out->premount_events = s_premount_events;
+  sdseg_commit_stats_t cs;
+  sdseg_get_commit_stats(&cs);
+  out->bytes_card = cs.bytes;
+}
+
+// Cota superior (µs) del cubo donde cae el percentil 'pct'
+static uint32_t lat_percentile(const uint32_t *h, uint32_t n, uint32_t pct) {
+  uint32_t want = (uint32_t)(((uint64_t)n * pct + 99) / 100), acc = 0;
+  for (uint32_t b = 0; b < SDJSON_LAT_BUCKETS; b++) {
+    acc += h[b];
+    if (acc >= want) return 1UL << b;
+  }
+  return 1UL << (SDJSON_LAT_BUCKETS - 1);
+}
+
+void sdjson_log_stats(void) {
+  if ((s_mount_state == SDCARD_MOUNTING || s_mount_state == SDCARD_MOUNT_TIMEOUT) &&
+      s_first_event_us)
+    ESP_LOGW(TAG, "sdjson: SD %s, first sniff at %u ms, %u event(s) in RAM",
+             s_mount_state == SDCARD_MOUNTING ? "still mounting" : "not mounted",
+             (unsigned)(s_first_event_us / 1000), (unsigned)s_premount_events);
+  if (sdflash_ready()) {
+    sdflash_stats_t fs;
+    sdflash_get_stats(&fs);
+    ESP_LOGI(TAG, "sdjson: flash %u/%u B, wrote %u B in %u fsyncs, wrapped %u, lost %u B, "
+                  "migrated %u, sent %u",
+             (unsigned)fs.used, (unsigned)fs.cap, (unsigned)fs.bytes,
+             (unsigned)fs.syncs, (unsigned)fs.wrapped, (unsigned)fs.lost,
+             (unsigned)fs.migrated, (unsigned)fs.sent);
+  }
+  sdrtc_stats_t rs;
+  sdrtc_get_stats(&rs);
+  if (rs.kept)
+    ESP_LOGI(TAG, "sdjson: rtc %u/%u counts, %u sleep(s) since flush, %u kept, "
+                  "%u flushed in %u batch(es), %u lost",
+             (unsigned)rs.used, (unsigned)SDRTC_SLOTS, (unsigned)rs.cycles,
+             (unsigned)rs.kept, (unsigned)rs.flushed, (unsigned)rs.flushes,
+             (unsigned)rs.lost);
+  if (!useSDCard) return;
+  static const char *const names[SDJSON_LAT_OPS] = {"append", "newline",
+                                                    "rotate", "purge", "commit"};
+  static int64_t s_last_us = 0;
+  static uint64_t s_last_in = 0, s_last_card = 0;
+
+  sdjson_stats_t st;
+  sdjson_get_stats(&st);
+  int64_t now = esp_timer_get_time();
+  uint32_t dt_ms = s_last_us ? (uint32_t)((now - s_last_us) / 1000) : 0;
+  uint32_t in_bps = dt_ms ? (uint32_t)((st.bytes_in - s_last_in) * 1000 / dt_ms) : 0;
+  uint32_t card_bps = dt_ms ? (uint32_t)((st.bytes_card - s_last_card) * 1000 / dt_ms) : 0;
+  s_last_us = now;
+  s_last_in = st.bytes_in;
+  s_last_card = st.bytes_card;
+
+  ESP_LOGI(TAG, "sdjson: drops task=%u isr=%u | ring hwm %u/%u B (%s) | in %u B/s, card %u B/s",
+           (unsigned)st.drops_task, (unsigned)st.drops_isr,
+           (unsigned)st.ring_hwm, (unsigned)st.ring_size,
+           st.ring_psram ? "psram" : "heap", (unsigned)in_bps, (unsigned)card_bps);
+  if (st.first_event_ms)
+    ESP_LOGI(TAG, "sdjson: boot -> first sniff %u ms, SD ready %u ms, %u event(s) buffered before mount",
+             (unsigned)st.first_event_ms, (unsigned)st.mount_ms,
+             (unsigned)st.premount_events);
+  ESP_LOGI(TAG, "sdjson: stage drains fill=%u deadline=%u (flush %u%%, %u ms)",
+           (unsigned)st.stage_fill, (unsigned)st.stage_deadline,
+           (unsigned)SDJSON_STAGE_FLUSH_PCT, (unsigned)SDJSON_STAGE_DEADLINE_MS);
+  static const char *const snames[SDJSON_STREAMS] = {"csv", "syslog"};
+  for (int i = 0; i < SDJSON_STREAMS; i++)
+    if (st.streams[i].bytes || st.streams[i].drops)
+      ESP_LOGI(TAG, "sdjson: %s %u B, %u fsyncs, %u dropped", snames[i],
+               (unsigned)st.streams[i].bytes, (unsigned)st.streams[i].syncs,
+               (unsigned)st.streams[i].drops);
+  if (st.degraded || st.lost_bulk || st.spilled || st.lost_critical)
+    ESP_LOGW(TAG, "sdjson: mac degraded=%u (%u summaries) lost=%u | critical spilled=%u lost=%u",
+             (unsigned)st.degraded, (unsigned)st.summaries,
+             (unsigned)st.lost_bulk, (unsigned)st.spilled,
+             (unsigned)st.lost_critical);
+  if (st.events)
+    ESP_LOGI(TAG, "sdjson: dedup %u of %u event(s) collapsed (%u%%)",
+             (unsigned)st.collapsed, (unsigned)st.events,
+             (unsigned)((uint64_t)st.collapsed * 100 / st.events));
+
+  sdseg_lz_stats_t lz;
+  sdseg_get_lz_stats(&lz);
+  if (lz.segments && lz.comp_bytes && lz.json_bytes)
+    ESP_LOGI(TAG, "sdjson: lz %u segs, bin %u KB / json %u KB -> %u KB (x%u.%02u), %u ms/MB",
+             (unsigned)lz.segments, (unsigned)(lz.raw_bytes / 1024),
+             (unsigned)(lz.json_bytes / 1024), (unsigned)(lz.comp_bytes / 1024),
+             (unsigned)(lz.json_bytes / lz.comp_bytes),
+             (unsigned)(lz.json_bytes * 100 / lz.comp_bytes % 100),
+             (unsigned)(lz.cpu_us * 1024 * 1024 / 1000 / lz.json_bytes));
+
+  sdenc_stats_t es;
+  sdenc_get_stats(&es);
+  if (es.bytes && es.cpu_us)
+    ESP_LOGI(TAG, "sdjson: aes-ctr %u KB, %u ms/MB (%u KB/s)",
+             (unsigned)(es.bytes / 1024),
+             (unsigned)(es.cpu_us * 1024 * 1024 / 1000 / es.bytes),
+             (unsigned)(es.bytes * 1000000 / 1024 / es.cpu_us));
+
+  // Desgaste: totales de la tarjeta desde que se vio por primera vez
+  sdacct_save(false);
+  sdacct_totals_t ac;
+  sdacct_get(&ac);
+  uint32_t waf = sdacct_waf_x100(&ac);
+  ESP_LOGI(TAG, "sdjson: card %08lX since %lu, %u mount(s), %u fsyncs, %u error(s), WAF x%u.%02u",
+           (unsigned long)ac.card_id, (unsigned long)ac.since,
+           (unsigned)ac.mounts, (unsigned)ac.fsyncs, (unsigned)ac.errors,
+           (unsigned)(waf / 100), (unsigned)(waf % 100));
+  static const char *const anames[SDACCT_REASONS] = {"append", "purge", "compact",
+                                                     "sanitize", "cursor"};
+  for (int i = 0; i < SDACCT_REASONS; i++)
+    if (ac.writes[i])
+      ESP_LOGI(TAG, "sdjson: card %-8s %u writes, %u KB -> %u KB", anames[i],
+               (unsigned)ac.writes[i], (unsigned)(ac.logical[i] / 1024),
+               (unsigned)(ac.physical[i] / 1024));
+
+  // Backlog según los contadores de la writer y el manifiesto (sin tocar
+  // la tarjeta)
+  sdjson_backlog_t bl;
+  sdjson_get_backlog(&bl);
+  ESP_LOGI(TAG, "sdjson: backlog %u seg(s), %u lines, %u events, %u KB, t %lu..%lu",
+           (unsigned)bl.seg.segments, (unsigned)bl.seg.lines,
+           (unsigned)bl.seg.events, (unsigned)(bl.seg.bytes / 1024),
+           (unsigned long)bl.seg.first_t, (unsigned long)bl.seg.last_t);
+  static sdseg_part_t parts[SDSEG_PARTS_MAX];
+  size_t np = sdseg_parts(parts, SDSEG_PARTS_MAX);
+  uint32_t pend = 0;
+  const sdseg_part_t *oldest = NULL;
+  for (size_t i = 0; i < np; i++) {
+    if (!parts[i].segments) continue;
+    if (!oldest) oldest = &parts[i];
+    pend++;
+  }
+  if (oldest) {
+    char dir[SDSEG_DIR_MAX];
+    sdseg_part_dir(oldest->day, dir, sizeof(dir));
+    ESP_LOGI(TAG, "sdjson: %u day(s) pending, oldest %s (%u segs, %u events, %s)",
+             (unsigned)pend, dir, (unsigned)oldest->segments,
+             (unsigned)oldest->events,
+             oldest->state == SDSEG_PART_PENDING ? "pending" : "partial");
+  }
+  for (int op = 0; op < SDJSON_LAT_OPS; op++) {
+    uint32_t n = 0;
+    for (int b = 0; b < SDJSON_LAT_BUCKETS; b++) n += st.lat[op][b];
+    if (n == 0) continue;
+    ESP_LOGI(TAG, "sdjson: %-7s n=%u p50<%uus p99<%uus max=%uus", names[op],
+             (unsigned)n, (unsigned)lat_percentile(st.lat[op], n, 50),
+             (unsigned)lat_percentile(st.lat[op], n, 99),
+             (unsigned)st.lat_max_us[op]);
   }
-  return false; // timeout
 }
 
 /*========================
@@ -504,7 +1388,7 @@ bool sdcard_init(bool create) {
   slot_config.gpio_cs = (gpio_num_t)SDCARD_CS;
 
   ret = spi_bus_initialize(SPI_HOST, &bus_cfg, 1);
-  if (ret != ESP_OK) {
+  if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) { // ya iniciado: reintento
     ESP_LOGE(TAG, "failed to initialize SPI bus");
     return false;
   }
@@ -520,6 +1404,7 @@ bool sdcard_init(bool create) {
 
   if (ret != ESP_OK) {
     if (ret == ESP_FAIL) {
+      sdacct_error(); // hay tarjeta pero no se puede leer
       ESP_LOGE(TAG, "failed to mount filesystem");
     } else {
       ESP_LOGI(TAG, "No SD-card found (%d)", ret);
@@ -527,49 +1412,216 @@ bool sdcard_init(bool create) {
     return false;
   }
 
-  useSDCard = true;
+  // useSDCard solo al final: la writer puede estar ya escribiendo en flash
+  bool ok = true;
   ESP_LOGI(TAG, "filesystem mounted");
   sdmmc_card_print_info(stdout, card);
+  // Contabilidad de escrituras: los totales de esta tarjeta, antes de que
+  // se escriba nada
+  sdacct_open(mount_point, (uint32_t)card->cid.serial);
 
-  // *** CAMBIO MINIMO: NO crear el fichero clásico paxcounter_*.json ***
-  // (Se deja data_file en nullptr para que sdcardWriteData no escriba nada)
-  data_file = nullptr;
-
-#if (SDLOGGING)
+  // CSV y log del sistema: ficheros propios, escritos por la writer
   char bufferFilename[64];
-  snprintf(bufferFilename, sizeof(bufferFilename), "/%s.log", SDCARD_FILE_NAME);
-  if (openFile(&log_file, bufferFilename)) {
+#if (SDCARD_CSV)
+  snprintf(bufferFilename, sizeof(bufferFilename), "%s/%s.csv", MOUNT_POINT, SDCARD_FILE_NAME);
+  stream_open(SDJSON_STREAM_CSV, bufferFilename, SDJSON_CSV_RING_SIZE,
+              SDJSON_CSV_SYNC_MS, SDCARD_FILE_HEADER
+#if (defined BAT_MEASURE_ADC || defined HAS_PMU)
+              SDCARD_FILE_HEADER_VOLTAGE
+#endif
+#if (HAS_SDS011)
+              SDCARD_FILE_HEADER_SDS011
+#endif
+  );
+#endif
+#if (SDLOGGING)
+  snprintf(bufferFilename, sizeof(bufferFilename), "%s/%s.log", MOUNT_POINT, SDCARD_FILE_NAME);
+  if (stream_open(SDJSON_STREAM_SYSLOG, bufferFilename, SDJSON_SYSLOG_RING_SIZE,
+                  SDJSON_SYSLOG_SYNC_MS, NULL)) {
     ESP_LOGI(TAG, "redirecting serial output to SD-card");
     esp_log_set_vprintf(&print_to_sd_card);
   } else {
-    useSDCard = false;
+    ok = false;
   }
 #endif
 
-  // Sanea backlog NDJSON al arranque ANTES de iniciar el writer
-  //sdjson_sanity_check_on_boot();
+  // Log de eventos MAC en segmentos: sella los que quedaron abiertos; la
+  // recuperación solo mira la cola de cada uno (frames con CRC)
+  if (!sdseg_init(mount_point))
+    ESP_LOGE(TAG, "sdjson: segment store unavailable");
 
-  sdjson_logger_start();
+  useSDCard = ok; // la writer la arranca tier_setup()
   return useSDCard;
 }
 
-void sdcard_flush(void) {
-  if (data_file) fsync(fileno(data_file));
-#if (SDLOGGING)
-  if (log_file) fsync(fileno(log_file));
-#endif
-  if (maclog_file) fsync(fileno(maclog_file));
+/* Único sitio que prepara la flash y arranca la writer. La tarea de montaje
+   (también el remontaje tardío) y el timeout del montaje pueden llegar a la
+   vez: van en serie con s_tier_mutex. Sin tarjeta (o mientras no monta) los
+   eventos van a la flash interna; con ella, la writer vuelca lo que hubiera
+   en la flash. */
+static void tier_setup(bool sd_ok) {
+  if (s_tier_mutex) xSemaphoreTake(s_tier_mutex, portMAX_DELAY);
+  if (sd_ok) {
+    sdflash_init(); // puede haber trozos de un arranque sin tarjeta
+    sdjson_logger_start();
+  } else if (!useSDCard && !s_fallback_tried) {
+    s_fallback_tried = true; // timeout y fallo del montaje pueden coincidir
+    if (sdflash_init() && sdjson_logger_start()) {
+      s_log_ring_ready = true;
+      ESP_LOGW(TAG, "sdjson: no SD, logging to internal flash");
+    } else {
+      s_log_ring_ready = false; // ni SD ni flash: no se acumula más
+      ESP_LOGW(TAG, "sdjson: no SD nor flash, %u B of buffered events dropped",
+               (unsigned)(s_log_ring_buf ? sdring_used(&s_log_ring) : 0));
+    }
+  }
+  if (s_tier_mutex) xSemaphoreGive(s_tier_mutex);
+}
+
+static void flash_fallback_task(void *arg) {
+  tier_setup(false);
+  vTaskDelete(NULL);
+}
+
+// Pasa de 'from' a SDCARD_MOUNTING; solo uno gana si compiten
+static bool mount_claim(sdcard_mount_state_t from) {
+  portENTER_CRITICAL(&s_mount_mux);
+  bool won = s_mount_state == from;
+  if (won) s_mount_state = SDCARD_MOUNTING;
+  portEXIT_CRITICAL(&s_mount_mux);
+  return won;
+}
+
+// Montaje en la propia tarea (ya en SDCARD_MOUNTING); sin tarjeta, a la flash
+static bool mount_sync_claimed(void) {
+  bool ok = sdcard_init();
+  s_mount_us = esp_timer_get_time();
+  s_mount_state = ok ? SDCARD_MOUNTED : SDCARD_MOUNT_FAILED;
+  tier_setup(ok);
+  return ok;
+}
+
+// Aplazado hasta ahora (sdjson_shutdown): se monta sin esperar a otra tarea
+static bool mount_sync(void) {
+  if (!mount_claim(SDCARD_MOUNT_DEFERRED)) return useSDCard;
+  return mount_sync_claimed();
 }
 
+// Monta la tarjeta; si no está, pasa a la flash y lo reintenta cada
+// SDCARD_REMOUNT_MS. Al montar, la writer vuelca la flash a la SD.
+static void mount_task(void *arg) {
+  bool ok = sdcard_init();
+  s_mount_timer.detach();
+  s_mount_us = esp_timer_get_time();
+  bool late = s_mount_state == SDCARD_MOUNT_TIMEOUT;
+  s_mount_state = ok ? SDCARD_MOUNTED : SDCARD_MOUNT_FAILED;
+  if (!ok) {
+    tier_setup(false);
+    while (SDCARD_REMOUNT_MS && !(ok = sdcard_init()))
+      vTaskDelay(pdMS_TO_TICKS(SDCARD_REMOUNT_MS));
+    if (ok) {
+      s_mount_state = SDCARD_MOUNTED;
+      s_mount_us = esp_timer_get_time();
+      late = true;
+    }
+  }
+  if (ok) {
+    // La writer vacía lo guardado en RAM y en flash
+    tier_setup(true);
+    s_stage_urgent = true;
+    ESP_LOGI(TAG, "sdjson: SD ready at %u ms%s, %u event(s) buffered before mount",
+             (unsigned)(s_mount_us / 1000), late ? " (late)" : "",
+             (unsigned)s_premount_events);
+  }
+  s_mount_task = NULL;
+  vTaskDelete(NULL);
+}
+
+// Se ejecuta en la tarea de esp_timer, que no debe bloquearse: el paso a
+// la flash va en su propia tarea. Si el montaje acaba más tarde, la
+// tarjeta se usa igual.
+static void mount_timeout(void) {
+  if (s_mount_state != SDCARD_MOUNTING) return;
+  s_mount_state = SDCARD_MOUNT_TIMEOUT;
+  ESP_LOGW(TAG, "sdjson: SD mount still pending after %u ms",
+           (unsigned)SDCARD_MOUNT_TIMEOUT_MS);
+  if (xTaskCreatePinnedToCore(flash_fallback_task, "sdflash", 4096, NULL, 1,
+                              NULL, 1) != pdPASS)
+    s_log_ring_ready = false;
+}
+
+static bool mount_start(sdcard_mount_state_t from, uint32_t timeout_ms) {
+  if (!mount_claim(from)) return false;
+  if (xTaskCreatePinnedToCore(mount_task, "sdmount", 8192, NULL, 1,
+                              &s_mount_task, 1) != pdPASS) {
+    mount_sync_claimed(); // sin tarea: como antes, bloqueando
+    return useSDCard;
+  }
+  if (timeout_ms) s_mount_timer.once_ms(timeout_ms, mount_timeout);
+  return true;
+}
+
+bool sdcard_init_async(uint32_t timeout_ms) {
+  if (s_mount_state != SDCARD_MOUNT_IDLE) return false;
+  if (!s_tier_mutex) s_tier_mutex = xSemaphoreCreateMutex(); // antes de las tareas
+  sdrtc_boot();
+  // Los eventos del sniffer esperan en el anillo mientras se monta
+  if (stage_start()) s_log_ring_ready = true;
+  if (s_log_ring_ready && sdrtc_defer()) {
+    s_mount_state = SDCARD_MOUNT_DEFERRED;
+    ESP_LOGI(TAG, "sdjson: sleep cycle wakeup, SD mount deferred (%u count(s) in RTC)",
+             (unsigned)sdrtc_pending());
+    return true;
+  }
+  return mount_start(SDCARD_MOUNT_IDLE, timeout_ms);
+}
+
+bool sdcard_mount_now(uint32_t wait_ms) {
+  if (mount_start(SDCARD_MOUNT_DEFERRED, SDCARD_MOUNT_TIMEOUT_MS))
+    ESP_LOGI(TAG, "sdjson: deferred SD mount started");
+  TickType_t t0 = xTaskGetTickCount();
+  while (s_mount_state == SDCARD_MOUNTING &&
+         xTaskGetTickCount() - t0 < pdMS_TO_TICKS(wait_ms))
+    vTaskDelay(pdMS_TO_TICKS(10));
+  return useSDCard;
+}
+
+/* Vuelca los recuentos guardados en RTC como líneas {t,w}, en orden y cada
+   una en su línea. Se quitan del anillo RTC al quedar encolados: a partir
+   de ahí los protege la writer como a cualquier registro crítico. */
+size_t sdjson_flush_rtc(void) {
+  if (!s_log_ring_ready || !sdrtc_pending()) return 0;
+  sdcard_mount_now(0);
+  sdrtc_rec_t r;
+  char line[48];
+  size_t n = 0;
+  while (sdrtc_peek(&r)) {
+    int len = snprintf(line, sizeof(line), "{\"t\":%lu,\"w\":%lu}",
+                       (unsigned long)r.t, (unsigned long)r.w);
+    if (!log_push(LOG_OP_APPEND, line, (size_t)len, true)) break;
+    (void) log_push(LOG_OP_NEWLINE, NULL, 0, true);
+    sdrtc_pop();
+    n++;
+  }
+  ESP_LOGI(TAG, "sdjson: %u count(s) moved from RTC memory to the SD log", (unsigned)n);
+  return n;
+}
+
+sdcard_mount_state_t sdcard_mount_state(void) { return s_mount_state; }
+
 void sdcard_close(void) {
   if (!useSDCard) return;
   ESP_LOGI(TAG, "closing SD-card");
-  sdcard_flush();
 #if (SDLOGGING)
   ESP_LOGI(TAG, "redirect console back to serial output");
   esp_log_set_vprintf(&vprintf);
 #endif
-  sdjson_logger_stop();
+  if (!sdjson_logger_stop()) {
+    // Desmontar con la writer a mitad de un write() sería peor que el corte
+    ESP_LOGW(TAG, "SD-card left mounted");
+    return;
+  }
+  sdacct_close();
   fcloseall();
   esp_vfs_fat_sdcard_unmount(mount_point, card);
   ESP_LOGI(TAG, "SD-card unmounted");
@@ -577,8 +1629,8 @@ void sdcard_close(void) {
 
 void sdcardWriteData(uint16_t noWifi, uint16_t noBle,
                      __attribute__((unused)) uint16_t voltage) {
-  // *** CAMBIO MINIMO: no escribir si no hay fichero clásico abierto ***
-  if (!useSDCard || data_file == nullptr) return;
+  // Solo con SDCARD_CSV: si no, el flujo está cerrado y no se hace nada
+  if (!useSDCard || !s_streams[SDJSON_STREAM_CSV].f) return;
 
   char timeBuffer[21];
   time_t t = time(NULL);
@@ -590,173 +1642,107 @@ void sdcardWriteData(uint16_t noWifi, uint16_t noBle,
   sdsStatus_t sds;
 #endif
 
-  ESP_LOGI(TAG, "writing data to SD-card");
-
-  fprintf(data_file, "%s", timeBuffer);
-  fprintf(data_file, ",%d,%d", noWifi, noBle);
+  char row[96];
+  int n = snprintf(row, sizeof(row), "%s,%d,%d", timeBuffer, noWifi, noBle);
 #if (defined BAT_MEASURE_ADC || defined HAS_PMU)
-  fprintf(data_file, ",%d", voltage);
+  n += snprintf(row + n, sizeof(row) - n, ",%d", voltage);
 #endif
 #if (HAS_SDS011)
   sds011_store(&sds);
-  fprintf(data_file, ",%5.1f,%4.1f", sds.pm10 / 10, sds.pm25 / 10);
+  n += snprintf(row + n, sizeof(row) - n, ",%5.1f,%4.1f", sds.pm10 / 10, sds.pm25 / 10);
 #endif
-  fprintf(data_file, "\n");
+  n += snprintf(row + n, sizeof(row) - n, "\n");
+
+  // La fila va a la writer; aquí nunca se espera a la tarjeta
+  if (n > 0 && (size_t)n < sizeof(row)) stream_push(SDJSON_STREAM_CSV, row, (size_t)n);
 }
 
 /*==========================================
  *  Helpers de lote para wifi_post.cpp
  *==========================================*/
 
-extern "C" bool sdjson_read_batch(String &outEventsArray,
-                                  size_t max_lines,
-                                  size_t max_bytes,
-                                  size_t &out_lines_read)
+extern "C" size_t sdjson_read_spans(sdjson_pos_t *from,
+                                   size_t max_lines,
+                                   size_t max_bytes,
+                                   uint8_t *buf, size_t buf_size,
+                                   sdjson_span_t *spans, size_t max_spans)
 {
-  outEventsArray = "[]";
-  out_lines_read = 0;
-  if (!useSDCard) return false;
-
-  // Paramos el writer para consistencia
-  sdjson_logger_stop();
-
-  char fullpath[96];
-  snprintf(fullpath, sizeof(fullpath), "%s/%s.jsonl", mount_point, SDCARD_MACLOG_BASENAME);
-
-  FILE* fin = fopen(fullpath, "r");
-  if (!fin) {
-    // no existe el backlog aún
-    sdjson_logger_start();
-    return true;
-  }
-
-  String arr;
-  arr.reserve(256);
-  arr = "[";
-
-  // Lectura robusta por caracteres
-  bool first_line = true;
-  size_t count = 0;
-  size_t bytes_acc = 1; // '['
-
-  int c;
-  bool line_has_data = false;
-  String line;
-
-  while ((c = fgetc(fin)) != EOF) {
-    if (c == '\r') continue;
-    if (c == '\n') {
-      if (!line_has_data) continue;
-
-      size_t add_bytes = (first_line ? 0 : 1) + line.length();
-      if ((bytes_acc + add_bytes + 1) > max_bytes) break;   // +1 por ']'
-      if (count >= max_lines) break;
-
-      if (!first_line) arr += ",";
-      arr += line;
-
-      bytes_acc += add_bytes;
-      first_line = false;
-      ++count;
-
-      line = "";
-      line_has_data = false;
-      continue;
+  if (!useSDCard || !buf || buf_size < SDREC_FRAME_MAX || max_lines == 0)
+    return 0;
+
+  // Sellados en orden y, al final, el activo hasta su final estable: la
+  // writer no se para y nunca se lee lo que aún puede cambiar
+  uint32_t seqs[SDJSON_SPAN_SEGS + 1];
+  size_t nseg = sdseg_list(seqs, SDJSON_SPAN_SEGS);
+  uint32_t act_seq = 0, act_end = 0;
+  if (sdseg_stable_end(&act_seq, &act_end)) seqs[nseg++] = act_seq;
+
+  size_t nspans = 0;
+  for (size_t i = 0; i < nseg && nspans < max_spans && max_lines > 0; i++) {
+    uint32_t seq = seqs[i];
+    if (seq < from->seq) continue;
+    sdseg_hdr_t hdr;
+    FILE *f = sdseg_fopen(seq, &hdr); // descifrado si hace falta
+    if (!f) continue; // purgado entre medias, o cifrado con otra clave
+
+    uint32_t end;
+    bool sealed = seq != act_seq;
+    if (!sealed) {
+      end = act_end; // su data_len en la tarjeta va por detrás
+    } else if (sdseg_is_binary(&hdr)) {
+      end = SDSEG_HDR_SIZE + hdr.data_len;
     } else {
-      line_has_data = true;
-      line += (char)c;
+      fseek(f, 0, SEEK_END); // NDJSON de versión 1: hasta EOF
+      long sz = ftell(f);
+      end = (sz > 0) ? (uint32_t)sz : 0;
     }
+    uint32_t start = sdseg_data_start(&hdr);
+    if (seq == from->seq && from->off > start) start = from->off;
+
+    size_t lines = 0;
+    uint32_t cut = (start < end)
+                       ? sdseg_scan_lines(f, &hdr, start, end, buf, buf_size,
+                                          max_lines, max_bytes, &lines)
+                       : start;
+    fclose(f);
+    // Sellado sin ninguna línea entera legible pero con datos: se devuelve
+    // el resto para que el uploader lo mande o lo dé por consumido
+    if (lines == 0 && sealed && start < end) cut = end;
+    if (cut == start) continue;
+
+    sdjson_span_t &sp = spans[nspans++];
+    sp.seq = seq;
+    sp.off = start;
+    sp.len = cut - start;
+    sp.lines = (uint32_t)lines;
+    sp.flags = hdr.flags;
+    from->seq = seq;
+    from->off = cut;
+    if (lines == 0) break; // cola ilegible: que la resuelva el uploader
+    max_lines -= lines;
+    if (sp.len >= max_bytes) break;
+    max_bytes -= sp.len;
   }
-  // última línea sin \n
-  if (line_has_data && count < max_lines) {
-    size_t add_bytes = (first_line ? 0 : 1) + line.length();
-    if ((bytes_acc + add_bytes + 1) <= max_bytes) {
-      if (!first_line) arr += ",";
-      arr += line;
-      ++count;
-    }
-  }
-
-  fclose(fin);
-
-  arr += "]";
-  outEventsArray = arr;
-  out_lines_read = count;
-
-  // Reanudamos el writer
-  sdjson_logger_start();
-  return true;
+  return nspans;
 }
 
-/* BORRADO ROBUSTO DE LAS PRIMERAS N LÍNEAS (maneja líneas largas) */
-extern "C" bool sdjson_delete_first_lines(size_t n) {
-  if (!useSDCard || n == 0) return true;
-
-  // Detenemos el writer para tener control exclusivo del archivo
-  sdjson_logger_stop();
-
-  char fullpath[96];
-  snprintf(fullpath, sizeof(fullpath), "%s/%s.jsonl", mount_point, SDCARD_MACLOG_BASENAME);
-  char tmppath[96];
-  snprintf(tmppath,  sizeof(tmppath),  "%s/%s.tmp",   mount_point, SDCARD_MACLOG_BASENAME);
-
-  FILE* fin = fopen(fullpath, "r");
-  if (!fin) { sdjson_logger_start(); return true; }
-
-  FILE* ftmp = fopen(tmppath, "w");
-  if (!ftmp) { fclose(fin); sdjson_logger_start(); return false; }
-
-  size_t to_skip = n;
-  int c;
-  bool saw_any = false;
-  bool last_was_nl = true;
-
-  // 1) Saltar exactamente N líneas completas (cuenta '\n')
-  while (to_skip > 0 && (c = fgetc(fin)) != EOF) {
-    saw_any = true;
-    if (c == '\r') continue;
-    last_was_nl = (c == '\n');
-    if (last_was_nl) to_skip--;
-  }
-  // Si EOF y última línea no tenía '\n' pero vimos algo, considérala línea
-  if (to_skip > 0 && saw_any && !last_was_nl) {
-    to_skip--;
-  }
-
-  // 2) Copiar el resto tal cual
-  if (to_skip == 0) {
-    while ((c = fgetc(fin)) != EOF) {
-      fputc(c, ftmp);
-    }
-  }
-
-  fflush(ftmp); fsync(fileno(ftmp));
-  fclose(ftmp);
-  fclose(fin);
-
-  // 3) Reemplazo atómico
-  remove(fullpath);
-  rename(tmppath, fullpath);
-
-  // Reanudamos el writer
-  sdjson_logger_start();
-  return true;
+/* ACUSE DEL UPLOADER: lo anterior a 'off' en 'seq' ya está en el servidor.
+   Los sellados se consumen aquí mismo (ver sdseg_consume); el activo lo
+   toca la writer, así que se le pide y se espera. */
+extern "C" bool sdjson_consume(uint32_t seq, uint32_t off, uint32_t timeout_ms) {
+  if (!useSDCard || seq == 0) return false;
+  uint32_t act_seq = 0, act_end = 0;
+  if (!sdseg_stable_end(&act_seq, &act_end) || act_seq != seq)
+    return sdseg_consume(seq, off);
+  uint32_t arg[2] = {seq, off};
+  sdjson_pos_t pos = {0, 0};
+  return log_request_sync(LOG_OP_CONSUME, timeout_ms, &pos, arg, sizeof(arg)) &&
+         pos.seq == seq;
 }
 
 /* API pública: pedir PURGA al writer (se encola, sin carreras) */
 extern "C" void sdjson_request_purge_older_than(uint32_t max_age_sec) {
-  if (!s_log_queue) return;
-  logrec_t r = {};
-  r.op = LOG_OP_PURGE;
-  snprintf(r.raw, sizeof(r.raw), "%lu", (unsigned long)max_age_sec);
-
-  if (xPortInIsrContext()) {
-    BaseType_t hpw = pdFALSE;
-    (void)xQueueSendFromISR(s_log_queue, &r, &hpw);
-    if (hpw) portYIELD_FROM_ISR();
-  } else {
-    (void)xQueueSend(s_log_queue, &r, 0);
-  }
+  (void) log_push(LOG_OP_PURGE, &max_age_sec, sizeof(max_age_sec), true);
 }
 
 #endif // HAS_SDCARD
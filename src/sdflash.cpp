@@ -0,0 +1,471 @@
+#ifdef HAS_SDCARD
+
+#include "sdflash.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <LittleFS.h>
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/unistd.h>
+#include <sys/stat.h>
+
+#ifndef TAG
+#define TAG "sdflash"
+#endif
+
+#define SDFLASH_DIR SDFLASH_MOUNT "/flog"
+
+static bool s_ready = false;
+static SemaphoreHandle_t s_mutex = NULL; // writer frente a uploader
+static uint32_t s_cap = SDFLASH_MAX_BYTES;
+static uint32_t s_used = 0;        // bytes en la flash (todos los trozos)
+
+// Trozos [s_first, s_next); el abierto, si hay, es s_next - 1
+static uint32_t s_first = 1, s_next = 1;
+static uint32_t s_pinned = 0;
+
+// Trozo abierto y escritura agrupada (solo la writer)
+static FILE *s_active = NULL;
+static uint32_t s_active_bytes = 0;
+static uint8_t s_buf[SDFLASH_BUF_SIZE];
+static size_t s_blen = 0;
+static uint32_t s_dirty_since = 0; // ms del primer byte sin fsync
+static bool s_unsynced = false;    // escrito pero sin fsync
+static bool s_line_open = false;   // la línea ya tiene algún objeto
+static bool s_skip_line = false;   // la línea abierta se perdió: hasta su '\n'
+
+static sdflash_stats_t s_stats;
+
+// Contadores por trozo, en el hueco id % SDFLASH_MAX_CHUNKS
+typedef struct {
+  uint32_t id; // 0 = libre
+  uint32_t lines;
+  uint32_t bytes; // sin los '\n'
+} chunk_meta_t;
+static chunk_meta_t s_meta[SDFLASH_MAX_CHUNKS];
+static uint32_t s_lines = 0;
+
+static inline chunk_meta_t *meta_of(uint32_t id) {
+  return &s_meta[id % SDFLASH_MAX_CHUNKS];
+}
+
+static void meta_add(uint32_t id, const uint8_t *p, size_t len) {
+  uint32_t nl = 0;
+  for (const uint8_t *e = p + len; (p = (const uint8_t *)memchr(p, '\n', e - p)) != NULL; p++)
+    nl++;
+  chunk_meta_t *m = meta_of(id);
+  if (m->id != id) *m = {id, 0, 0};
+  m->lines += nl;
+  m->bytes += (uint32_t)len - nl;
+  s_lines += nl;
+}
+
+static inline void lock(void) {
+  if (s_mutex) xSemaphoreTake(s_mutex, portMAX_DELAY);
+}
+static inline void unlock(void) {
+  if (s_mutex) xSemaphoreGive(s_mutex);
+}
+
+static inline uint32_t now_ms(void) {
+  uint32_t ms = (uint32_t)(esp_timer_get_time() / 1000);
+  return ms ? ms : 1;
+}
+
+void sdflash_path(uint32_t id, char *out, size_t n) {
+  snprintf(out, n, "%s/%08lX.FLG", SDFLASH_DIR, (unsigned long)id);
+}
+
+// "00000001.FLG" -> 1
+static bool parse_id(const char *name, uint32_t *id) {
+  if (strlen(name) != 12 || name[8] != '.' || strcasecmp(name + 9, "FLG") != 0)
+    return false;
+  char hex[9];
+  memcpy(hex, name, 8);
+  hex[8] = '\0';
+  char *end = NULL;
+  unsigned long v = strtoul(hex, &end, 16);
+  if (!end || *end || v == 0) return false;
+  *id = (uint32_t)v;
+  return true;
+}
+
+static long file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Borra el trozo 'id' y descuenta su tamaño. Con el mutex tomado.
+static bool drop_chunk(uint32_t id) {
+  char path[48];
+  sdflash_path(id, path, sizeof(path));
+  long size = file_size(path);
+  bool ok = remove(path) == 0;
+  if (ok && size > 0) s_used = (s_used > (uint32_t)size) ? s_used - (uint32_t)size : 0;
+  chunk_meta_t *m = meta_of(id);
+  if (ok && m->id == id) {
+    s_lines = s_lines > m->lines ? s_lines - m->lines : 0;
+    m->id = 0;
+  }
+  while (s_first < s_next) { // avanza sobre los que ya no están
+    sdflash_path(s_first, path, sizeof(path));
+    if (file_size(path) >= 0) break;
+    s_first++;
+  }
+  return ok;
+}
+
+// Un corte pudo dejar la última línea a medias: se copia solo lo que
+// acaba en '\n' (el trozo es pequeño) y se sustituye.
+static void repair_tail(uint32_t id) {
+  char path[48], tmp[48];
+  sdflash_path(id, path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  if (!f) return;
+  long good = 0, pos = 0;
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    pos++;
+    if (c == '\n') good = pos;
+  }
+  if (good == pos) {
+    fclose(f);
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s/REPAIR.TMP", SDFLASH_DIR);
+  FILE *out = good ? fopen(tmp, "wb") : NULL;
+  bool ok = out != NULL;
+  fseek(f, 0, SEEK_SET);
+  for (long i = 0; ok && i < good && (c = fgetc(f)) != EOF; i++) ok = fputc(c, out) != EOF;
+  fclose(f);
+  if (out) ok = (fclose(out) == 0) && ok;
+  remove(path);
+  if (ok) rename(tmp, path);
+  else remove(tmp);
+  ESP_LOGW(TAG, "sdflash: %08lX torn tail, dropped %ld bytes", (unsigned long)id,
+           pos - good);
+}
+
+static bool init_locked(void);
+
+// Se puede llamar desde varias tareas a la vez: una monta y las demás
+// esperan al mutex y ven s_ready
+bool sdflash_init(void) {
+  if (s_ready) return true;
+  if (!s_mutex) {
+    static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    SemaphoreHandle_t m = xSemaphoreCreateMutex();
+    portENTER_CRITICAL(&mux);
+    if (!s_mutex) {
+      s_mutex = m;
+      m = NULL;
+    }
+    portEXIT_CRITICAL(&mux);
+    if (m) vSemaphoreDelete(m);
+    if (!s_mutex) return false;
+  }
+  lock();
+  bool ok = s_ready || init_locked();
+  unlock();
+  return ok;
+}
+
+static bool init_locked(void) {
+  // Formatea si la partición no tiene LittleFS (primer arranque)
+  if (!LittleFS.begin(true, SDFLASH_MOUNT, 4, SDFLASH_PARTITION)) {
+    ESP_LOGE(TAG, "sdflash: can't mount LittleFS on '%s'", SDFLASH_PARTITION);
+    return false;
+  }
+  size_t total = LittleFS.totalBytes();
+  s_cap = SDFLASH_MAX_BYTES;
+  if (total && s_cap > total / 4 * 3) s_cap = total / 4 * 3;
+
+  struct stat st;
+  if (stat(SDFLASH_DIR, &st) != 0 && mkdir(SDFLASH_DIR, 0777) != 0) {
+    ESP_LOGE(TAG, "sdflash: can't create %s", SDFLASH_DIR);
+    return false;
+  }
+  DIR *d = opendir(SDFLASH_DIR);
+  if (!d) return false;
+  uint32_t min_id = 0, max_id = 0;
+  s_used = 0;
+  struct dirent *e;
+  char path[48];
+  while ((e = readdir(d)) != NULL) {
+    uint32_t id;
+    if (!parse_id(e->d_name, &id)) continue;
+    if (!min_id || id < min_id) min_id = id;
+    if (id > max_id) max_id = id;
+  }
+  closedir(d);
+  if (max_id) repair_tail(max_id);
+  // Más trozos que huecos (no debería): se quedan los más nuevos
+  if (max_id && max_id - min_id >= SDFLASH_MAX_CHUNKS) {
+    for (uint32_t id = min_id; id <= max_id - SDFLASH_MAX_CHUNKS; id++) {
+      sdflash_path(id, path, sizeof(path));
+      remove(path);
+    }
+    min_id = max_id - SDFLASH_MAX_CHUNKS + 1;
+  }
+  memset(s_meta, 0, sizeof(s_meta));
+  s_lines = 0;
+  uint8_t buf[256];
+  for (uint32_t id = min_id; min_id && id <= max_id; id++) {
+    sdflash_path(id, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) continue;
+    size_t n, size = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      meta_add(id, buf, n);
+      size += n;
+    }
+    fclose(f);
+    if (size > 0) s_used += (uint32_t)size;
+    else remove(path);
+  }
+  s_first = min_id ? min_id : 1;
+  s_next = max_id + 1;
+  s_stats.cap = s_cap;
+  s_ready = true;
+  ESP_LOGI(TAG, "sdflash: %s ready, %u/%u B used in %u chunk(s) (partition %u B)",
+           SDFLASH_DIR, (unsigned)s_used, (unsigned)s_cap,
+           (unsigned)(s_next - s_first), (unsigned)total);
+  return true;
+}
+
+bool sdflash_ready(void) { return s_ready; }
+
+// Hace sitio para 'need' bytes borrando trozos cerrados desde el más
+// antiguo. false si el más antiguo está fijado por el uploader.
+static bool make_room(uint32_t need) {
+  bool ok = true;
+  lock();
+  // Sin trozo abierto, write_buf va a abrir uno: que quepa en s_meta
+  uint32_t chunks = s_next - s_first + (s_active ? 0 : 1);
+  while (s_used + need > s_cap || chunks > SDFLASH_MAX_CHUNKS) {
+    uint32_t limit = s_active ? s_next - 1 : s_next;
+    if (s_first >= limit || s_first == s_pinned) {
+      ok = false;
+      break;
+    }
+    uint32_t id = s_first;
+    drop_chunk(id);
+    if (s_first == id) s_first++;
+    chunks = s_next - s_first + (s_active ? 0 : 1);
+    s_stats.wrapped++;
+    ESP_LOGW(TAG, "sdflash: ring full, dropped chunk %08lX", (unsigned long)id);
+  }
+  unlock();
+  return ok;
+}
+
+static bool open_chunk(void) {
+  char path[48];
+  lock();
+  uint32_t id = s_next;
+  sdflash_path(id, path, sizeof(path));
+  s_active = fopen(path, "wb");
+  if (s_active) s_next++;
+  unlock();
+  if (!s_active) {
+    ESP_LOGE(TAG, "sdflash: can't create %s", path);
+    return false;
+  }
+  s_active_bytes = 0;
+  return true;
+}
+
+// Un volcado falló: el trozo abierto se cierra sin la cabeza de la línea
+// que quedó a medias (repair_tail) y se recuentan sus líneas, así que en la
+// flash solo faltan líneas enteras. Devuelve los bytes que se quitaron.
+static uint32_t close_torn(void) {
+  uint32_t id = s_next - 1;
+  char path[48];
+  sdflash_path(id, path, sizeof(path));
+  // Con el mutex: el uploader no lo ve cerrado hasta que está reparado
+  lock();
+  fclose(s_active);
+  repair_tail(id);
+  s_active = NULL;
+  long size = file_size(path);
+  uint32_t kept = size > 0 ? (uint32_t)size : 0;
+  chunk_meta_t *m = meta_of(id);
+  if (m->id == id) {
+    s_lines = s_lines > m->lines ? s_lines - m->lines : 0;
+    m->id = 0;
+  }
+  s_used = s_used > s_active_bytes ? s_used - s_active_bytes : 0;
+  s_used += kept;
+  FILE *f = kept ? fopen(path, "rb") : NULL;
+  if (f) {
+    uint8_t buf[256];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) meta_add(id, buf, n);
+    fclose(f);
+  } else if (!kept) {
+    drop_chunk(id); // no quedó ninguna línea entera
+  }
+  unlock();
+  uint32_t torn = s_active_bytes > kept ? s_active_bytes - kept : 0;
+  s_active_bytes = 0;
+  return torn;
+}
+
+// Vuelca el buffer al trozo abierto (un único fwrite). Si falla se pierden
+// líneas enteras: lo que ya estaba escrito de la primera y, si el buffer
+// acaba a media línea, el resto de esa hasta su '\n'.
+static void write_buf(void) {
+  if (s_blen == 0) return;
+  if (!make_room((uint32_t)s_blen) || (!s_active && !open_chunk()) ||
+      fwrite(s_buf, 1, s_blen, s_active) != s_blen) {
+    s_stats.lost += s_blen;
+    if (s_active) s_stats.lost += close_torn();
+    s_skip_line = s_buf[s_blen - 1] != '\n';
+    ESP_LOGW(TAG, "sdflash: write of %u bytes failed, dropping whole lines",
+             (unsigned)s_blen);
+  } else {
+    lock();
+    s_used += (uint32_t)s_blen;
+    meta_add(s_next - 1, s_buf, s_blen);
+    unlock();
+    s_active_bytes += (uint32_t)s_blen;
+    s_stats.bytes += (uint32_t)s_blen;
+    s_unsynced = true;
+  }
+  s_blen = 0;
+}
+
+static void put(const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  if (!s_dirty_since) s_dirty_since = now_ms();
+  while (len) {
+    size_t n;
+    if (s_skip_line) { // resto de una línea perdida: no se escribe
+      const uint8_t *nl = (const uint8_t *)memchr(p, '\n', len);
+      n = nl ? (size_t)(nl - p) + 1 : len;
+      s_skip_line = nl == NULL;
+      s_stats.lost += n;
+      p += n;
+      len -= n;
+      continue;
+    }
+    n = sizeof(s_buf) - s_blen;
+    if (n > len) n = len;
+    memcpy(s_buf + s_blen, p, n);
+    s_blen += n;
+    p += n;
+    len -= n;
+    if (s_blen == sizeof(s_buf)) write_buf();
+  }
+}
+
+bool sdflash_append(const char *obj, size_t len) {
+  if (!s_ready || len == 0) return false;
+  if (s_line_open) put(",", 1);
+  put(obj, len);
+  s_line_open = true;
+  return true;
+}
+
+void sdflash_end_line(void) {
+  if (!s_ready || !s_line_open) return;
+  put("\n", 1);
+  s_line_open = false;
+  // Los trozos solo se cierran en fin de línea
+  if (s_active_bytes + s_blen >= SDFLASH_CHUNK_BYTES) sdflash_seal();
+}
+
+void sdflash_sync(bool force) {
+  if (!s_ready || !s_dirty_since) return;
+  if (!force && now_ms() - s_dirty_since < SDFLASH_SYNC_MS) return;
+  write_buf();
+  if (s_active && s_unsynced) {
+    fflush(s_active);
+    fsync(fileno(s_active));
+    s_stats.syncs++;
+  }
+  s_unsynced = false;
+  s_dirty_since = 0;
+}
+
+uint32_t sdflash_due_ms(void) {
+  if (!s_ready || !s_dirty_since) return UINT32_MAX;
+  uint32_t age = now_ms() - s_dirty_since;
+  return age >= SDFLASH_SYNC_MS ? 0 : SDFLASH_SYNC_MS - age;
+}
+
+void sdflash_seal(void) {
+  if (!s_ready) return;
+  if (s_line_open) sdflash_end_line(); // no debería: lo cierra la writer antes
+  sdflash_sync(true);
+  if (!s_active) return;
+  fclose(s_active);
+  s_active = NULL;
+  if (s_active_bytes == 0) {
+    lock();
+    drop_chunk(s_next - 1);
+    unlock();
+  }
+  s_active_bytes = 0;
+}
+
+bool sdflash_pending(void) { return s_ready && (s_first < s_next || s_blen); }
+
+bool sdflash_oldest(uint32_t *id) {
+  if (!s_ready) return false;
+  lock();
+  uint32_t limit = s_active ? s_next - 1 : s_next;
+  bool found = s_first < limit;
+  if (found) *id = s_first;
+  unlock();
+  return found;
+}
+
+bool sdflash_remove(uint32_t id, bool migrated) {
+  if (!s_ready) return false;
+  lock();
+  bool ok = (!s_active || id != s_next - 1) && drop_chunk(id);
+  if (ok) {
+    if (migrated) s_stats.migrated++;
+    else s_stats.sent++;
+  }
+  unlock();
+  return ok;
+}
+
+bool sdflash_chunk_stats(uint32_t id, uint32_t *lines, uint32_t *bytes) {
+  lock();
+  const chunk_meta_t *m = meta_of(id);
+  bool found = s_ready && m->id == id;
+  if (found) {
+    *lines = m->lines;
+    *bytes = m->bytes;
+  }
+  unlock();
+  return found;
+}
+
+void sdflash_pin(uint32_t id) {
+  lock();
+  s_pinned = id;
+  unlock();
+}
+
+void sdflash_get_stats(sdflash_stats_t *out) {
+  lock();
+  *out = s_stats;
+  out->used = s_used;
+  out->chunks = s_next - s_first;
+  out->lines = s_lines;
+  unlock();
+}
+
+#endif
@@ -0,0 +1,378 @@
+#include "sdlz.h"
+#include "sdrecord.h" // sdrec_crc32 (mismo polinomio que gzip)
+
+#include <string.h>
+
+// Longitudes 257..285 y distancias 0..29 (RFC 1951, 3.2.5)
+static const uint16_t LEN_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                      15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                      67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                       6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+enum { D_HDR, D_FIXED, D_STORED, D_END };
+
+/* ================= Compresor ================= */
+
+static void out_flush(sdlz_enc_t *e) {
+  if (e->olen == 0) return;
+  if (!e->error && !e->write(e->ctx, e->out, e->olen)) e->error = true;
+  e->out_len += (uint32_t)e->olen;
+  e->olen = 0;
+}
+
+static void put_bits(sdlz_enc_t *e, uint32_t v, uint8_t n) {
+  e->bits |= v << e->nbits;
+  e->nbits += n;
+  while (e->nbits >= 8) {
+    e->out[e->olen++] = (uint8_t)e->bits;
+    if (e->olen == sizeof(e->out)) out_flush(e);
+    e->bits >>= 8;
+    e->nbits -= 8;
+  }
+}
+
+// Los códigos Huffman van con el bit más significativo primero
+static void put_code(sdlz_enc_t *e, uint32_t code, uint8_t n) {
+  uint32_t r = 0;
+  for (uint8_t i = 0; i < n; i++) r |= ((code >> i) & 1) << (n - 1 - i);
+  put_bits(e, r, n);
+}
+
+static void put_litlen(sdlz_enc_t *e, uint32_t sym) {
+  if (sym < 144) put_code(e, 0x30 + sym, 8);
+  else if (sym < 256) put_code(e, 0x190 + sym - 144, 9);
+  else if (sym < 280) put_code(e, sym - 256, 7);
+  else put_code(e, 0xC0 + sym - 280, 8);
+}
+
+static void put_match(sdlz_enc_t *e, uint32_t len, uint32_t dist) {
+  int i = 28;
+  while (LEN_BASE[i] > len) i--;
+  put_litlen(e, 257 + i);
+  if (LEN_EXTRA[i]) put_bits(e, len - LEN_BASE[i], LEN_EXTRA[i]);
+  int d = 29;
+  while (DIST_BASE[d] > dist) d--;
+  put_code(e, d, 5);
+  if (DIST_EXTRA[d]) put_bits(e, dist - DIST_BASE[d], DIST_EXTRA[d]);
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+  uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+  return (v * 2654435761u) >> (32 - SDLZ_HASH_BITS);
+}
+
+static inline void insert(sdlz_enc_t *e, uint32_t p) {
+  uint32_t h = hash3(e->win + p);
+  e->prev[p & (SDLZ_WINDOW - 1)] = e->head[h];
+  e->head[h] = (uint16_t)(p + 1);
+}
+
+static uint32_t longest_match(sdlz_enc_t *e, uint32_t *dist) {
+  uint32_t avail = e->fill - e->pos;
+  if (avail < SDLZ_MIN_MATCH) return 0;
+  uint32_t max = (avail < SDLZ_MAX_MATCH) ? avail : SDLZ_MAX_MATCH;
+  const uint8_t *cur = e->win + e->pos;
+  uint32_t best = 0;
+  uint32_t cand = e->head[hash3(cur)];
+  for (int chain = 0; cand && chain < SDLZ_CHAIN; chain++) {
+    uint32_t c = cand - 1;
+    if (c >= e->pos || e->pos - c > SDLZ_WINDOW) break;
+    const uint8_t *m = e->win + c;
+    if (m[best] == cur[best] && m[0] == cur[0]) {
+      uint32_t n = 0;
+      while (n < max && m[n] == cur[n]) n++;
+      if (n > best) {
+        best = n;
+        *dist = e->pos - c;
+        if (n == max) break;
+      }
+    }
+    cand = e->prev[c & (SDLZ_WINDOW - 1)];
+  }
+  return (best >= SDLZ_MIN_MATCH) ? best : 0;
+}
+
+// Codifica mientras quede lookahead completo (o todo si 'flush')
+static void encode(sdlz_enc_t *e, bool flush) {
+  while (e->pos < e->fill && (flush || e->fill - e->pos >= SDLZ_MAX_MATCH)) {
+    uint32_t dist = 0;
+    uint32_t len = longest_match(e, &dist);
+    if (len) {
+      put_match(e, len, dist);
+    } else {
+      put_litlen(e, e->win[e->pos]);
+      len = 1;
+    }
+    for (uint32_t i = 0; i < len; i++, e->pos++)
+      if (e->pos + SDLZ_MIN_MATCH <= e->fill) insert(e, e->pos);
+  }
+}
+
+// Desplaza la ventana SDLZ_WINDOW bytes a la izquierda
+static void slide(sdlz_enc_t *e) {
+  memmove(e->win, e->win + SDLZ_WINDOW, SDLZ_WINDOW);
+  e->fill -= SDLZ_WINDOW;
+  e->pos -= SDLZ_WINDOW;
+  for (size_t i = 0; i < (1u << SDLZ_HASH_BITS); i++)
+    e->head[i] = (e->head[i] > SDLZ_WINDOW) ? e->head[i] - SDLZ_WINDOW : 0;
+  for (size_t i = 0; i < SDLZ_WINDOW; i++)
+    e->prev[i] = (e->prev[i] > SDLZ_WINDOW) ? e->prev[i] - SDLZ_WINDOW : 0;
+}
+
+static void begin_pack(sdlz_enc_t *e) {
+  e->fill = e->pos = 0;
+  memset(e->head, 0, sizeof(e->head));
+  memset(e->prev, 0, sizeof(e->prev));
+  e->in_len = e->out_len = 0;
+  e->crc = 0;
+  e->in_pack = true;
+  put_bits(e, 0, 1); // BFINAL = 0
+  put_bits(e, 1, 2); // BTYPE = 01 (Huffman fijo)
+}
+
+void sdlz_enc_init(sdlz_enc_t *e, sdlz_write_fn write, void *ctx) {
+  e->write = write;
+  e->ctx = ctx;
+  e->bits = 0;
+  e->nbits = 0;
+  e->olen = 0;
+  e->error = false;
+  e->in_pack = false;
+  e->in_len = e->out_len = 0;
+  e->crc = 0;
+}
+
+bool sdlz_enc_write(sdlz_enc_t *e, const void *data, size_t n) {
+  if (!e->in_pack) begin_pack(e);
+  const uint8_t *p = (const uint8_t *)data;
+  e->crc = sdrec_crc32(e->crc, p, n);
+  e->in_len += (uint32_t)n;
+  while (n > 0) {
+    if (e->fill == sizeof(e->win)) {
+      encode(e, false);
+      slide(e);
+    }
+    size_t k = sizeof(e->win) - e->fill;
+    if (k > n) k = n;
+    memcpy(e->win + e->fill, p, k);
+    e->fill += (uint32_t)k;
+    p += k;
+    n -= k;
+  }
+  return !e->error;
+}
+
+bool sdlz_enc_end_pack(sdlz_enc_t *e) {
+  if (!e->in_pack) begin_pack(e);
+  encode(e, true);
+  put_litlen(e, 256); // fin de bloque
+  // Sync flush: bloque stored vacío, deja la salida alineada a byte
+  put_bits(e, 0, 3);
+  if (e->nbits) put_bits(e, 0, 8 - e->nbits);
+  put_bits(e, 0x0000, 16);
+  put_bits(e, 0xFFFF, 16);
+  out_flush(e);
+  e->in_pack = false;
+  return !e->error;
+}
+
+/* ================= Descompresor ================= */
+
+void sdlz_dec_init(sdlz_dec_t *d, sdlz_read_fn read, void *ctx) {
+  d->read = read;
+  d->ctx = ctx;
+  d->total = 0;
+  d->bits = 0;
+  d->nbits = 0;
+  d->state = D_HDR;
+  d->final = false;
+  d->stored_left = 0;
+  d->copy_len = d->copy_dist = 0;
+}
+
+static bool need(sdlz_dec_t *d, uint8_t n) {
+  while (d->nbits < n) {
+    int c = d->read(d->ctx);
+    if (c < 0) return false;
+    d->bits |= (uint32_t)c << d->nbits;
+    d->nbits += 8;
+  }
+  return true;
+}
+
+static bool get_bits(sdlz_dec_t *d, uint8_t n, uint32_t *v) {
+  if (n == 0) {
+    *v = 0;
+    return true;
+  }
+  if (!need(d, n)) return false;
+  *v = d->bits & ((1u << n) - 1);
+  d->bits >>= n;
+  d->nbits -= n;
+  return true;
+}
+
+// Añade 'n' bits de un código Huffman (MSB primero) a 'code'
+static bool get_code(sdlz_dec_t *d, uint8_t n, uint32_t *code) {
+  for (uint8_t i = 0; i < n; i++) {
+    uint32_t b;
+    if (!get_bits(d, 1, &b)) return false;
+    *code = (*code << 1) | b;
+  }
+  return true;
+}
+
+static int fixed_litlen(sdlz_dec_t *d) {
+  uint32_t c = 0;
+  if (!get_code(d, 7, &c)) return -1;
+  if (c <= 23) return 256 + (int)c;
+  if (!get_code(d, 1, &c)) return -1;
+  if (c >= 0x30 && c <= 0xBF) return (int)(c - 0x30);
+  if (c >= 0xC0 && c <= 0xC7) return 280 + (int)(c - 0xC0);
+  if (!get_code(d, 1, &c)) return -1;
+  if (c >= 0x190 && c <= 0x1FF) return 144 + (int)(c - 0x190);
+  return -1;
+}
+
+static inline void emit(sdlz_dec_t *d, uint8_t *out, size_t *n, uint8_t b) {
+  d->win[d->total & (SDLZ_WINDOW - 1)] = b;
+  d->total++;
+  out[(*n)++] = b;
+}
+
+int sdlz_dec_read(sdlz_dec_t *d, uint8_t *out, size_t cap) {
+  size_t n = 0;
+  while (n < cap) {
+    if (d->copy_len) {
+      emit(d, out, &n, d->win[(d->total - d->copy_dist) & (SDLZ_WINDOW - 1)]);
+      d->copy_len--;
+      continue;
+    }
+    if (d->state == D_END) break;
+
+    if (d->state == D_HDR) {
+      if (d->final) {
+        d->state = D_END;
+        break;
+      }
+      uint32_t bf, bt;
+      if (!get_bits(d, 1, &bf) || !get_bits(d, 2, &bt)) return -1;
+      d->final = bf != 0;
+      if (bt == 1) {
+        d->state = D_FIXED;
+      } else if (bt == 0) {
+        d->bits >>= d->nbits & 7; // alinear a byte
+        d->nbits &= ~7;
+        uint32_t len, nlen;
+        if (!get_bits(d, 16, &len) || !get_bits(d, 16, &nlen) ||
+            (len ^ 0xFFFF) != nlen)
+          return -1;
+        // Bloque stored vacío sin BFINAL = sync flush = fin del pack
+        if (len == 0 && !d->final) {
+          d->state = D_END;
+          break;
+        }
+        d->stored_left = (uint16_t)len;
+        d->state = D_STORED;
+      } else {
+        return -1; // Huffman dinámico: no lo genera sdlz_enc
+      }
+      continue;
+    }
+
+    if (d->state == D_STORED) {
+      if (d->stored_left == 0) {
+        d->state = D_HDR;
+        continue;
+      }
+      uint32_t b;
+      if (!get_bits(d, 8, &b)) return -1;
+      emit(d, out, &n, (uint8_t)b);
+      d->stored_left--;
+      continue;
+    }
+
+    // D_FIXED
+    int sym = fixed_litlen(d);
+    if (sym < 0) return -1;
+    if (sym < 256) {
+      emit(d, out, &n, (uint8_t)sym);
+    } else if (sym == 256) {
+      d->state = D_HDR;
+    } else {
+      int i = sym - 257;
+      if (i > 28) return -1;
+      uint32_t extra, dcode = 0, dextra;
+      if (!get_bits(d, LEN_EXTRA[i], &extra)) return -1;
+      if (!get_code(d, 5, &dcode) || dcode > 29) return -1;
+      if (!get_bits(d, DIST_EXTRA[dcode], &dextra)) return -1;
+      uint32_t dist = DIST_BASE[dcode] + dextra;
+      if (dist > SDLZ_WINDOW || dist > d->total) return -1;
+      d->copy_len = (uint16_t)(LEN_BASE[i] + extra);
+      d->copy_dist = (uint16_t)dist;
+    }
+  }
+  return (int)n;
+}
+
+/* ================= Envoltorio gzip ================= */
+
+size_t sdlz_gzip_header(uint8_t *out) {
+  static const uint8_t h[SDLZ_GZIP_HDR] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+  memcpy(out, h, sizeof(h));
+  return sizeof(h);
+}
+
+size_t sdlz_stored_hdr(uint8_t *out, uint16_t len, bool final) {
+  out[0] = final ? 1 : 0;
+  out[1] = (uint8_t)len;
+  out[2] = (uint8_t)(len >> 8);
+  out[3] = (uint8_t)~len;
+  out[4] = (uint8_t)(~len >> 8);
+  return SDLZ_STORED_HDR;
+}
+
+size_t sdlz_gzip_trailer(uint8_t *out, uint32_t crc, uint32_t isize) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (uint8_t)(crc >> (8 * i));
+    out[4 + i] = (uint8_t)(isize >> (8 * i));
+  }
+  return SDLZ_GZIP_TRAILER;
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  for (; vec; vec >>= 1, mat++)
+    if (vec & 1) sum ^= *mat;
+  return sum;
+}
+
+static void gf2_square(uint32_t *sq, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++) sq[n] = gf2_times(mat, mat[n]);
+}
+
+uint32_t sdlz_crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2) {
+  if (len2 == 0) return crc1;
+  uint32_t even[32], odd[32];
+  odd[0] = 0xEDB88320u; // operador para un bit a cero
+  uint32_t row = 1;
+  for (int n = 1; n < 32; n++, row <<= 1) odd[n] = row;
+  gf2_square(even, odd); // 2 bits
+  gf2_square(odd, even); // 4 bits
+  do {
+    gf2_square(even, odd);
+    if (len2 & 1) crc1 = gf2_times(even, crc1);
+    len2 >>= 1;
+    if (!len2) break;
+    gf2_square(odd, even);
+    if (len2 & 1) crc1 = gf2_times(odd, crc1);
+    len2 >>= 1;
+  } while (len2);
+  return crc1 ^ crc2;
+}
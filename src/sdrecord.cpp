@@ -0,0 +1,684 @@
+#include "sdrecord.h"
+
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include <rom/crc.h>
+#endif
+
+// Tipos de valor (nibble alto del byte de campo)
+enum {
+  V_UINT = 0,   // varint
+  V_NINT = 1,   // '-' + varint
+  V_TDELTA = 2, // zigzag(t - t_anterior)
+  V_STR = 3,    // varint len + bytes (sin comillas, escapes tal cual)
+  V_MAC_LC = 4, // 6 bytes, "aa:bb:cc:dd:ee:ff"
+  V_MAC_UC = 5, // 6 bytes, "AA:BB:CC:DD:EE:FF"
+  V_TRUE = 6,
+  V_FALSE = 7,
+  V_NULL = 8,
+  V_NUM = 9, // número no entero: varint len + texto
+};
+
+#define KEY_NEW 0x0F
+
+void sdrec_ctx_reset(sdrec_ctx_t *ctx) {
+  ctx->nkeys = 0;
+  ctx->last_t = 0;
+}
+
+/* ================= Utilidades ================= */
+
+typedef struct {
+  uint8_t *p;
+  uint8_t *end;
+  bool ok;
+} wbuf_t;
+
+static inline void w_byte(wbuf_t *w, uint8_t b) {
+  if (w->p < w->end) *w->p++ = b;
+  else w->ok = false;
+}
+
+static inline void w_bytes(wbuf_t *w, const void *src, size_t n) {
+  if ((size_t)(w->end - w->p) >= n) {
+    memcpy(w->p, src, n);
+    w->p += n;
+  } else {
+    w->ok = false;
+  }
+}
+
+static inline void w_varint(wbuf_t *w, uint64_t v) {
+  while (v >= 0x80) {
+    w_byte(w, (uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  w_byte(w, (uint8_t)v);
+}
+
+static inline bool r_varint(const uint8_t **p, const uint8_t *end,
+                            uint64_t *v) {
+  uint64_t x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*p >= end) return false;
+    uint8_t b = *(*p)++;
+    x |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      *v = x;
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline int hexval(char c, bool *upper) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') {
+    *upper = true;
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// "aa:bb:cc:dd:ee:ff" en minúsculas o mayúsculas (no mezcladas)
+static bool parse_mac(const char *s, size_t len, uint8_t mac[6], bool *uc) {
+  if (len != 17) return false;
+  bool has_upper = false, has_lower = false;
+  for (int i = 0; i < 6; i++) {
+    const char *h = s + i * 3;
+    if (i < 5 && h[2] != ':') return false;
+    bool up = false;
+    int hi = hexval(h[0], &up), lo = hexval(h[1], &up);
+    if (hi < 0 || lo < 0) return false;
+    if (up) has_upper = true;
+    if ((h[0] >= 'a' && h[0] <= 'f') || (h[1] >= 'a' && h[1] <= 'f'))
+      has_lower = true;
+    mac[i] = (uint8_t)(hi << 4 | lo);
+  }
+  if (has_upper && has_lower) return false;
+  *uc = has_upper;
+  return true;
+}
+
+// Entero JSON canónico: -?(0|[1-9][0-9]*), hasta 19 cifras
+static bool parse_int(const char *s, size_t len, uint64_t *v, bool *neg) {
+  *neg = (len > 0 && s[0] == '-');
+  if (*neg) {
+    s++;
+    len--;
+  }
+  if (len == 0 || len > 19) return false;
+  if (s[0] == '0' && (len > 1 || *neg)) return false;
+  uint64_t x = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] < '0' || s[i] > '9') return false;
+    x = x * 10 + (uint64_t)(s[i] - '0');
+  }
+  *v = x;
+  return true;
+}
+
+static int find_key(const sdrec_ctx_t *ctx, const char *k, size_t klen) {
+  for (int i = 0; i < ctx->nkeys; i++) {
+    if (ctx->klen[i] == klen && memcmp(ctx->keys[i], k, klen) == 0) return i;
+  }
+  return -1;
+}
+
+static void add_key(sdrec_ctx_t *ctx, const char *k, size_t klen) {
+  if (ctx->nkeys >= SDREC_MAX_KEYS) return;
+  memcpy(ctx->keys[ctx->nkeys], k, klen);
+  ctx->keys[ctx->nkeys][klen] = '\0';
+  ctx->klen[ctx->nkeys] = (uint8_t)klen;
+  ctx->nkeys++;
+}
+
+/* ================= Codificador ================= */
+
+// Objeto plano y compacto: {"k":v,...}. Falla con espacios, anidados o
+// claves con escapes; entonces el llamante guarda el texto crudo.
+static bool encode_fields(sdrec_ctx_t *ctx, const char *p, const char *e,
+                          wbuf_t *w) {
+  if (p >= e || *p++ != '{') return false;
+  if (p < e && *p == '}') return p + 1 == e;
+
+  for (;;) {
+    // clave
+    if (p >= e || *p++ != '"') return false;
+    const char *ks = p;
+    while (p < e && *p != '"' && *p != '\\') p++;
+    if (p >= e || *p != '"') return false;
+    size_t klen = (size_t)(p - ks);
+    p++;
+    if (klen > SDREC_KEY_MAX) return false;
+    if (p >= e || *p++ != ':') return false;
+    if (p >= e) return false;
+
+    int ki = find_key(ctx, ks, klen);
+    bool is_t = (klen == 1 && ks[0] == 't');
+
+    // valor
+    uint8_t tag;
+    const char *vs = p;
+    size_t vlen = 0;
+    uint64_t num = 0;
+    uint8_t mac[6];
+    bool neg = false, uc = false;
+
+    if (*p == '"') {
+      vs = ++p;
+      bool esc = false;
+      while (p < e) {
+        if (esc) esc = false;
+        else if (*p == '\\') esc = true;
+        else if (*p == '"') break;
+        p++;
+      }
+      if (p >= e) return false;
+      vlen = (size_t)(p - vs);
+      p++;
+      if (parse_mac(vs, vlen, mac, &uc)) tag = uc ? V_MAC_UC : V_MAC_LC;
+      else tag = V_STR;
+    } else if (e - p >= 4 && memcmp(p, "true", 4) == 0) {
+      tag = V_TRUE;
+      p += 4;
+    } else if (e - p >= 5 && memcmp(p, "false", 5) == 0) {
+      tag = V_FALSE;
+      p += 5;
+    } else if (e - p >= 4 && memcmp(p, "null", 4) == 0) {
+      tag = V_NULL;
+      p += 4;
+    } else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+      while (p < e && (strchr("+-.eE", *p) || (*p >= '0' && *p <= '9')))
+        p++;
+      vlen = (size_t)(p - vs);
+      if (parse_int(vs, vlen, &num, &neg))
+        tag = neg ? V_NINT : (is_t ? V_TDELTA : V_UINT);
+      else
+        tag = V_NUM;
+    } else {
+      return false; // objeto/array anidado
+    }
+
+    w_byte(w, (uint8_t)(tag << 4 | (ki >= 0 ? ki : KEY_NEW)));
+    if (ki < 0) {
+      w_byte(w, (uint8_t)klen);
+      w_bytes(w, ks, klen);
+      add_key(ctx, ks, klen);
+    }
+
+    switch (tag) {
+    case V_UINT:
+    case V_NINT:
+      w_varint(w, num);
+      break;
+    case V_TDELTA: {
+      int64_t d = (int64_t)(num - ctx->last_t);
+      w_varint(w, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+      ctx->last_t = num;
+      break;
+    }
+    case V_MAC_LC:
+    case V_MAC_UC:
+      w_bytes(w, mac, 6);
+      break;
+    case V_STR:
+    case V_NUM:
+      w_varint(w, vlen);
+      w_bytes(w, vs, vlen);
+      break;
+    default:
+      break;
+    }
+    if (!w->ok) return false;
+
+    if (p < e && *p == ',') {
+      p++;
+      continue;
+    }
+    if (p < e && *p == '}') return p + 1 == e;
+    return false;
+  }
+}
+
+size_t sdrec_encode(sdrec_ctx_t *ctx, const char *json, size_t len,
+                    uint8_t *out, size_t cap) {
+  if (cap < SDREC_REC_MAX || len == 0 || len > SDREC_PAYLOAD_MAX) return 0;
+
+  // El cuerpo se escribe tras 3 bytes reservados (tipo + varint de 2 bytes)
+  const uint8_t nkeys = ctx->nkeys;
+  const uint64_t last_t = ctx->last_t;
+  wbuf_t w = {out + 3, out + 3 + SDREC_PAYLOAD_MAX, true};
+  if (encode_fields(ctx, json, json + len, &w)) {
+    size_t n = (size_t)(w.p - (out + 3));
+    if (n < len) {
+      out[0] = SDREC_OBJ;
+      if (n < 0x80) {
+        out[1] = (uint8_t)n;
+        memmove(out + 2, out + 3, n);
+        return n + 2;
+      }
+      out[1] = (uint8_t)(n | 0x80);
+      out[2] = (uint8_t)(n >> 7);
+      return n + 3;
+    }
+  }
+
+  // No compensa o no sabemos codificarlo: deshacer claves y guardar crudo
+  ctx->nkeys = nkeys;
+  ctx->last_t = last_t;
+  wbuf_t r = {out, out + cap, true};
+  w_byte(&r, SDREC_RAW);
+  w_varint(&r, len);
+  w_bytes(&r, json, len);
+  return r.ok ? (size_t)(r.p - out) : 0;
+}
+
+/* ================= Decodificador ================= */
+
+typedef struct {
+  char *p;
+  char *end;
+  bool ok;
+} tbuf_t;
+
+static inline void t_bytes(tbuf_t *t, const void *src, size_t n) {
+  if ((size_t)(t->end - t->p) >= n) {
+    memcpy(t->p, src, n);
+    t->p += n;
+  } else {
+    t->ok = false;
+  }
+}
+
+static inline void t_char(tbuf_t *t, char c) { t_bytes(t, &c, 1); }
+
+static void t_u64(tbuf_t *t, uint64_t v) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  while (n > 0) t_char(t, tmp[--n]);
+}
+
+static void t_mac(tbuf_t *t, const uint8_t *mac, bool uc) {
+  const char *hex = uc ? "0123456789ABCDEF" : "0123456789abcdef";
+  char s[17];
+  for (int i = 0; i < 6; i++) {
+    s[i * 3] = hex[mac[i] >> 4];
+    s[i * 3 + 1] = hex[mac[i] & 0x0F];
+    if (i < 5) s[i * 3 + 2] = ':';
+  }
+  t_bytes(t, s, sizeof(s));
+}
+
+static bool decode_fields(sdrec_ctx_t *ctx, const uint8_t *p,
+                          const uint8_t *e, tbuf_t *t) {
+  t_char(t, '{');
+  bool first = true;
+  while (p < e) {
+    uint8_t fb = *p++;
+    uint8_t tag = fb >> 4, ki = fb & 0x0F;
+    const char *k;
+    size_t klen;
+    if (ki == KEY_NEW) {
+      if (p >= e) return false;
+      klen = *p++;
+      if (klen > SDREC_KEY_MAX || (size_t)(e - p) < klen) return false;
+      k = (const char *)p;
+      p += klen;
+      add_key(ctx, k, klen);
+    } else {
+      if (ki >= ctx->nkeys) return false;
+      k = ctx->keys[ki];
+      klen = ctx->klen[ki];
+    }
+
+    if (!first) t_char(t, ',');
+    first = false;
+    t_char(t, '"');
+    t_bytes(t, k, klen);
+    t_bytes(t, "\":", 2);
+
+    uint64_t v;
+    switch (tag) {
+    case V_UINT:
+    case V_NINT:
+      if (!r_varint(&p, e, &v)) return false;
+      if (tag == V_NINT) t_char(t, '-');
+      t_u64(t, v);
+      break;
+    case V_TDELTA:
+      if (!r_varint(&p, e, &v)) return false;
+      ctx->last_t += (uint64_t)((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+      t_u64(t, ctx->last_t);
+      break;
+    case V_MAC_LC:
+    case V_MAC_UC:
+      if (e - p < 6) return false;
+      t_char(t, '"');
+      t_mac(t, p, tag == V_MAC_UC);
+      t_char(t, '"');
+      p += 6;
+      break;
+    case V_STR:
+    case V_NUM:
+      if (!r_varint(&p, e, &v) || (uint64_t)(e - p) < v) return false;
+      if (tag == V_STR) t_char(t, '"');
+      t_bytes(t, p, (size_t)v);
+      if (tag == V_STR) t_char(t, '"');
+      p += v;
+      break;
+    case V_TRUE:
+      t_bytes(t, "true", 4);
+      break;
+    case V_FALSE:
+      t_bytes(t, "false", 5);
+      break;
+    case V_NULL:
+      t_bytes(t, "null", 4);
+      break;
+    default:
+      return false;
+    }
+  }
+  t_char(t, '}');
+  return t->ok;
+}
+
+/* ================= Frames ================= */
+
+uint32_t sdrec_crc32(uint32_t crc, const uint8_t *p, size_t n) {
+#ifdef ESP_PLATFORM
+  return crc32_le(crc, p, n); // ROM, mismo resultado que zlib crc32()
+#else
+  crc = ~crc;
+  while (n--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+  }
+  return ~crc;
+#endif
+}
+
+size_t sdrec_frame_seal(uint8_t *frame, size_t payload_len, uint16_t flags,
+                        uint32_t seed) {
+  uint16_t lf = (uint16_t)((payload_len & SDREC_FRAME_LEN_MASK) | flags);
+  frame[0] = SDREC_SYNC;
+  frame[1] = (uint8_t)(lf & 0xFF);
+  frame[2] = (uint8_t)(lf >> 8);
+  uint32_t crc = sdrec_crc32(seed, frame + 1, 2 + payload_len);
+  uint8_t *c = frame + SDREC_FRAME_HDR + payload_len;
+  c[0] = (uint8_t)crc;
+  c[1] = (uint8_t)(crc >> 8);
+  c[2] = (uint8_t)(crc >> 16);
+  c[3] = (uint8_t)(crc >> 24);
+  return payload_len + SDREC_FRAME_OVH;
+}
+
+static inline uint32_t get_u32(const uint8_t *c) {
+  return (uint32_t)c[0] | (uint32_t)c[1] << 8 | (uint32_t)c[2] << 16 |
+         (uint32_t)c[3] << 24;
+}
+
+size_t sdrec_frame_check(const uint8_t *p, size_t avail, uint16_t *flags,
+                         uint32_t seed) {
+  if (avail < SDREC_FRAME_OVH || p[0] != SDREC_SYNC) return 0;
+  uint16_t lf = (uint16_t)(p[1] | p[2] << 8);
+  size_t len = lf & SDREC_FRAME_LEN_MASK;
+  if (len > SDREC_REC_MAX || len + SDREC_FRAME_OVH > avail) return 0;
+  if (sdrec_crc32(seed, p + 1, 2 + len) != get_u32(p + SDREC_FRAME_HDR + len))
+    return 0;
+  if (flags) *flags = lf & ~SDREC_FRAME_LEN_MASK;
+  return len + SDREC_FRAME_OVH;
+}
+
+void sdrec_evscan_reset(sdrec_evscan_t *ev) {
+  ev->nkeys = 0;
+  ev->rep_key = -1;
+}
+
+// Valor de "rep" de un registro OBJ (0 si no tiene). Recorre los campos como
+// decode_fields, sin texto; las claves nuevas se apuntan igual que add_key.
+static uint64_t obj_rep(sdrec_evscan_t *ev, const uint8_t *p, const uint8_t *e) {
+  uint64_t rep = 0;
+  while (p < e) {
+    uint8_t fb = *p++;
+    uint8_t tag = fb >> 4, ki = fb & 0x0F;
+    bool is_rep;
+    if (ki == KEY_NEW) {
+      if (p >= e) return rep;
+      size_t klen = *p++;
+      if (klen > SDREC_KEY_MAX || (size_t)(e - p) < klen) return rep;
+      is_rep = klen == 3 && memcmp(p, "rep", 3) == 0;
+      p += klen;
+      if (ev->nkeys < SDREC_MAX_KEYS) {
+        if (is_rep) ev->rep_key = (int8_t)ev->nkeys;
+        ev->nkeys++;
+      }
+    } else {
+      is_rep = ki == ev->rep_key;
+    }
+
+    uint64_t v;
+    switch (tag) {
+    case V_UINT:
+    case V_NINT:
+    case V_TDELTA:
+      if (!r_varint(&p, e, &v)) return rep;
+      if (is_rep && tag == V_UINT) rep = v;
+      break;
+    case V_MAC_LC:
+    case V_MAC_UC:
+      if (e - p < 6) return rep;
+      p += 6;
+      break;
+    case V_STR:
+    case V_NUM:
+      if (!r_varint(&p, e, &v) || (uint64_t)(e - p) < v) return rep;
+      p += v;
+      break;
+    case V_TRUE:
+    case V_FALSE:
+    case V_NULL:
+      break;
+    default:
+      return rep;
+    }
+  }
+  return rep;
+}
+
+size_t sdrec_count_events(sdrec_evscan_t *ev, const uint8_t *recs, size_t len) {
+  const uint8_t *p = recs, *end = recs + len;
+  size_t n = 0;
+  while (p < end) {
+    uint8_t type = *p++;
+    if (type == SDREC_EOL) {
+      sdrec_evscan_reset(ev);
+      continue;
+    }
+    if (type != SDREC_OBJ && type != SDREC_RAW) continue;
+    uint64_t rlen;
+    if (!r_varint(&p, end, &rlen) || rlen > (uint64_t)(end - p)) break;
+    if (type == SDREC_RAW) {
+      n += sdrec_json_events((const char *)p, (size_t)rlen);
+    } else {
+      uint64_t rep = obj_rep(ev, p, p + rlen);
+      n += (rep > 1 && rep <= UINT32_MAX) ? (size_t)rep : 1;
+    }
+    p += rlen;
+  }
+  return n;
+}
+
+uint32_t sdrec_json_events(const char *json, size_t len) {
+  const char *end = json + len, *p = json;
+  for (; p + 6 <= end; p++)
+    if (memcmp(p, "\"rep\":", 6) == 0) break;
+  if (p + 6 > end) return 1;
+  p += 6;
+  uint32_t v = 0;
+  while (p < end && *p >= '0' && *p <= '9' && v < 100000000u)
+    v = v * 10 + (uint32_t)(*p++ - '0');
+  return v > 1 ? v : 1;
+}
+
+size_t sdrec_find_tail(const uint8_t *buf, size_t n, uint16_t *flags,
+                       uint32_t seed) {
+  if (n < SDREC_FRAME_OVH) return 0;
+  for (size_t p = n - SDREC_FRAME_OVH + 1; p-- > 0;) {
+    if (buf[p] != SDREC_SYNC) continue;
+    size_t sz = sdrec_frame_check(buf + p, n - p, flags, seed);
+    if (sz) return p + sz;
+  }
+  return 0;
+}
+
+/* ================= Lector ================= */
+
+bool sdrec_reader_init(sdrec_reader_t *r, FILE *f, uint32_t start,
+                       uint32_t end, bool framed, uint32_t seed) {
+  r->f = f;
+  r->framed = framed;
+  r->seed = seed;
+  r->pos = r->next_pos = start;
+  r->end = end;
+  r->skipped = 0;
+  r->rec_len = r->rec_off = 0;
+  r->json_len = 0;
+  sdrec_ctx_reset(&r->ctx);
+  return fseek(f, (long)start, SEEK_SET) == 0;
+}
+
+// Lee el frame en r->next_pos. SDREC_R_JSON = cargado, END, o BAD si el
+// fichero se acaba a mitad (cola cortada). 'ok' = false si no valida.
+static int read_frame(sdrec_reader_t *r, bool *ok, uint16_t *flags) {
+  uint8_t h[SDREC_FRAME_HDR];
+  size_t got = fread(h, 1, sizeof(h), r->f);
+  if (got == 0) return SDREC_R_END;
+  if (got < sizeof(h)) return SDREC_R_BAD;
+  *ok = false;
+  if (h[0] != SDREC_SYNC) return SDREC_R_JSON;
+  uint16_t lf = (uint16_t)(h[1] | h[2] << 8);
+  size_t len = lf & SDREC_FRAME_LEN_MASK;
+  if (len > SDREC_REC_MAX) return SDREC_R_JSON;
+  uint8_t c[4];
+  if (fread(r->rec, 1, len, r->f) != len || fread(c, 1, 4, r->f) != 4)
+    return SDREC_R_BAD;
+  uint32_t crc = sdrec_crc32(r->seed, h + 1, 2);
+  crc = sdrec_crc32(crc, r->rec, len);
+  if (crc != get_u32(c)) return SDREC_R_JSON;
+  *ok = true;
+  *flags = lf & ~SDREC_FRAME_LEN_MASK;
+  r->rec_len = len;
+  r->rec_off = 0;
+  r->next_pos += (uint32_t)(len + SDREC_FRAME_OVH);
+  return SDREC_R_JSON;
+}
+
+static int load_frame(sdrec_reader_t *r) {
+  bool ok;
+  uint16_t flags;
+  uint32_t bad_at = r->next_pos;
+  int x = read_frame(r, &ok, &flags);
+  if (x != SDREC_R_JSON || ok) return x;
+
+  // Frame corrupto: buscamos el siguiente que valide y empiece línea (la
+  // tabla de claves de la línea a medias se ha perdido)
+  for (uint32_t cand = bad_at + 1;; cand++) {
+    if (fseek(r->f, (long)cand, SEEK_SET) != 0) return SDREC_R_END;
+    int c;
+    while ((c = fgetc(r->f)) != EOF && c != SDREC_SYNC) cand++;
+    if (c == EOF) {
+      r->skipped += cand - bad_at;
+      r->next_pos = cand;
+      return SDREC_R_END;
+    }
+    fseek(r->f, (long)cand, SEEK_SET);
+    r->next_pos = cand;
+    x = read_frame(r, &ok, &flags);
+    if (x == SDREC_R_JSON && ok && (flags & SDREC_FRAME_LINE_START)) {
+      r->skipped += cand - bad_at;
+      sdrec_ctx_reset(&r->ctx);
+      return SDREC_R_JSON;
+    }
+    if (x == SDREC_R_END) return x;
+  }
+}
+
+// Versión 2: cada registro se carga suelto como si fuera un frame
+static int load_record(sdrec_reader_t *r) {
+  int c = fgetc(r->f);
+  if (c == EOF) return SDREC_R_END;
+  r->rec[0] = (uint8_t)c;
+  size_t n = 1;
+  if (c != SDREC_EOL) {
+    if (c != SDREC_OBJ && c != SDREC_RAW) return SDREC_R_BAD;
+    uint32_t len = 0;
+    for (int shift = 0;; shift += 7) {
+      int b = fgetc(r->f);
+      if (b == EOF || shift > 14) return SDREC_R_BAD;
+      r->rec[n++] = (uint8_t)b;
+      len |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) break;
+    }
+    if (len > SDREC_PAYLOAD_MAX) return SDREC_R_BAD;
+    if (fread(r->rec + n, 1, len, r->f) != len) return SDREC_R_BAD;
+    n += len;
+  }
+  r->rec_len = n;
+  r->rec_off = 0;
+  r->next_pos += (uint32_t)n;
+  return SDREC_R_JSON;
+}
+
+int sdrec_next(sdrec_reader_t *r) {
+  if (r->rec_off >= r->rec_len) {
+    r->pos = r->next_pos;
+    if (r->end && r->pos >= r->end) return SDREC_R_END;
+    int x = r->framed ? load_frame(r) : load_record(r);
+    if (x != SDREC_R_JSON) {
+      r->pos = r->next_pos;
+      return x;
+    }
+  }
+
+  const uint8_t *p = r->rec + r->rec_off;
+  const uint8_t *e = r->rec + r->rec_len;
+  uint8_t type = *p++;
+  int ret;
+
+  if (type == SDREC_EOL) {
+    sdrec_ctx_reset(&r->ctx);
+    ret = SDREC_R_LINE;
+  } else {
+    uint64_t len;
+    if ((type != SDREC_OBJ && type != SDREC_RAW) || !r_varint(&p, e, &len) ||
+        (uint64_t)(e - p) < len) {
+      r->rec_off = r->rec_len; // frame inconsistente: se descarta el resto
+      return SDREC_R_BAD;
+    }
+    if (type == SDREC_RAW) {
+      memcpy(r->json, p, (size_t)len);
+      r->json_len = (size_t)len;
+    } else {
+      tbuf_t t = {r->json, r->json + sizeof(r->json), true};
+      if (!decode_fields(&r->ctx, p, p + len, &t)) {
+        r->rec_off = r->rec_len;
+        return SDREC_R_BAD;
+      }
+      r->json_len = (size_t)(t.p - r->json);
+    }
+    p += len;
+    ret = SDREC_R_JSON;
+  }
+
+  r->rec_off = (size_t)(p - r->rec);
+  if (r->rec_off >= r->rec_len) r->pos = r->next_pos; // frame consumido
+  return ret;
+}
@@ -0,0 +1,102 @@
+#include "sdring.h"
+
+#include <string.h>
+
+#define PAD_LEN 0xFFFFu // cabecera de relleno hasta el final del buffer
+
+static inline uint32_t rec_span(size_t len) {
+  return (uint32_t)((SDRING_HDR_SIZE + len + 3u) & ~3u);
+}
+
+static inline uint32_t load_acq(const volatile uint32_t *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_rel(volatile uint32_t *p, uint32_t v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline void put_hdr(uint8_t *p, uint16_t len, uint8_t op) {
+  p[0] = (uint8_t)(len & 0xFF);
+  p[1] = (uint8_t)(len >> 8);
+  p[2] = op;
+  p[3] = 0;
+}
+
+bool sdring_init(sdring_t *r, uint8_t *buf, uint32_t size) {
+  if (!r || !buf || size < 64 || (size & (size - 1)) != 0) return false;
+  r->buf = buf;
+  r->size = size;
+  r->head = 0;
+  r->tail = 0;
+  r->hwm = 0;
+  portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+  r->lock = unlocked;
+  return true;
+}
+
+uint32_t sdring_used(const sdring_t *r) {
+  return load_acq(&r->head) - load_acq(&r->tail);
+}
+
+// Se puede llamar desde tarea o ISR. Devuelve false si no hay hueco.
+bool sdring_push(sdring_t *r, uint8_t op, const void *data, size_t len) {
+  if (len > SDRING_MAX_PAYLOAD) return false;
+  const uint32_t need = rec_span(len);
+  if (need > r->size / 2) return false;
+
+  bool ok = false;
+  portENTER_CRITICAL_SAFE(&r->lock);
+  uint32_t head = r->head;
+  uint32_t tail = load_acq(&r->tail);
+  uint32_t free_bytes = r->size - (head - tail);
+  uint32_t off = head & (r->size - 1);
+  uint32_t to_end = r->size - off;
+
+  if (need > to_end) {
+    // No cabe contiguo: relleno hasta el final y empezamos en 0
+    if (to_end + need <= free_bytes) {
+      put_hdr(r->buf + off, PAD_LEN, 0);
+      head += to_end;
+      off = 0;
+      ok = true;
+    }
+  } else {
+    ok = (need <= free_bytes);
+  }
+
+  if (ok) {
+    put_hdr(r->buf + off, (uint16_t)len, op);
+    if (len) memcpy(r->buf + off + SDRING_HDR_SIZE, data, len);
+    store_rel(&r->head, head + need);
+    uint32_t used = head + need - tail; // incluye el relleno
+    if (used > r->hwm) r->hwm = used;
+  }
+  portEXIT_CRITICAL_SAFE(&r->lock);
+  return ok;
+}
+
+// Solo consumidor: devuelve el registro más antiguo sin copiarlo.
+bool sdring_peek(sdring_t *r, sdring_rec_t *out) {
+  uint32_t tail = r->tail;
+  for (;;) {
+    if (tail == load_acq(&r->head)) return false;
+    uint32_t off = tail & (r->size - 1);
+    const uint8_t *p = r->buf + off;
+    uint16_t len = (uint16_t)(p[0] | (p[1] << 8));
+    if (len == PAD_LEN) {
+      tail += r->size - off;
+      store_rel(&r->tail, tail);
+      continue;
+    }
+    out->op = p[2];
+    out->len = len;
+    out->data = p + SDRING_HDR_SIZE;
+    out->span = rec_span(len);
+    return true;
+  }
+}
+
+void sdring_pop(sdring_t *r, const sdring_rec_t *rec) {
+  store_rel(&r->tail, r->tail + rec->span);
+}
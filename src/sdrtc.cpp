@@ -0,0 +1,137 @@
+#ifdef HAS_SDCARD
+
+#include "sdrtc.h"
+#include "sdrecord.h" // sdrec_crc32
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include <string.h>
+
+#ifndef TAG
+#define TAG "sdrtc"
+#endif
+
+#define SDRTC_MAGIC 0x43545253UL // "SRTC"
+
+typedef struct {
+  uint32_t magic;
+  uint16_t head;   // hueco del más antiguo
+  uint16_t used;
+  uint16_t cycles; // sueños desde el último volcado
+  uint16_t armed;  // el último sueño fue de SLEEPCYCLE
+  uint32_t kept, flushed, flushes, lost;
+  sdrtc_rec_t recs[SDRTC_SLOTS];
+  uint32_t crc;    // de todo lo anterior
+} sdrtc_mem_t;
+
+RTC_NOINIT_ATTR static sdrtc_mem_t s_rtc;
+
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool s_woke = false; // arranque por fin de sueño profundo
+
+static inline uint32_t mem_crc(void) {
+  return sdrec_crc32(0, (const uint8_t *)&s_rtc, offsetof(sdrtc_mem_t, crc));
+}
+
+void sdrtc_boot(void) {
+  s_woke = esp_reset_reason() == ESP_RST_DEEPSLEEP;
+  portENTER_CRITICAL(&s_mux);
+  bool valid = s_rtc.magic == SDRTC_MAGIC && s_rtc.crc == mem_crc() &&
+               s_rtc.head < SDRTC_SLOTS && s_rtc.used <= SDRTC_SLOTS;
+  if (!valid) {
+    memset(&s_rtc, 0, sizeof(s_rtc));
+    s_rtc.magic = SDRTC_MAGIC;
+  }
+  if (!s_woke) s_rtc.armed = 0; // reinicio: se monta como siempre
+  s_rtc.crc = mem_crc();
+  portEXIT_CRITICAL(&s_mux);
+  if (valid && s_rtc.used)
+    ESP_LOGI(TAG, "sdrtc: %u count(s) kept in RTC memory over %u sleep(s)",
+             (unsigned)s_rtc.used, (unsigned)s_rtc.cycles);
+}
+
+static bool due_locked(void) {
+  return s_rtc.cycles >= SDRTC_FLUSH_CYCLES ||
+         s_rtc.used * 100U >= SDRTC_SLOTS * (uint32_t)SDRTC_FULL_PCT;
+}
+
+bool sdrtc_defer(void) {
+  portENTER_CRITICAL(&s_mux);
+  bool defer = s_woke && s_rtc.armed && !due_locked();
+  portEXIT_CRITICAL(&s_mux);
+  return defer;
+}
+
+void sdrtc_sleep(bool armed) {
+  portENTER_CRITICAL(&s_mux);
+  s_rtc.armed = armed;
+  if (armed && s_rtc.cycles < UINT16_MAX) s_rtc.cycles++;
+  s_rtc.crc = mem_crc();
+  portEXIT_CRITICAL(&s_mux);
+}
+
+bool sdrtc_push(uint32_t t, uint32_t w) {
+  portENTER_CRITICAL(&s_mux);
+  bool full = s_rtc.used == SDRTC_SLOTS;
+  if (full) { // se pisa el más antiguo
+    s_rtc.head = (s_rtc.head + 1) % SDRTC_SLOTS;
+    s_rtc.used--;
+    s_rtc.lost++;
+  }
+  sdrtc_rec_t &r = s_rtc.recs[(s_rtc.head + s_rtc.used) % SDRTC_SLOTS];
+  r.t = t;
+  r.w = w;
+  s_rtc.used++;
+  s_rtc.kept++;
+  s_rtc.crc = mem_crc();
+  portEXIT_CRITICAL(&s_mux);
+  return !full;
+}
+
+bool sdrtc_due(void) {
+  portENTER_CRITICAL(&s_mux);
+  bool due = s_rtc.used && due_locked();
+  portEXIT_CRITICAL(&s_mux);
+  return due;
+}
+
+size_t sdrtc_pending(void) { return s_rtc.used; }
+
+bool sdrtc_peek(sdrtc_rec_t *out) {
+  portENTER_CRITICAL(&s_mux);
+  bool found = s_rtc.used != 0;
+  if (found) *out = s_rtc.recs[s_rtc.head];
+  portEXIT_CRITICAL(&s_mux);
+  return found;
+}
+
+void sdrtc_pop(void) {
+  portENTER_CRITICAL(&s_mux);
+  if (s_rtc.used) {
+    s_rtc.head = (s_rtc.head + 1) % SDRTC_SLOTS;
+    s_rtc.used--;
+    s_rtc.flushed++;
+    if (s_rtc.used == 0) { // volcado completo: vuelve a contar sueños
+      s_rtc.cycles = 0;
+      s_rtc.flushes++;
+    }
+    s_rtc.crc = mem_crc();
+  }
+  portEXIT_CRITICAL(&s_mux);
+}
+
+void sdrtc_get_stats(sdrtc_stats_t *out) {
+  portENTER_CRITICAL(&s_mux);
+  out->used = s_rtc.used;
+  out->cycles = s_rtc.cycles;
+  out->kept = s_rtc.kept;
+  out->flushed = s_rtc.flushed;
+  out->flushes = s_rtc.flushes;
+  out->lost = s_rtc.lost;
+  portEXIT_CRITICAL(&s_mux);
+}
+
+#endif
@@ -0,0 +1,1846 @@
+#ifdef HAS_SDCARD
+
+#include "sdsegment.h"
+#include "sdrecord.h"
+#include "sdtindex.h"
+#include "sdlz.h"
+#include "sdenc.h"
+#include "sdacct.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h" // esp_random
+#include "esp_timer.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+#include <fcntl.h>
+#include <sys/unistd.h>
+#include <sys/stat.h>
+
+#ifndef TAG
+#define TAG "sdseg"
+#endif
+
+static char s_root[SDSEG_ROOT_MAX] = "";     // p.ej. "/sdcard/maclog"
+static char s_manifest[SDSEG_PATH_MAX] = ""; // s_root + "/MANIFEST.TXT"
+static uint32_t s_next_seq = 1;      // siguiente número de segmento libre
+static SemaphoreHandle_t s_seg_mutex = NULL; // serializa unlink/reescritura
+
+// Segmento activo: solo lo toca la tarea writer
+static int s_active = -1;                    // fd del segmento activo
+static sdseg_hdr_t s_hdr;
+static bool s_hdr_dirty = false;
+static uint32_t s_alloc_end = 0;             // tamaño preasignado del fichero
+
+// Group commit: los registros se acumulan en s_wbuf, que siempre empieza en
+// un offset múltiplo de SDSEG_SECTOR; cada commit es un único write(). El
+// sector final incompleto se queda en el buffer y se reescribe entero en el
+// siguiente commit.
+static uint8_t s_wbuf[SDSEG_WBUF_SIZE];
+static uint32_t s_wbuf_off = 0;   // offset en fichero de s_wbuf[0]
+static size_t s_wlen = 0;         // bytes válidos en s_wbuf
+static size_t s_wcommitted = 0;   // de ellos, ya escritos en la tarjeta
+static bool s_unsynced = false;   // hay commits sin fsync
+static uint32_t s_dirty_since = 0; // ms del primer byte sin fsync
+
+// Frame abierto: registros pendientes de CRC (ver sdrecord.h)
+static uint8_t s_frame[SDREC_FRAME_MAX];
+static size_t s_flen = 0;          // bytes de registros en el frame
+static bool s_fline_start = true;  // el frame abierto empieza línea
+
+static sdtidx_writer_t s_tidx;     // índice temporal del activo
+
+static sdseg_durability_t s_durability = SDSEG_DURABILITY_DEFAULT;
+static uint32_t s_interval_ms = SDSEG_COMMIT_INTERVAL_MS;
+static sdseg_commit_stats_t s_cstats;
+static uint32_t s_bucket = 0;                // franja SDSEG_SPAN_SEC del activo
+static volatile uint32_t s_active_seq = 0;   // 0 = ninguno (visible a lectores)
+static volatile uint32_t s_pinned_seq = 0;   // en envío: no se comprime
+static uint32_t s_lz_bad_seq = 0;            // último que no se pudo comprimir
+static sdseg_lz_stats_t s_lz_stats;
+
+// Final estable del activo para lectores: último fin de línea que ya pasó
+// por fsync. Lo publica la writer; se lee sin pararla.
+static uint32_t s_line_end = 0;              // último fin de línea (writer)
+static portMUX_TYPE s_pub_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_pub_seq = 0, s_pub_end = 0;
+static sdseg_hdr_t s_pub_hdr; // contadores del activo en ese momento
+
+static inline void seg_lock(void) {
+  if (s_seg_mutex) xSemaphoreTake(s_seg_mutex, portMAX_DELAY);
+}
+static inline void seg_unlock(void) {
+  if (s_seg_mutex) xSemaphoreGive(s_seg_mutex);
+}
+
+static inline uint32_t bucket_of(time_t t) {
+  return ((uint32_t)t >= SDSEG_MIN_VALID_T) ? (uint32_t)t / SDSEG_SPAN_SEC : 0;
+}
+
+// "0000002A.SEG" -> 0x2A (FAT puede devolver el nombre en minúsculas)
+static bool parse_seq(const char *name, uint32_t *seq) {
+  if (strlen(name) != 12 || name[8] != '.') return false;
+  if (strcasecmp(name + 9, "SEG") != 0) return false;
+  char hex[9];
+  memcpy(hex, name, 8);
+  hex[8] = '\0';
+  char *end = NULL;
+  unsigned long v = strtoul(hex, &end, 16);
+  if (!end || *end || v == 0) return false;
+  *seq = (uint32_t)v;
+  return true;
+}
+
+// Días desde 1970 <-> fecha UTC (calendario gregoriano, sin gmtime)
+static void civil_from_days(uint32_t z, unsigned *y, unsigned *m, unsigned *d) {
+  z += 719468;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+static uint32_t days_from_civil(unsigned y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  uint32_t era = y / 400;
+  uint32_t yoe = y - era * 400;
+  uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// "20250314" -> día
+static bool parse_day(const char *name, uint32_t *day) {
+  if (strlen(name) != 8) return false;
+  for (int i = 0; i < 8; i++)
+    if (name[i] < '0' || name[i] > '9') return false;
+  unsigned long v = strtoul(name, NULL, 10);
+  unsigned y = v / 10000, m = v / 100 % 100, d = v % 100;
+  if (y < 1970 || m < 1 || m > 12 || d < 1 || d > 31) return false;
+  *day = days_from_civil(y, m, d);
+  return true;
+}
+
+void sdseg_part_dir(uint32_t day, char *out, size_t n) {
+  unsigned y, m, d;
+  civil_from_days(day, &y, &m, &d);
+  snprintf(out, n, "%s/%04u%02u%02u", s_root, y % 10000, m % 100, d % 100);
+}
+
+// 'ext' de 3 letras. Si no cabe en 'n' la ruta queda vacía (fopen falla).
+static void seg_file(uint32_t seq, const char *ext, char *out, size_t n) {
+  char dir[SDSEG_DIR_MAX];
+  sdseg_part_dir(sdseg_seq_day(seq), dir, sizeof(dir));
+  int r = snprintf(out, n, "%s/%08lX.%.3s", dir, (unsigned long)seq, ext);
+  if (r < 0 || (size_t)r >= n) {
+    ESP_LOGE(TAG, "sdseg: path for %08lX doesn't fit in %u bytes",
+             (unsigned long)seq, (unsigned)n);
+    if (n) out[0] = '\0';
+  }
+}
+
+void sdseg_path(uint32_t seq, char *out, size_t n) { seg_file(seq, "SEG", out, n); }
+
+void sdseg_idx_path(uint32_t seq, char *out, size_t n) { seg_file(seq, "IDX", out, n); }
+
+static bool write_hdr(FILE *f, const sdseg_hdr_t *hdr) {
+  if (fseek(f, 0, SEEK_SET) != 0) return false;
+  bool ok = fwrite(hdr, 1, sizeof(*hdr), f) == sizeof(*hdr);
+  fseek(f, 0, SEEK_END);
+  return ok;
+}
+
+static bool read_hdr_fp(FILE *f, sdseg_hdr_t *hdr) {
+  if (fseek(f, 0, SEEK_SET) != 0) return false;
+  if (fread(hdr, 1, sizeof(*hdr), f) != sizeof(*hdr)) return false;
+  return hdr->magic == SDSEG_MAGIC && hdr->hdr_size == SDSEG_HDR_SIZE;
+}
+
+bool sdseg_read_hdr(uint32_t seq, sdseg_hdr_t *hdr) {
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  bool ok = read_hdr_fp(f, hdr);
+  fclose(f);
+  return ok;
+}
+
+bool sdseg_readable(const sdseg_hdr_t *hdr) {
+  return !sdseg_is_enc(hdr) || (sdenc_ready() && hdr->key_id == sdenc_key_id());
+}
+
+// Lectura de los datos con la cabecera ya leída
+static FILE *open_data(const char *path, const sdseg_hdr_t *hdr) {
+  if (!sdseg_is_enc(hdr)) return fopen(path, "rb");
+  if (!sdseg_readable(hdr)) {
+    ESP_LOGW(TAG, "sdseg: %s encrypted with another key (%08lX)", path,
+             (unsigned long)hdr->key_id);
+    return NULL;
+  }
+  return sdenc_fopen(path, hdr->iv, SDSEG_HDR_SIZE);
+}
+
+FILE *sdseg_fopen(uint32_t seq, sdseg_hdr_t *hdr) {
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  sdseg_hdr_t h;
+  if (!hdr) hdr = &h;
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  if (!read_hdr_fp(f, hdr)) {
+    fclose(f);
+    return NULL;
+  }
+  if (!sdseg_is_enc(hdr)) return f;
+  fclose(f);
+  return open_data(path, hdr);
+}
+
+// Cabecera de un fichero nuevo: si hay clave se cifra, con su propio nonce
+static void hdr_set_enc(sdseg_hdr_t *h) {
+  h->flags &= ~SDSEG_FLAG_ENC;
+  memset(h->iv, 0, sizeof(h->iv));
+  h->key_id = 0;
+  if (!sdenc_ready()) return;
+  h->flags |= SDSEG_FLAG_ENC;
+  sdenc_new_iv(h->iv);
+  h->key_id = sdenc_key_id();
+}
+
+// Recorre los registros binarios desde la cabecera. Devuelve el offset tras
+// el último registro íntegro; 'lines' cuenta las líneas cerradas y
+// 'open_line' indica si quedan objetos sin fin de línea.
+static uint32_t scan_records(FILE *f, bool framed, uint32_t seed,
+                             uint32_t *lines, bool *open_line) {
+  *lines = 0;
+  *open_line = false;
+  sdrec_reader_t *r = (sdrec_reader_t *)malloc(sizeof(sdrec_reader_t));
+  if (!r) return SDSEG_HDR_SIZE;
+  sdrec_reader_init(r, f, SDSEG_HDR_SIZE, 0, framed, seed);
+  int x;
+  while ((x = sdrec_next(r)) > 0) {
+    if (x == SDREC_R_LINE) {
+      (*lines)++;
+      *open_line = false;
+    } else {
+      *open_line = true;
+    }
+  }
+  uint32_t good = r->pos;
+  free(r);
+  return good;
+}
+
+// Frames: el corte está como mucho a una ventana del final (lo que no llegó
+// a fsync), así que se busca hacia atrás el último frame válido. Las líneas
+// se cuentan solo desde el último punto con cabecera escrita. Si algo no
+// cuadra se recurre al recorrido completo.
+#define RECOVERY_WINDOW (SDSEG_WBUF_SIZE + SDREC_FRAME_MAX)
+
+static uint32_t recover_tail(FILE *f, const sdseg_hdr_t *hdr, uint32_t size,
+                             uint32_t *lines, bool *open_line) {
+  uint32_t data = size - SDSEG_HDR_SIZE;
+  uint32_t win = (data < RECOVERY_WINDOW) ? data : RECOVERY_WINDOW;
+  uint8_t *buf = (uint8_t *)malloc(win ? win : 1);
+  if (!buf) return scan_records(f, true, 0, lines, open_line);
+
+  uint16_t fl = 0;
+  size_t e = 0;
+  if (fseek(f, (long)(size - win), SEEK_SET) == 0 &&
+      fread(buf, 1, win, f) == win)
+    e = sdrec_find_tail(buf, win, &fl, 0);
+  free(buf);
+
+  uint32_t good;
+  if (e) good = size - win + (uint32_t)e;
+  else if (win == data) good = SDSEG_HDR_SIZE; // nada válido
+  else return scan_records(f, true, 0, lines, open_line);
+
+  uint32_t synced = SDSEG_HDR_SIZE + hdr->data_len;
+  if (synced > good) return scan_records(f, true, 0, lines, open_line);
+
+  // Fines de línea entre el último sync y el corte (solo cabeceras)
+  *lines = hdr->lines;
+  *open_line = (good > SDSEG_HDR_SIZE) && !(fl & SDREC_FRAME_LINE_END);
+  uint32_t pos = synced;
+  while (pos < good) {
+    uint8_t h[SDREC_FRAME_HDR];
+    if (fseek(f, (long)pos, SEEK_SET) != 0 || fread(h, 1, sizeof(h), f) != sizeof(h) ||
+        h[0] != SDREC_SYNC)
+      return scan_records(f, true, 0, lines, open_line);
+    uint16_t lf = (uint16_t)(h[1] | h[2] << 8);
+    if (lf & SDREC_FRAME_LINE_END) (*lines)++;
+    pos += (lf & SDREC_FRAME_LEN_MASK) + SDREC_FRAME_OVH;
+  }
+  if (pos != good) return scan_records(f, true, 0, lines, open_line);
+  return good;
+}
+
+// Versión 4: el fichero está preasignado, así que su final físico no dice
+// nada. Se avanza frame a frame desde el último punto con cabecera escrita
+// hasta el primero que no valida (el CRC salado descarta lo que hubiera en
+// los clusters reutilizados).
+static uint32_t recover_from_sync(FILE *f, const sdseg_hdr_t *hdr,
+                                  uint32_t size, uint32_t *lines,
+                                  uint32_t *objs, bool *open_line) {
+  uint32_t pos = SDSEG_HDR_SIZE + hdr->data_len;
+  *lines = hdr->lines;
+  *objs = hdr->objs;
+  *open_line = (hdr->flags & SDSEG_FLAG_MIDLINE) != 0;
+  if (pos > size) { // cabecera más nueva que los datos: desde el principio
+    pos = SDSEG_HDR_SIZE;
+    *lines = 0;
+    *objs = 0;
+    *open_line = false;
+  }
+  uint8_t *buf = (uint8_t *)malloc(SDREC_FRAME_MAX);
+  if (!buf) return pos;
+
+  uint32_t seed = sdseg_crc_seed(hdr);
+  sdrec_evscan_t ev; // desde el sync, quizá a media línea
+  sdrec_evscan_reset(&ev);
+  while (pos + SDREC_FRAME_OVH <= size) {
+    size_t avail = size - pos;
+    if (avail > SDREC_FRAME_MAX) avail = SDREC_FRAME_MAX;
+    uint16_t fl;
+    size_t n = 0;
+    if (fseek(f, (long)pos, SEEK_SET) == 0 && fread(buf, 1, avail, f) == avail)
+      n = sdrec_frame_check(buf, avail, &fl, seed);
+    if (n == 0) break;
+    *objs += (uint32_t)sdrec_count_events(&ev, buf + SDREC_FRAME_HDR, n - SDREC_FRAME_OVH);
+    if (fl & SDREC_FRAME_LINE_END) (*lines)++;
+    *open_line = !(fl & SDREC_FRAME_LINE_END);
+    pos += (uint32_t)n;
+  }
+  free(buf);
+  return pos;
+}
+
+// Un segmento que quedó abierto (reset/corte) se sella tal cual: la
+// longitud real manda sobre la cabecera y se cierra la línea a medias.
+static void seal_stale(uint32_t seq) {
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  FILE *f = fopen(path, "r+b");
+  if (!f) return;
+  sdseg_hdr_t hdr;
+  if (!read_hdr_fp(f, &hdr)) {
+    fclose(f);
+    ESP_LOGW(TAG, "sdseg: %s without valid header, removed", path);
+    remove(path);
+    return;
+  }
+  if (hdr.flags & SDSEG_FLAG_SEALED) {
+    fclose(f);
+    return;
+  }
+  if (!sdseg_readable(&hdr)) {
+    // Cifrado con otra clave: no se pueden validar sus frames ni escribir
+    // nada que se lea con la suya. Queda en cuarentena tal cual (sin sellar
+    // ni enviar) hasta que vuelva esa clave o lo quite la retención.
+    fclose(f);
+    ESP_LOGW(TAG, "sdseg: %08lX encrypted with another key (%08lX), left unsealed",
+             (unsigned long)seq, (unsigned long)hdr.key_id);
+    return;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+
+  if (sdseg_is_binary(&hdr)) {
+    // Binario: se descarta lo que quedó cortado por el reset
+    uint32_t lines, objs = hdr.objs;
+    bool open_line;
+    bool framed = sdseg_is_framed(&hdr);
+    bool prealloc = hdr.version >= 4;
+    // Cifrado: los frames se validan descifrados
+    FILE *rf = sdseg_is_enc(&hdr) ? open_data(path, &hdr) : NULL;
+    FILE *src = rf ? rf : f;
+    uint32_t good =
+        prealloc ? recover_from_sync(src, &hdr, (uint32_t)size, &lines, &objs, &open_line)
+        : framed ? recover_tail(src, &hdr, (uint32_t)size, &lines, &open_line)
+                 : scan_records(src, false, 0, &lines, &open_line);
+    if (rf) fclose(rf);
+    if ((long)good < size) {
+      fclose(f);
+      truncate(path, good);
+      if (prealloc)
+        ESP_LOGI(TAG, "sdseg: %08lX recovered %u bytes past last sync, trimmed %ld",
+                 (unsigned long)seq,
+                 (unsigned)(good - SDSEG_HDR_SIZE - hdr.data_len),
+                 size - (long)good);
+      else
+        ESP_LOGW(TAG, "sdseg: %08lX torn tail, dropped %ld bytes",
+                 (unsigned long)seq, size - (long)good);
+      f = fopen(path, "r+b");
+      if (!f) return;
+    }
+    fseek(f, 0, SEEK_END);
+    if (open_line) {
+      uint8_t eol[SDREC_FRAME_OVH + 1];
+      eol[SDREC_FRAME_HDR] = SDREC_EOL;
+      size_t n = framed ? sdrec_frame_seal(eol, 1, SDREC_FRAME_LINE_END,
+                                           sdseg_crc_seed(&hdr))
+                        : 1;
+      uint8_t *w = framed ? eol : eol + SDREC_FRAME_HDR;
+      if (sdseg_is_enc(&hdr)) sdenc_xor(hdr.iv, good, w, n);
+      fwrite(w, 1, n, f);
+      sdacct_physical(SDACCT_APPEND, good, n);
+      good += n;
+      lines++;
+    }
+    hdr.data_len = good - SDSEG_HDR_SIZE;
+    hdr.lines = lines;
+    hdr.objs = objs;
+    hdr.flags &= ~SDSEG_FLAG_MIDLINE;
+  } else {
+    hdr.data_len = (size > SDSEG_HDR_SIZE) ? (uint32_t)(size - SDSEG_HDR_SIZE) : 0;
+    if (hdr.data_len > 0) {
+      fseek(f, size - 1, SEEK_SET);
+      int last = fgetc(f);
+      fseek(f, 0, SEEK_END);
+      if (last != '\n') {
+        fputc('\n', f);
+        sdacct_physical(SDACCT_APPEND, (uint32_t)size, 1);
+        hdr.data_len++;
+        hdr.lines++;
+      }
+    }
+  }
+  hdr.flags |= SDSEG_FLAG_SEALED;
+  write_hdr(f, &hdr);
+  sdacct_physical(SDACCT_APPEND, 0, sizeof(hdr));
+  fflush(f);
+  sdacct_fsync(fileno(f));
+  fclose(f);
+
+  // El índice quedó sin terminador: se reconstruye cuando haga falta
+  char idx[SDSEG_PATH_MAX];
+  sdseg_idx_path(seq, idx, sizeof(idx));
+  remove(idx);
+  ESP_LOGI(TAG, "sdseg: sealed stale segment %08lX (%u bytes)",
+           (unsigned long)seq, (unsigned)hdr.data_len);
+}
+
+// "0000002A.TMZ": compresión a medias o sin renombrar
+static bool parse_tmz(const char *name, uint32_t *seq) {
+  if (strlen(name) != 12 || strcasecmp(name + 9, "TMZ") != 0) return false;
+  char tmp[13];
+  memcpy(tmp, name, 9);
+  memcpy(tmp + 9, "SEG", 4);
+  return parse_seq(tmp, seq);
+}
+
+// El .TMZ solo se renombra completo y con fsync: si el .SEG ya no está
+// (corte entre remove y rename) es la única copia; si no, se descarta.
+static void finish_tmz(uint32_t seq) {
+  char path[SDSEG_PATH_MAX], tmp[SDSEG_PATH_MAX];
+  seg_file(seq, "TMX", tmp, sizeof(tmp)); // índice que no llegó a renombrarse
+  remove(tmp);
+  sdseg_path(seq, path, sizeof(path));
+  seg_file(seq, "TMZ", tmp, sizeof(tmp));
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    remove(tmp);
+  } else if (rename(tmp, path) == 0) {
+    ESP_LOGI(TAG, "sdseg: finished compression of %08lX", (unsigned long)seq);
+  }
+}
+
+/* ================= Particiones y manifiesto ================= */
+
+// Copia en RAM de MANIFEST.TXT, ascendente por día; protegida por el mutex
+static sdseg_part_t s_parts[SDSEG_PARTS_MAX];
+static size_t s_nparts = 0;
+static const char s_state_ch[] = "PUS"; // pending / partial / sent
+
+typedef enum { PART_SEALED, PART_CONSUMED, PART_CHANGED } part_event_t;
+
+// Entrada del día, creada en su sitio si no está. Con el manifiesto lleno
+// se recicla la partición vacía más antigua.
+static sdseg_part_t *part_get(uint32_t day, bool create) {
+  size_t i = 0;
+  while (i < s_nparts && s_parts[i].day < day) i++;
+  if (i < s_nparts && s_parts[i].day == day) return &s_parts[i];
+  if (!create) return NULL;
+  if (s_nparts == SDSEG_PARTS_MAX) {
+    size_t j = 0;
+    while (j < s_nparts && s_parts[j].segments) j++;
+    if (j == s_nparts) {
+      ESP_LOGE(TAG, "sdseg: manifest full, day %u not tracked", (unsigned)day);
+      return NULL;
+    }
+    memmove(&s_parts[j], &s_parts[j + 1], (s_nparts - j - 1) * sizeof(s_parts[0]));
+    s_nparts--;
+    if (j < i) i--;
+  }
+  memmove(&s_parts[i + 1], &s_parts[i], (s_nparts - i) * sizeof(s_parts[0]));
+  s_nparts++;
+  memset(&s_parts[i], 0, sizeof(s_parts[0]));
+  s_parts[i].day = day;
+  return &s_parts[i];
+}
+
+static void part_drop(sdseg_part_t *p) {
+  size_t i = p - s_parts;
+  memmove(&s_parts[i], &s_parts[i + 1], (s_nparts - i - 1) * sizeof(s_parts[0]));
+  s_nparts--;
+}
+
+// Recalcula la partición con las cabeceras de su carpeta (un segmento por
+// hora: pocas lecturas). El activo no cuenta hasta sellarse.
+static void part_rescan(sdseg_part_t *p) {
+  char dir[SDSEG_DIR_MAX];
+  sdseg_part_dir(p->day, dir, sizeof(dir));
+  p->segments = p->lines = p->events = p->bytes = p->first_t = p->last_t = 0;
+  DIR *d = opendir(dir);
+  if (!d) return;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    uint32_t seq;
+    sdseg_hdr_t hdr;
+    if (!parse_seq(e->d_name, &seq) || seq == s_active_seq ||
+        !sdseg_read_hdr(seq, &hdr))
+      continue;
+    p->segments++;
+    p->lines += sdseg_live_lines(&hdr);
+    p->events += sdseg_live_objs(&hdr);
+    p->bytes += SDSEG_HDR_SIZE + hdr.data_len;
+    if (hdr.first_t && (!p->first_t || hdr.first_t < p->first_t)) p->first_t = hdr.first_t;
+    if (hdr.last_t > p->last_t) p->last_t = hdr.last_t;
+  }
+  closedir(d);
+}
+
+// Totales del backlog: se rehacen con cada cambio del manifiesto (como mucho
+// SDSEG_PARTS_MAX entradas) para que sdseg_backlog() no recorra nada
+static sdseg_backlog_t s_total;
+
+static void totals_refresh(void) {
+  sdseg_backlog_t t = {};
+  for (size_t i = 0; i < s_nparts; i++) {
+    const sdseg_part_t *p = &s_parts[i];
+    t.segments += p->segments;
+    t.lines += p->lines;
+    t.events += p->events;
+    t.bytes += p->bytes;
+    if (p->first_t && (!t.first_t || p->first_t < t.first_t)) t.first_t = p->first_t;
+    if (p->last_t > t.last_t) t.last_t = p->last_t;
+  }
+  portENTER_CRITICAL(&s_pub_mux);
+  s_total = t;
+  portEXIT_CRITICAL(&s_pub_mux);
+}
+
+// Se reescribe entero (.TMP + rename): un corte deja el anterior o el nuevo
+static void manifest_save(void) {
+  totals_refresh();
+  char tmp[SDSEG_PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s/MANIFEST.TMP", s_root);
+  FILE *f = fopen(tmp, "w");
+  if (!f) return;
+  fprintf(f, "# dia segs lineas eventos bytes first_t last_t estado\n");
+  for (size_t i = 0; i < s_nparts; i++) {
+    const sdseg_part_t *p = &s_parts[i];
+    unsigned y, m, d;
+    civil_from_days(p->day, &y, &m, &d);
+    fprintf(f, "%04u%02u%02u %u %u %u %u %lu %lu %c\n", y, m, d,
+            (unsigned)p->segments, (unsigned)p->lines, (unsigned)p->events,
+            (unsigned)p->bytes,
+            (unsigned long)p->first_t, (unsigned long)p->last_t,
+            s_state_ch[p->state]);
+  }
+  bool ok = fflush(f) == 0 && sdacct_fsync(fileno(f)) == 0;
+  sdacct_write(SDACCT_CURSOR, 0, (size_t)ftell(f));
+  fclose(f);
+  if (ok) {
+    remove(s_manifest);
+    ok = rename(tmp, s_manifest) == 0;
+  }
+  if (!ok) {
+    remove(tmp);
+    ESP_LOGW(TAG, "sdseg: can't write %s", s_manifest);
+  }
+}
+
+// Solo el estado de envío es imprescindible: los contadores se rehacen en
+// sdseg_init con las cabeceras
+static void manifest_load(void) {
+  s_nparts = 0;
+  FILE *f = fopen(s_manifest, "r");
+  if (!f) return;
+  char line[96];
+  while (fgets(line, sizeof(line), f)) {
+    char name[9], st;
+    unsigned segs, lines, events = 0, bytes;
+    unsigned long first_t, last_t;
+    uint32_t day;
+    // Manifiestos anteriores no tienen la columna de eventos
+    if (sscanf(line, "%8s %u %u %u %u %lu %lu %c", name, &segs, &lines, &events,
+               &bytes, &first_t, &last_t, &st) != 8) {
+      events = 0;
+      if (sscanf(line, "%8s %u %u %u %lu %lu %c", name, &segs, &lines, &bytes,
+                 &first_t, &last_t, &st) != 7)
+        continue;
+    }
+    if (!parse_day(name, &day)) continue;
+    const char *k = strchr(s_state_ch, st);
+    sdseg_part_t *p = part_get(day, true);
+    if (!p || !k) continue;
+    p->segments = segs;
+    p->lines = lines;
+    p->events = events;
+    p->bytes = bytes;
+    p->first_t = (uint32_t)first_t;
+    p->last_t = (uint32_t)last_t;
+    p->state = (uint8_t)(k - s_state_ch);
+  }
+  fclose(f);
+}
+
+// Actualiza la partición de 'seq' tras un cambio en sus segmentos
+static void part_update(uint32_t seq, part_event_t ev) {
+  seg_lock();
+  sdseg_part_t *p = part_get(sdseg_seq_day(seq), true);
+  if (p) {
+    uint8_t was = p->state;
+    part_rescan(p);
+    if (ev == PART_SEALED && p->state == SDSEG_PART_SENT)
+      p->state = SDSEG_PART_PARTIAL;
+    else if (ev == PART_CONSUMED)
+      p->state = p->segments ? SDSEG_PART_PARTIAL : SDSEG_PART_SENT;
+    if (p->state == SDSEG_PART_SENT && was != SDSEG_PART_SENT) {
+      char dir[SDSEG_DIR_MAX];
+      sdseg_part_dir(p->day, dir, sizeof(dir));
+      ESP_LOGI(TAG, "sdseg: partition %s sent", dir);
+    }
+    manifest_save();
+  }
+  seg_unlock();
+}
+
+void sdseg_backlog(sdseg_backlog_t *out) {
+  portENTER_CRITICAL(&s_pub_mux);
+  *out = s_total;
+  if (s_pub_seq) { // el activo, hasta su último fsync y sin lo ya enviado
+    out->lines += sdseg_live_lines(&s_pub_hdr);
+    out->events += sdseg_live_objs(&s_pub_hdr);
+    out->bytes += SDSEG_HDR_SIZE + s_pub_hdr.data_len;
+    if (s_pub_hdr.first_t && (!out->first_t || s_pub_hdr.first_t < out->first_t))
+      out->first_t = s_pub_hdr.first_t;
+    if (s_pub_hdr.last_t > out->last_t) out->last_t = s_pub_hdr.last_t;
+  }
+  portEXIT_CRITICAL(&s_pub_mux);
+}
+
+size_t sdseg_parts(sdseg_part_t *out, size_t max) {
+  seg_lock();
+  size_t n = s_nparts < max ? s_nparts : max;
+  memcpy(out, s_parts, n * sizeof(s_parts[0]));
+  seg_unlock();
+  return n;
+}
+
+// Segmentos de la raíz de antes de las particiones: cada uno a la carpeta
+// de su número (los antiguos caen en 19700101). Índices y temporales se
+// descartan; se rehacen cuando hacen falta.
+static void migrate_flat(void) {
+  DIR *d = opendir(s_root);
+  if (!d) return;
+  struct dirent *e;
+  char from[SDSEG_PATH_MAX], to[SDSEG_PATH_MAX], dir[SDSEG_DIR_MAX];
+  size_t moved = 0;
+  while ((e = readdir(d)) != NULL) {
+    const char *name = e->d_name;
+    if (strlen(name) != 12 || name[8] != '.') continue;
+    snprintf(from, sizeof(from), "%s/%.12s", s_root, name);
+    uint32_t seq;
+    if (parse_seq(name, &seq) || parse_tmz(name, &seq)) {
+      sdseg_part_dir(sdseg_seq_day(seq), dir, sizeof(dir));
+      struct stat st;
+      if (stat(dir, &st) != 0) mkdir(dir, 0777);
+      snprintf(to, sizeof(to), "%s/%.12s", dir, name);
+      if (rename(from, to) == 0) moved++;
+    } else if (!strcasecmp(name + 9, "IDX") || !strcasecmp(name + 9, "TMP")) {
+      remove(from);
+    }
+  }
+  closedir(d);
+  if (moved) ESP_LOGI(TAG, "sdseg: moved %u segment(s) into day folders", (unsigned)moved);
+}
+
+// Sella lo que quedó abierto en una carpeta de día y devuelve el mayor seq
+static uint32_t recover_day(uint32_t day) {
+  char dir[SDSEG_DIR_MAX];
+  sdseg_part_dir(day, dir, sizeof(dir));
+  uint32_t max_seq = 0;
+  DIR *d = opendir(dir);
+  if (!d) return 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    uint32_t seq;
+    if (parse_tmz(e->d_name, &seq)) {
+      finish_tmz(seq);
+    } else if (parse_seq(e->d_name, &seq)) {
+      seal_stale(seq);
+    } else {
+      continue;
+    }
+    if (seq > max_seq) max_seq = seq;
+  }
+  closedir(d);
+  return max_seq;
+}
+
+bool sdseg_init(const char *mount_point) {
+  int r = snprintf(s_root, sizeof(s_root), "%s/%s", mount_point, SDSEG_DIR);
+  if (r < 0 || (size_t)r >= sizeof(s_root)) {
+    ESP_LOGE(TAG, "sdseg: mount point too long: %s", mount_point);
+    s_root[0] = '\0';
+    return false;
+  }
+  snprintf(s_manifest, sizeof(s_manifest), "%s/MANIFEST.TXT", s_root);
+  if (!s_seg_mutex) s_seg_mutex = xSemaphoreCreateMutex();
+
+  struct stat st;
+  if (stat(s_root, &st) != 0 && mkdir(s_root, 0777) != 0) {
+    ESP_LOGE(TAG, "sdseg: can't create %s", s_root);
+    return false;
+  }
+
+  if (sdenc_init())
+    ESP_LOGI(TAG, "sdseg: new segments encrypted (key %08lX)",
+             (unsigned long)sdenc_key_id());
+
+  seg_lock();
+  manifest_load();
+  migrate_flat();
+  uint32_t max_seq = 0;
+  DIR *d = opendir(s_root);
+  if (!d) {
+    seg_unlock();
+    return false;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    uint32_t day;
+    if (!parse_day(e->d_name, &day)) continue;
+    uint32_t seq = recover_day(day);
+    if (seq > max_seq) max_seq = seq;
+    part_get(day, true);
+  }
+  closedir(d);
+
+  // Contadores desde las cabeceras; se olvidan los días sin nada pendiente
+  for (size_t i = 0; i < s_nparts;) {
+    part_rescan(&s_parts[i]);
+    if (s_parts[i].segments == 0) {
+      char dir[SDSEG_DIR_MAX];
+      sdseg_part_dir(s_parts[i].day, dir, sizeof(dir));
+      rmdir(dir);
+      if (s_parts[i].state != SDSEG_PART_SENT) {
+        part_drop(&s_parts[i]);
+        continue;
+      }
+    }
+    i++;
+  }
+  manifest_save();
+  seg_unlock();
+
+  s_next_seq = max_seq + 1;
+  ESP_LOGI(TAG, "sdseg: %s ready, %u partition(s), next segment %08lX", s_root,
+           (unsigned)s_nparts, (unsigned long)s_next_seq);
+  return true;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Días con segmentos sellados según el manifiesto
+static size_t part_days(uint32_t *days, size_t max) {
+  size_t n = 0;
+  seg_lock();
+  for (size_t i = 0; i < s_nparts && n < max; i++)
+    if (s_parts[i].segments) days[n++] = s_parts[i].day;
+  seg_unlock();
+  return n;
+}
+
+static size_t list_day(uint32_t day, uint32_t *seqs, size_t max) {
+  char dir[SDSEG_DIR_MAX];
+  sdseg_part_dir(day, dir, sizeof(dir));
+  size_t n = 0;
+  DIR *d = opendir(dir);
+  if (!d) return 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL && n < max) {
+    uint32_t seq;
+    if (!parse_seq(e->d_name, &seq) || seq == s_active_seq) continue;
+    seqs[n++] = seq;
+  }
+  closedir(d);
+  qsort(seqs, n, sizeof(uint32_t), cmp_seq);
+  return n;
+}
+
+// El seq crece con el día: basta concatenar las carpetas en orden
+size_t sdseg_list(uint32_t *seqs, size_t max) {
+  uint32_t days[SDSEG_PARTS_MAX];
+  size_t nd = part_days(days, SDSEG_PARTS_MAX), n = 0;
+  for (size_t i = 0; i < nd && n < max; i++) n += list_day(days[i], seqs + n, max - n);
+  return n;
+}
+
+bool sdseg_remove(uint32_t seq) {
+  if (seq == s_active_seq) return false;
+  char path[SDSEG_PATH_MAX], idx[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  sdseg_idx_path(seq, idx, sizeof(idx));
+  seg_lock();
+  bool ok = (remove(path) == 0);
+  remove(idx);
+  seg_unlock();
+  if (ok) part_update(seq, PART_CONSUMED);
+  return ok;
+}
+
+/* ================= Segmento activo (tarea writer) ================= */
+
+static inline uint32_t now_ms(void) {
+  return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
+
+// Reserva clusters hasta 'need' (redondeado a SDSEG_PREALLOC_BYTES)
+// escribiendo el último byte: FAT asigna la cadena entera de una vez y los
+// commits siguientes ya no tocan la FAT. f_expand no es accesible desde un fd
+// de la VFS, así que se extiende con lseek + write.
+static void extend_active(uint32_t need) {
+  if (need <= s_alloc_end) return;
+  uint32_t end = (need + SDSEG_PREALLOC_BYTES - 1) / SDSEG_PREALLOC_BYTES *
+                 SDSEG_PREALLOC_BYTES;
+  const uint8_t z = 0;
+  if (lseek(s_active, (off_t)(end - 1), SEEK_SET) != (off_t)(end - 1) ||
+      write(s_active, &z, 1) != 1) {
+    // Sin espacio para la extensión: se sigue creciendo con cada write()
+    ESP_LOGW(TAG, "sdseg: can't preallocate %u bytes", (unsigned)end);
+    s_alloc_end = need;
+    return;
+  }
+  sdacct_physical(SDACCT_APPEND, end - 1, 1);
+  s_alloc_end = end;
+}
+
+// Escribe lo pendiente de s_wbuf en un solo write() alineado a sector
+static bool commit_wbuf(void) {
+  if (s_active < 0 || s_wlen == s_wcommitted) return true;
+  extend_active(s_wbuf_off + (uint32_t)s_wlen);
+  // Cifrado: se cifra en el sitio para el write() y luego se vuelve a dejar
+  // en claro solo lo que se queda en el buffer (la cabecera nunca se cifra)
+  size_t whole = s_wlen & ~(size_t)(SDSEG_SECTOR - 1);
+  size_t plain = (s_wbuf_off < SDSEG_HDR_SIZE) ? SDSEG_HDR_SIZE - s_wbuf_off : 0;
+  bool enc = sdseg_is_enc(&s_hdr) && s_wlen > plain;
+  if (enc) sdenc_xor(s_hdr.iv, s_wbuf_off + plain, s_wbuf + plain, s_wlen - plain);
+  bool ok = lseek(s_active, (off_t)s_wbuf_off, SEEK_SET) == (off_t)s_wbuf_off &&
+            write(s_active, s_wbuf, s_wlen) == (ssize_t)s_wlen;
+  if (enc) {
+    size_t from = ok ? whole : 0;
+    if (from < plain) from = plain;
+    if (s_wlen > from) sdenc_xor(s_hdr.iv, s_wbuf_off + from, s_wbuf + from, s_wlen - from);
+  }
+  if (!ok) {
+    sdacct_error();
+    ESP_LOGE(TAG, "sdseg: commit of %u bytes failed", (unsigned)s_wlen);
+    return false;
+  }
+  sdacct_physical(SDACCT_APPEND, s_wbuf_off, s_wlen);
+  s_cstats.commits++;
+  s_cstats.bytes += s_wlen - s_wcommitted;
+  s_cstats.phys_bytes += s_wlen;
+  s_unsynced = true;
+
+  // Conserva el sector incompleto para reescribirlo en el siguiente commit
+  if (whole > 0) {
+    memmove(s_wbuf, s_wbuf + whole, s_wlen - whole);
+    s_wbuf_off += whole;
+    s_wlen -= whole;
+  }
+  s_wcommitted = s_wlen;
+  return true;
+}
+
+static bool wbuf_put(const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  bool ok = true;
+  while (len > 0) {
+    size_t n = sizeof(s_wbuf) - s_wlen;
+    if (n > len) n = len;
+    memcpy(s_wbuf + s_wlen, p, n);
+    s_wlen += n;
+    p += n;
+    len -= n;
+    s_hdr.data_len += (uint32_t)n;
+    if (s_wlen == sizeof(s_wbuf)) ok = commit_wbuf() && ok;
+  }
+  s_hdr_dirty = true;
+  return ok;
+}
+
+// Cierra el frame abierto (CRC) y lo pasa al buffer de escritura
+static bool close_frame(bool line_end) {
+  if (s_flen == 0) return true;
+  uint16_t fl = (s_fline_start ? SDREC_FRAME_LINE_START : 0) |
+                (line_end ? SDREC_FRAME_LINE_END : 0);
+  size_t n = sdrec_frame_seal(s_frame, s_flen, fl, s_hdr.salt);
+  s_flen = 0;
+  s_fline_start = line_end;
+  return wbuf_put(s_frame, n);
+}
+
+static bool write_hdr_active(void) {
+  // Si el sector 0 sigue en el buffer, se mantiene coherente con la cabecera
+  if (s_wbuf_off == 0 && s_wlen >= sizeof(s_hdr))
+    memcpy(s_wbuf, &s_hdr, sizeof(s_hdr));
+  bool ok = lseek(s_active, 0, SEEK_SET) == 0 &&
+            write(s_active, &s_hdr, sizeof(s_hdr)) == (ssize_t)sizeof(s_hdr);
+  if (ok) sdacct_physical(SDACCT_APPEND, 0, sizeof(s_hdr));
+  else sdacct_error();
+  s_hdr_dirty = !ok;
+  return ok;
+}
+
+static void publish_end(uint32_t seq, uint32_t end) {
+  portENTER_CRITICAL(&s_pub_mux);
+  s_pub_seq = seq;
+  s_pub_end = end;
+  s_pub_hdr = s_hdr;
+  portEXIT_CRITICAL(&s_pub_mux);
+}
+
+// Commit + cabecera + fsync: a partir de aquí los datos sobreviven a un corte
+static bool sync_active(void) {
+  if (s_active < 0) return false;
+  bool ok = close_frame(false);
+  ok = commit_wbuf() && ok;
+  // Si se corta aquí, la recuperación sabe si el siguiente frame sigue una
+  // línea empezada antes del sync
+  uint32_t fl = s_fline_start ? (s_hdr.flags & ~SDSEG_FLAG_MIDLINE)
+                              : (s_hdr.flags | SDSEG_FLAG_MIDLINE);
+  if (fl != s_hdr.flags) {
+    s_hdr.flags = fl;
+    s_hdr_dirty = true;
+  }
+  if (s_hdr_dirty) ok = write_hdr_active() && ok;
+  if (s_unsynced) {
+    ok = (sdacct_fsync(s_active) == 0) && ok;
+    s_cstats.syncs++;
+    s_unsynced = false;
+  }
+  s_dirty_since = 0;
+  if (ok) publish_end(s_hdr.seq, s_line_end);
+  return ok;
+}
+
+bool sdseg_open_active(void) {
+  if (s_active >= 0) return true;
+
+  // Primer número del día actual si ya hay hora; si no, sigue la serie
+  uint32_t seq = s_next_seq;
+  uint32_t now = (uint32_t)time(NULL);
+  if (now >= SDSEG_MIN_VALID_T) {
+    uint32_t first = ((now / 86400UL) << SDSEG_DAY_SHIFT) | 1;
+    if (first > seq) seq = first;
+  }
+  char path[SDSEG_PATH_MAX];
+  sdseg_part_dir(sdseg_seq_day(seq), path, sizeof(path));
+  struct stat st;
+  if (stat(path, &st) != 0 && mkdir(path, 0777) != 0) {
+    ESP_LOGE(TAG, "sdseg: can't create %s", path);
+    return false;
+  }
+  sdseg_path(seq, path, sizeof(path));
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    ESP_LOGE(TAG, "sdseg: can't create %s", path);
+    return false;
+  }
+
+  memset(&s_hdr, 0, sizeof(s_hdr));
+  s_hdr.magic = SDSEG_MAGIC;
+  s_hdr.version = SDSEG_VERSION;
+  s_hdr.hdr_size = SDSEG_HDR_SIZE;
+  s_hdr.seq = seq;
+  s_hdr.salt = esp_random();
+  hdr_set_enc(&s_hdr);
+  if (write(fd, &s_hdr, sizeof(s_hdr)) != (ssize_t)sizeof(s_hdr)) {
+    sdacct_error();
+    close(fd);
+    remove(path);
+    return false;
+  }
+  sdacct_physical(SDACCT_APPEND, 0, sizeof(s_hdr));
+
+  // El primer sector (cabecera + datos) se reescribe desde el buffer
+  memcpy(s_wbuf, &s_hdr, sizeof(s_hdr));
+  s_wbuf_off = 0;
+  s_wlen = s_wcommitted = sizeof(s_hdr);
+  s_flen = 0;
+  s_fline_start = true;
+  s_unsynced = false;
+  s_dirty_since = 0;
+  s_line_end = SDSEG_HDR_SIZE;
+  publish_end(seq, SDSEG_HDR_SIZE);
+
+  s_next_seq = seq + 1;
+  s_active = fd;
+  s_alloc_end = sizeof(s_hdr);
+  extend_active(SDSEG_PREALLOC_BYTES);
+  s_active_seq = seq;
+  s_hdr_dirty = false;
+  s_bucket = bucket_of(time(NULL));
+
+  char idx[SDSEG_PATH_MAX];
+  sdseg_idx_path(seq, idx, sizeof(idx));
+  if (sdtidx_writer_open(&s_tidx, idx)) sdtidx_line_start(&s_tidx, SDSEG_HDR_SIZE);
+  ESP_LOGI(TAG, "sdseg: opened segment %08lX", (unsigned long)seq);
+  return true;
+}
+
+bool sdseg_stable_end(uint32_t *seq, uint32_t *end) {
+  portENTER_CRITICAL(&s_pub_mux);
+  *seq = s_pub_seq;
+  *end = s_pub_end;
+  portEXIT_CRITICAL(&s_pub_mux);
+  return *seq != 0;
+}
+
+bool sdseg_active_pos(uint32_t *seq, uint32_t *off) {
+  if (s_active < 0) return false;
+  *seq = s_hdr.seq;
+  *off = SDSEG_HDR_SIZE + s_hdr.data_len;
+  return true;
+}
+
+// Añade un registro completo al frame abierto
+bool sdseg_append(const char *data, size_t len) {
+  if (s_active < 0 && !sdseg_open_active()) return false;
+  if (len > SDREC_REC_MAX) return false;
+  bool ok = true;
+  if (s_flen > 0 && s_flen + len > SDREC_FRAME_TARGET) ok = close_frame(false);
+  memcpy(s_frame + SDREC_FRAME_HDR + s_flen, data, len);
+  s_flen += len;
+  sdacct_logical(SDACCT_APPEND, len);
+  if (s_dirty_since == 0) s_dirty_since = now_ms() | 1;
+  return ok;
+}
+
+void sdseg_note_ts(uint32_t t) {
+  if (s_active < 0 || t < SDSEG_MIN_VALID_T) return;
+  if (s_hdr.first_t == 0 || t < s_hdr.first_t) s_hdr.first_t = t;
+  if (t > s_hdr.last_t) s_hdr.last_t = t;
+  s_hdr_dirty = true;
+  sdtidx_note_ts(&s_tidx, t);
+}
+
+void sdseg_note_obj(uint32_t t, uint32_t events) {
+  if (s_active < 0) return;
+  s_hdr.objs += events;
+  s_hdr_dirty = true;
+  sdseg_note_ts(t);
+}
+
+void sdseg_end_line(void) {
+  const char eol = SDREC_EOL;
+  if (!sdseg_append(&eol, 1)) return;
+  close_frame(true); // el fin de línea siempre cierra el frame
+  s_hdr.lines++;
+  s_line_end = SDSEG_HDR_SIZE + s_hdr.data_len;
+  sdtidx_line_start(&s_tidx, SDSEG_HDR_SIZE + s_hdr.data_len);
+}
+
+void sdseg_flush_active(bool sync) {
+  if (s_active < 0) return;
+  if (sync) sync_active();
+  else if (close_frame(false)) commit_wbuf();
+}
+
+/* ---- Política de durabilidad ---- */
+
+void sdseg_set_durability(sdseg_durability_t d, uint32_t interval_ms) {
+  s_durability = d;
+  if (interval_ms) s_interval_ms = interval_ms;
+}
+
+void sdseg_commit_point(bool line_end) {
+  if (s_active < 0) return;
+  switch (s_durability) {
+  case SDSEG_DUR_RECORD:
+    sync_active();
+    break;
+  case SDSEG_DUR_LINE:
+    if (line_end) sync_active();
+    break;
+  case SDSEG_DUR_INTERVAL:
+    sdseg_commit_tick();
+    break;
+  case SDSEG_DUR_SEAL:
+    break; // solo buffer lleno y sellado
+  }
+}
+
+uint32_t sdseg_commit_due_ms(void) {
+  if (s_active < 0 || s_durability != SDSEG_DUR_INTERVAL || s_dirty_since == 0)
+    return UINT32_MAX;
+  uint32_t age = now_ms() - s_dirty_since;
+  return (age >= s_interval_ms) ? 0 : s_interval_ms - age;
+}
+
+void sdseg_commit_tick(void) {
+  if (sdseg_commit_due_ms() == 0) sync_active();
+}
+
+void sdseg_get_commit_stats(sdseg_commit_stats_t *out) { *out = s_cstats; }
+
+// Solo se rota en frontera de línea: la decide la writer tras cerrar una línea
+bool sdseg_should_rotate(time_t now) {
+  if (s_active < 0) return false;
+  if (s_hdr.data_len >= SDSEG_MAX_BYTES) return true;
+  uint32_t b = bucket_of(now);
+  // Un segmento nunca cruza de día: cada partición es un día UTC
+  bool new_day = b && sdseg_seq_day(s_hdr.seq) < (uint32_t)now / 86400UL;
+  if (b == s_bucket && !new_day) return false;
+  if (s_hdr.data_len == 0 && !new_day) { // vacío: basta con moverlo de franja
+    s_bucket = b;
+    return false;
+  }
+  return true;
+}
+
+bool sdseg_seal_active(void) {
+  if (s_active < 0) return false;
+  close_frame(false);
+
+  uint32_t seq = s_hdr.seq;
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+
+  publish_end(0, 0); // los lectores pasan a tratarlo como sellado
+  // Vacío o ya enviado entero desde el activo: nada que conservar
+  bool consumed = s_hdr.data_len && sdseg_data_start(&s_hdr) >= SDSEG_HDR_SIZE + s_hdr.data_len;
+  if (s_hdr.data_len == 0 || consumed) {
+    close(s_active);
+    s_active = -1;
+    s_active_seq = 0;
+    remove(path);
+    sdtidx_writer_abort(&s_tidx);
+    sdseg_idx_path(seq, path, sizeof(path));
+    remove(path);
+    if (consumed) part_update(seq, PART_CONSUMED);
+    return true;
+  }
+
+  // Primero se recorta la parte preasignada sin usar y después se marca
+  // sellado: un corte entre medias lo resuelve seal_stale
+  uint32_t data_end = SDSEG_HDR_SIZE + s_hdr.data_len;
+  sync_active();
+  publish_end(0, 0); // el sync lo volvía a publicar como activo
+  sdtidx_writer_close(&s_tidx, data_end);
+  close(s_active);
+  s_active = -1;
+  bool ok = truncate(path, data_end) == 0;
+  int fd = ok ? open(path, O_WRONLY) : -1;
+  s_hdr.flags |= SDSEG_FLAG_SEALED;
+  ok = fd >= 0 && lseek(fd, 0, SEEK_SET) == 0 &&
+       write(fd, &s_hdr, sizeof(s_hdr)) == (ssize_t)sizeof(s_hdr) &&
+       sdacct_fsync(fd) == 0;
+  if (fd >= 0) close(fd);
+  if (ok) sdacct_physical(SDACCT_APPEND, 0, sizeof(s_hdr));
+  else sdacct_error();
+  s_active_seq = 0;
+  if (!ok) // queda sin sellar; seal_stale lo cierra en el próximo arranque
+    ESP_LOGE(TAG, "sdseg: can't trim/seal %08lX", (unsigned long)seq);
+  ESP_LOGI(TAG, "sdseg: sealed %08lX lines=%u bytes=%u t=[%lu..%lu] trimmed=%u",
+           (unsigned long)seq, (unsigned)s_hdr.lines,
+           (unsigned)s_hdr.data_len, (unsigned long)s_hdr.first_t,
+           (unsigned long)s_hdr.last_t,
+           (unsigned)(s_alloc_end > data_end ? s_alloc_end - data_end : 0));
+  if (s_cstats.commits)
+    ESP_LOGI(TAG, "sdseg: %u commits, %u B/commit, %u fsyncs",
+             (unsigned)s_cstats.commits,
+             (unsigned)(s_cstats.bytes / s_cstats.commits),
+             (unsigned)s_cstats.syncs);
+  part_update(seq, PART_SEALED);
+  return true;
+}
+
+/* ================= Retención ================= */
+
+// Borra la carpeta de un día entera. Se llama con el mutex tomado.
+static size_t remove_part_dir(uint32_t day) {
+  char dir[SDSEG_DIR_MAX], path[SDSEG_PATH_MAX];
+  sdseg_part_dir(day, dir, sizeof(dir));
+  size_t removed = 0;
+  DIR *d = opendir(dir);
+  if (!d) return 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    // Lo nuestro es 8.3; un nombre más largo no cabe y no se toca
+    if (e->d_name[0] == '.' || strlen(e->d_name) > 12) continue;
+    int r = snprintf(path, sizeof(path), "%s/%.12s", dir, e->d_name);
+    if (r < 0 || (size_t)r >= sizeof(path)) continue;
+    uint32_t seq;
+    if (remove(path) == 0 && parse_seq(e->d_name, &seq)) removed++;
+  }
+  closedir(d);
+  rmdir(dir);
+  return removed;
+}
+
+static bool index_seek(uint32_t seq, uint32_t t, uint32_t *off);
+static bool drop_head(uint32_t seq, uint32_t stop, size_t *dropped, bool *changed);
+
+// Segmento que cruza 'cutoff': se consume la cabeza hasta la primera línea
+// que puede tener "t" >= cutoff, buscada en el índice .IDX
+static void purge_head(uint32_t seq, const sdseg_hdr_t *hdr, time_t cutoff) {
+  uint32_t off;
+  size_t dropped;
+  bool changed;
+  if (seq == s_pinned_seq || !(hdr->flags & SDSEG_FLAG_SEALED) ||
+      !index_seek(seq, (uint32_t)cutoff, &off) || off <= sdseg_data_start(hdr))
+    return;
+  if (drop_head(seq, off, &dropped, &changed) && dropped)
+    ESP_LOGI(TAG, "sdseg: purged %u line(s) from the head of %08lX",
+             (unsigned)dropped, (unsigned long)seq);
+}
+
+// Borra los segmentos sellados cuyo último "t" es anterior a 'cutoff'. Los
+// días enteramente anteriores se quitan con su carpeta sin abrir cabeceras;
+// solo el que cruza 'cutoff' se mira segmento a segmento. Los segmentos
+// sin hora real no se purgan por edad.
+size_t sdseg_purge_older_than(time_t cutoff) {
+  uint32_t active_day = s_active_seq ? sdseg_seq_day(s_active_seq) : UINT32_MAX;
+  size_t removed = 0;
+  bool changed = false;
+  seg_lock();
+  for (size_t i = 0; i < s_nparts;) {
+    sdseg_part_t *p = &s_parts[i];
+    if (p->segments == 0) {
+      // Entrada de un día ya enviado: se olvida al salir de la retención
+      if ((time_t)((p->day + 1) * 86400UL) <= cutoff) {
+        char dir[SDSEG_DIR_MAX];
+        sdseg_part_dir(p->day, dir, sizeof(dir));
+        rmdir(dir);
+        part_drop(p);
+        changed = true;
+        continue;
+      }
+    } else if (p->last_t && (time_t)p->last_t < cutoff && p->day != active_day) {
+      removed += remove_part_dir(p->day);
+      part_drop(p);
+      changed = true;
+      continue;
+    } else if (p->first_t && (time_t)p->first_t < cutoff) {
+      uint32_t seqs[SDSEG_LIST_MAX];
+      size_t n = list_day(p->day, seqs, SDSEG_LIST_MAX);
+      for (size_t k = 0; k < n; k++) {
+        sdseg_hdr_t hdr;
+        if (!sdseg_read_hdr(seqs[k], &hdr) || hdr.last_t == 0) continue;
+        if ((time_t)hdr.last_t >= cutoff) {
+          if (hdr.first_t && (time_t)hdr.first_t < cutoff)
+            purge_head(seqs[k], &hdr, cutoff);
+          continue;
+        }
+        char path[SDSEG_PATH_MAX];
+        sdseg_path(seqs[k], path, sizeof(path));
+        if (remove(path) == 0) removed++;
+        sdseg_idx_path(seqs[k], path, sizeof(path));
+        remove(path);
+      }
+      part_rescan(p);
+      changed = true;
+    }
+    i++;
+  }
+  if (changed) manifest_save();
+  seg_unlock();
+  return removed;
+}
+
+// Salida a un fichero nuevo (.TMP/.TMZ): los datos se cifran con el nonce
+// de ese fichero según su offset
+typedef struct {
+  FILE *f;
+  const uint8_t *iv; // NULL = en claro
+  uint32_t off;
+} seg_out_t;
+
+static void out_init(seg_out_t *o, FILE *f, const sdseg_hdr_t *hdr) {
+  o->f = f;
+  o->iv = sdseg_is_enc(hdr) ? hdr->iv : NULL;
+  o->off = SDSEG_HDR_SIZE;
+}
+
+static bool out_seek(seg_out_t *o, uint32_t off) {
+  o->off = off;
+  return fseek(o->f, (long)off, SEEK_SET) == 0;
+}
+
+static bool out_write(seg_out_t *o, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint8_t tmp[512];
+  while (len > 0) {
+    size_t n = len;
+    const uint8_t *w = p;
+    if (o->iv) {
+      if (n > sizeof(tmp)) n = sizeof(tmp);
+      memcpy(tmp, p, n);
+      sdenc_xor(o->iv, o->off, tmp, n);
+      w = tmp;
+    }
+    if (fwrite(w, 1, n, o->f) != n) return false;
+    o->off += (uint32_t)n;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Quita las 'n' primeras líneas de un segmento sellado. Copia por bloques
+// solo lo que queda de ese segmento; el resto del backlog no se toca.
+// Reescribe el segmento sin lo anterior a 'keep_off' (.TMP + rename).
+// Se llama con el mutex tomado y 'fin' (descifrado) abierto; lo cierra.
+static bool rewrite_from(uint32_t seq, FILE *fin, sdseg_hdr_t *hdr,
+                         uint32_t keep_off) {
+  char path[SDSEG_PATH_MAX], tmppath[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  seg_file(seq, "TMP", tmppath, sizeof(tmppath));
+  FILE *fout = fopen(tmppath, "wb");
+  if (!fout) return false;
+
+  uint32_t skipped_bytes = keep_off - SDSEG_HDR_SIZE;
+  hdr->data_len = (hdr->data_len > skipped_bytes) ? hdr->data_len - skipped_bytes : 0;
+  hdr->lines = sdseg_live_lines(hdr);
+  hdr->objs = sdseg_live_objs(hdr);
+  hdr->head_off = 0;
+  hdr->head_lines = 0;
+  hdr->head_objs = 0;
+  hdr_set_enc(hdr); // los offsets cambian: nonce nuevo
+
+  seg_out_t out;
+  out_init(&out, fout, hdr);
+  uint8_t buf[512];
+  size_t r;
+  bool ok = fwrite(hdr, 1, sizeof(*hdr), fout) == sizeof(*hdr);
+  fseek(fin, (long)keep_off, SEEK_SET);
+  while (ok && (r = fread(buf, 1, sizeof(buf), fin)) > 0) {
+    ok = out_write(&out, buf, r);
+  }
+  ok = ok && fflush(fout) == 0 && sdacct_fsync(fileno(fout)) == 0;
+  sdacct_write(SDACCT_PURGE, 0, out.off);
+  if (!ok) sdacct_error();
+  fclose(fout);
+  fclose(fin);
+
+  if (ok) {
+    remove(path);
+    ok = (rename(tmppath, path) == 0);
+    sdseg_idx_path(seq, tmppath, sizeof(tmppath)); // offsets cambiados
+    remove(tmppath);
+  } else {
+    remove(tmppath);
+  }
+  return ok;
+}
+
+static uint32_t scan_lines(FILE *f, const sdseg_hdr_t *hdr, uint32_t start,
+                           uint32_t end, uint8_t *buf, size_t cap,
+                           size_t max_lines, size_t max_bytes, size_t *lines,
+                           size_t *objs);
+
+// Consume la cabeza hasta 'stop' (inicio de línea o de pack; desde el final
+// de los datos, el segmento entero aunque su cola no se pueda leer):
+// normalmente solo se reescribe la cabecera con la nueva cabeza; el fichero
+// se rehace al pasar de SDSEG_RECLAIM_PCT y se borra al quedarse vacío.
+// Con el mutex tomado; *dropped = líneas consumidas, *changed si se tocó.
+static bool drop_head(uint32_t seq, uint32_t stop, size_t *dropped_out,
+                      bool *changed) {
+  *dropped_out = 0;
+  *changed = false;
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+
+  FILE *f = fopen(path, "r+b");
+  if (!f) return true;
+  sdseg_hdr_t hdr;
+  // Se lee por 'rf' (descifrado si hace falta); 'f' es para la cabecera
+  FILE *rf = NULL;
+  if (read_hdr_fp(f, &hdr)) rf = sdseg_is_enc(&hdr) ? open_data(path, &hdr) : f;
+  if (!rf) {
+    fclose(f);
+    return false;
+  }
+
+  // Offset de la primera línea que se conserva
+  uint32_t end = SDSEG_HDR_SIZE + hdr.data_len;
+  uint32_t scan_end = (stop < end) ? stop : end;
+  uint32_t keep_off = sdseg_data_start(&hdr);
+  size_t dropped = 0, objs = 0;
+  if (sdseg_is_lz(&hdr)) {
+    // Comprimido: solo se quitan packs enteros
+    sdseg_pack_t pk;
+    while (keep_off < scan_end && sdseg_read_pack(rf, keep_off, &pk) &&
+           keep_off + sizeof(pk) + pk.comp_len <= scan_end) {
+      dropped += pk.lines;
+      objs += pk.objs;
+      keep_off += sizeof(pk) + pk.comp_len;
+    }
+  } else {
+    uint8_t *buf = (uint8_t *)malloc(SDSEG_SCAN_BUF);
+    if (buf && keep_off < scan_end)
+      keep_off = scan_lines(rf, &hdr, keep_off, scan_end, buf, SDSEG_SCAN_BUF,
+                            SIZE_MAX, SIZE_MAX, &dropped, &objs);
+    free(buf);
+    if (!buf) {
+      if (rf != f) fclose(rf);
+      fclose(f);
+      return false;
+    }
+  }
+  if (stop >= end) keep_off = end;
+  bool rewrite = dropped && keep_off < end &&
+                 (uint64_t)(keep_off - SDSEG_HDR_SIZE) * 100 >=
+                     (uint64_t)hdr.data_len * SDSEG_RECLAIM_PCT;
+  if (rf != f) { // desde aquí 'f' basta: la reescritura lee descifrando
+    if (rewrite) {
+      fclose(f);
+      f = rf;
+    } else {
+      fclose(rf);
+    }
+  }
+
+  bool ok = true;
+  if (keep_off >= end) {
+    fclose(f);
+    ok = remove(path) == 0;
+    sdseg_idx_path(seq, path, sizeof(path));
+    remove(path);
+    dropped = sdseg_live_lines(&hdr);
+    *changed = true;
+  } else if (dropped == 0) {
+    fclose(f);
+  } else if (rewrite) {
+    hdr.head_lines += (uint32_t)dropped;
+    hdr.head_objs += (uint32_t)objs;
+    ok = rewrite_from(seq, f, &hdr, keep_off);
+    *changed = true;
+  } else {
+    hdr.head_off = keep_off;
+    hdr.head_lines += (uint32_t)dropped;
+    hdr.head_objs += (uint32_t)objs;
+    ok = write_hdr(f, &hdr) && fflush(f) == 0 && sdacct_fsync(fileno(f)) == 0;
+    sdacct_write(SDACCT_PURGE, 0, sizeof(hdr));
+    if (!ok) sdacct_error();
+    fclose(f);
+    *changed = true;
+  }
+  *dropped_out = dropped;
+  return ok;
+}
+
+bool sdseg_consume_active(uint32_t off) {
+  if (s_active < 0 || s_pub_seq != s_hdr.seq || off > s_pub_end) return false;
+  uint32_t start = sdseg_data_start(&s_hdr);
+  if (off <= start) return true;
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(s_hdr.seq, path, sizeof(path));
+  // Hasta el final estable todo está en la tarjeta: se lee por otro FILE
+  uint8_t *buf = (uint8_t *)malloc(SDSEG_SCAN_BUF);
+  FILE *f = buf ? open_data(path, &s_hdr) : NULL;
+  size_t lines = 0, objs = 0;
+  uint32_t cut = f ? scan_lines(f, &s_hdr, start, off, buf, SDSEG_SCAN_BUF,
+                                SIZE_MAX, SIZE_MAX, &lines, &objs)
+                   : start;
+  if (f) fclose(f);
+  free(buf);
+  if (cut == start) return false;
+  s_hdr.head_off = cut; // si no acaba en 'off', lo demás se reenvía
+  s_hdr.head_lines += (uint32_t)lines;
+  s_hdr.head_objs += (uint32_t)objs;
+  s_hdr_dirty = true;
+  return sync_active();
+}
+
+bool sdseg_consume(uint32_t seq, uint32_t off) {
+  if (seq == s_active_seq) return false;
+  size_t dropped;
+  bool changed;
+  seg_lock();
+  bool ok = drop_head(seq, off, &dropped, &changed);
+  seg_unlock();
+  if (changed) part_update(seq, PART_CONSUMED);
+  return ok;
+}
+
+/* ================= Compresión ================= */
+
+void sdseg_pin(uint32_t seq) {
+  seg_lock();
+  s_pinned_seq = seq;
+  seg_unlock();
+}
+
+bool sdseg_read_pack(FILE *f, uint32_t off, sdseg_pack_t *pk) {
+  return fseek(f, (long)off, SEEK_SET) == 0 &&
+         fread(pk, 1, sizeof(*pk), f) == sizeof(*pk) &&
+         pk->magic == SDSEG_PACK_MAGIC;
+}
+
+/* ================= Lectura por trozos de líneas ================= */
+
+// Mide la unidad que empieza en p[0..avail): un frame, un registro o un
+// trozo de texto. false si no está entera en el buffer. 'objs' son los
+// eventos que lleva (ver sdrec_count_events).
+static bool scan_unit(const sdseg_hdr_t *hdr, sdrec_evscan_t *ev,
+                      const uint8_t *p, size_t avail, size_t *step, bool *eol,
+                      size_t *objs) {
+  *eol = false;
+  *objs = 0;
+  if (!sdseg_is_binary(hdr)) { // NDJSON: hasta el '\n' o todo el bloque
+    const uint8_t *nl = (const uint8_t *)memchr(p, '\n', avail);
+    *eol = nl != NULL;
+    *step = nl ? (size_t)(nl - p) + 1 : avail;
+    return true;
+  }
+  if (sdseg_is_framed(hdr)) {
+    uint16_t fl = 0;
+    size_t sz = (p[0] == SDREC_SYNC) ? sdrec_frame_check(p, avail, &fl, sdseg_crc_seed(hdr)) : 0;
+    if (sz == 0) {
+      // Frame que sigue en el bloque siguiente, o basura (se salta un byte
+      // como hace sdrec_next al resincronizar)
+      size_t len = (avail >= SDREC_FRAME_HDR) ? ((p[1] | p[2] << 8) & SDREC_FRAME_LEN_MASK) : 0;
+      if (p[0] == SDREC_SYNC && (avail < SDREC_FRAME_HDR ||
+                                 (len <= SDREC_REC_MAX && len + SDREC_FRAME_OVH > avail)))
+        return false;
+      sz = 1;
+    }
+    *step = sz;
+    *eol = (fl & SDREC_FRAME_LINE_END) != 0;
+    if (sz > 1) *objs = sdrec_count_events(ev, p + SDREC_FRAME_HDR, sz - SDREC_FRAME_OVH);
+    return true;
+  }
+  // Registros sueltos (versión 2): tipo + varint len + datos
+  if (p[0] != SDREC_OBJ && p[0] != SDREC_RAW) {
+    *step = 1;
+    *eol = p[0] == SDREC_EOL;
+    if (*eol) sdrec_evscan_reset(ev);
+    return true;
+  }
+  size_t i = 1, len = 0;
+  for (int shift = 0;; shift += 7) {
+    if (i >= avail || shift > 28) return false;
+    uint8_t b = p[i++];
+    len |= (size_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) break;
+  }
+  if (i + len > avail) return false;
+  *step = i + len;
+  *objs = sdrec_count_events(ev, p, *step);
+  return true;
+}
+
+// sdseg_scan_lines contando además los objetos de las líneas tomadas (los
+// NDJSON de versión 1 no se cuentan)
+static uint32_t scan_lines(FILE *f, const sdseg_hdr_t *hdr, uint32_t start,
+                           uint32_t end, uint8_t *buf, size_t cap,
+                           size_t max_lines, size_t max_bytes, size_t *lines,
+                           size_t *objs) {
+  uint32_t cut = start;
+  *lines = 0;
+  *objs = 0;
+  if (sdseg_is_lz(hdr)) { // packs enteros
+    sdseg_pack_t pk;
+    while (cut < end && *lines < max_lines && sdseg_read_pack(f, cut, &pk)) {
+      uint32_t next = cut + sizeof(pk) + pk.comp_len;
+      if (next > end || (*lines > 0 && (next - start > max_bytes ||
+                                         *lines + pk.lines > max_lines)))
+        break;
+      cut = next;
+      *lines += pk.lines;
+      *objs += pk.objs;
+    }
+    return cut;
+  }
+
+  uint32_t pos = start;
+  size_t line_objs = 0; // de la línea en curso
+  sdrec_evscan_t ev;    // 'start' siempre es principio de línea
+  sdrec_evscan_reset(&ev);
+  while (pos < end && *lines < max_lines) {
+    size_t want = (end - pos < cap) ? end - pos : cap;
+    if (fseek(f, (long)pos, SEEK_SET) != 0) break;
+    size_t k = fread(buf, 1, want, f);
+    size_t i = 0;
+    while (i < k) {
+      size_t step, n;
+      bool eol;
+      if (!scan_unit(hdr, &ev, buf + i, k - i, &step, &eol, &n)) break;
+      i += step;
+      line_objs += n;
+      if (!eol) continue;
+      uint32_t off = pos + (uint32_t)i;
+      if (*lines > 0 && off - start > max_bytes) return cut;
+      cut = off;
+      *objs += line_objs;
+      line_objs = 0;
+      if (++(*lines) >= max_lines) return cut;
+    }
+    if (i == 0) break; // unidad mayor que 'buf' o cola cortada
+    pos += (uint32_t)i;
+  }
+  return cut;
+}
+
+uint32_t sdseg_scan_lines(FILE *f, const sdseg_hdr_t *hdr, uint32_t start,
+                          uint32_t end, uint8_t *buf, size_t cap,
+                          size_t max_lines, size_t max_bytes, size_t *lines) {
+  size_t objs;
+  return scan_lines(f, hdr, start, end, buf, cap, max_lines, max_bytes, lines, &objs);
+}
+
+static bool lz_fwrite(void *ctx, const uint8_t *p, size_t n) {
+  return out_write((seg_out_t *)ctx, p, n);
+}
+
+// Escribe en 'out' los packs de los registros de 'rd' y en 'idx' su índice
+// temporal (las entradas empiezan en un pack). Devuelve el offset final o 0
+// si algo falla.
+static uint32_t write_packs(seg_out_t *out, sdrec_reader_t *rd, sdlz_enc_t *enc,
+                            sdtidx_writer_t *idx, uint64_t *json_total) {
+  uint32_t out_off = SDSEG_HDR_SIZE;
+  int x = SDREC_R_LINE;
+  while (x > 0) {
+    sdseg_pack_t pk = {SDSEG_PACK_MAGIC, 0, 0, 0, 0, 0};
+    // La cabecera se escribe al cerrar el pack
+    if (!out_seek(out, out_off + sizeof(pk))) return 0;
+    sdtidx_line_start(idx, out_off);
+    while ((x = sdrec_next(rd)) > 0) {
+      if (x == SDREC_R_LINE) {
+        pk.lines++;
+        if (pk.json_len >= SDSEG_LZ_PACK_BYTES) break;
+        continue;
+      }
+      if (pk.json_len) {
+        sdlz_enc_write(enc, ",", 1);
+        pk.json_len++;
+      }
+      sdlz_enc_write(enc, rd->json, rd->json_len);
+      pk.json_len += (uint32_t)rd->json_len;
+      pk.objs += sdrec_json_events(rd->json, rd->json_len);
+      sdtidx_note_ts(idx, sdseg_json_ts(rd->json, rd->json_len));
+    }
+    if (x < 0) return 0; // registro cortado: se queda sin comprimir
+    if (pk.lines == 0 && pk.objs == 0) break;
+    if (!sdlz_enc_end_pack(enc)) return 0;
+    pk.comp_len = enc->out_len;
+    pk.crc = enc->crc;
+    if (!out_seek(out, out_off) || !out_write(out, &pk, sizeof(pk)))
+      return 0;
+    out_off += sizeof(pk) + pk.comp_len;
+    *json_total += pk.json_len;
+  }
+  return out_off;
+}
+
+// Sustituye un segmento sellado por su versión comprimida. Se escribe
+// aparte (.TMZ) y se cambia con remove + rename bajo el mutex.
+bool sdseg_compress(uint32_t seq) {
+  sdseg_hdr_t hdr;
+  if (seq == s_active_seq || seq == s_pinned_seq || !sdseg_read_hdr(seq, &hdr) ||
+      !(hdr.flags & SDSEG_FLAG_SEALED) || !sdseg_is_binary(&hdr) ||
+      sdseg_is_lz(&hdr) || !sdseg_readable(&hdr))
+    return false;
+
+  char path[SDSEG_PATH_MAX], tmp[SDSEG_PATH_MAX], tmx[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  seg_file(seq, "TMZ", tmp, sizeof(tmp));
+  seg_file(seq, "TMX", tmx, sizeof(tmx)); // índice por packs
+
+  sdrec_reader_t *rd = (sdrec_reader_t *)malloc(sizeof(sdrec_reader_t));
+  sdlz_enc_t *enc = (sdlz_enc_t *)malloc(sizeof(sdlz_enc_t));
+  FILE *fin = open_data(path, &hdr);
+  FILE *fout = fin ? fopen(tmp, "wb") : NULL;
+  bool ok = rd && enc && fin && fout;
+
+  // El resultado se cifra (nonce nuevo) si hay clave, aunque el original
+  // fuera de antes del cifrado
+  sdseg_hdr_t zh = hdr;
+  hdr_set_enc(&zh);
+  seg_out_t out;
+  out_init(&out, fout, &zh);
+
+  int64_t t0 = esp_timer_get_time();
+  uint64_t json_total = 0;
+  uint32_t end = 0;
+  sdtidx_writer_t tw;
+  bool have_idx = false;
+  if (ok) {
+    // Lo ya consumido (antes de la cabeza) no se comprime
+    sdrec_reader_init(rd, fin, sdseg_data_start(&hdr), SDSEG_HDR_SIZE + hdr.data_len,
+                      sdseg_is_framed(&hdr), sdseg_crc_seed(&hdr));
+    sdlz_enc_init(enc, lz_fwrite, &out);
+    have_idx = sdtidx_writer_open(&tw, tmx); // sin él solo se purga entero
+    end = write_packs(&out, rd, enc, &tw, &json_total);
+    ok = end != 0;
+    if (ok) sdtidx_writer_close(&tw, end);
+    else sdtidx_writer_abort(&tw);
+  }
+  if (ok) {
+    zh.flags |= SDSEG_FLAG_LZ;
+    zh.data_len = end - SDSEG_HDR_SIZE;
+    zh.lines = sdseg_live_lines(&hdr);
+    zh.objs = sdseg_live_objs(&hdr);
+    zh.head_off = 0;
+    zh.head_lines = 0;
+    zh.head_objs = 0;
+    ok = write_hdr(fout, &zh) && fflush(fout) == 0 &&
+         sdacct_fsync(fileno(fout)) == 0;
+    // Packs de principio a fin y la cabecera otra vez al final
+    sdacct_write(SDACCT_COMPACT, 0, end);
+    sdacct_physical(SDACCT_COMPACT, 0, sizeof(zh));
+    if (!ok) sdacct_error();
+  }
+  if (fout) fclose(fout);
+  if (fin) fclose(fin);
+  free(enc);
+  free(rd);
+
+  seg_lock();
+  // Si se fijó o avanzó la cabeza mientras tanto, se descarta sin marcarlo
+  sdseg_hdr_t now;
+  bool busy = seq == s_pinned_seq || !sdseg_read_hdr(seq, &now) ||
+              now.head_off != hdr.head_off;
+  if (ok && !busy) {
+    // Primero el índice: si se corta antes del rename del .TMZ, el de packs
+    // no encaja con el .SEG sin comprimir y se reconstruye al buscar
+    char idx[SDSEG_PATH_MAX];
+    sdseg_idx_path(seq, idx, sizeof(idx));
+    remove(idx);
+    if (have_idx) rename(tmx, idx);
+    remove(path);
+    ok = rename(tmp, path) == 0;
+  } else {
+    remove(tmp);
+    if (have_idx) remove(tmx);
+    ok = false;
+  }
+  seg_unlock();
+
+  if (!ok) {
+    if (busy) return false;
+    s_lz_bad_seq = seq;
+    ESP_LOGW(TAG, "sdseg: can't compress %08lX", (unsigned long)seq);
+    return false;
+  }
+  part_update(seq, PART_CHANGED);
+  uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+  uint32_t comp = end - SDSEG_HDR_SIZE;
+  s_lz_stats.segments++;
+  s_lz_stats.raw_bytes += hdr.data_len;
+  s_lz_stats.json_bytes += json_total;
+  s_lz_stats.comp_bytes += comp;
+  s_lz_stats.cpu_us += us;
+  ESP_LOGI(TAG, "sdseg: compressed %08lX %u -> %u B (json %u B, x%u.%02u) in %u ms",
+           (unsigned long)seq, (unsigned)hdr.data_len, (unsigned)comp,
+           (unsigned)json_total, (unsigned)(json_total / (comp ? comp : 1)),
+           (unsigned)(json_total * 100 / (comp ? comp : 1) % 100),
+           (unsigned)(us / 1000));
+  return true;
+}
+
+bool sdseg_compress_next(void) {
+  uint32_t seqs[SDSEG_LIST_MAX];
+  size_t n = sdseg_list(seqs, SDSEG_LIST_MAX);
+  for (size_t i = 0; i < n; i++) {
+    sdseg_hdr_t hdr;
+    if (seqs[i] == s_pinned_seq || seqs[i] == s_lz_bad_seq ||
+        !sdseg_read_hdr(seqs[i], &hdr) || !sdseg_is_binary(&hdr) ||
+        sdseg_is_lz(&hdr) || !(hdr.flags & SDSEG_FLAG_SEALED))
+      continue;
+    return sdseg_compress(seqs[i]);
+  }
+  return false;
+}
+
+void sdseg_get_lz_stats(sdseg_lz_stats_t *out) { *out = s_lz_stats; }
+
+/* ================= Búsqueda por tiempo ================= */
+
+// Offset del primer inicio de línea (de pack, si está comprimido) del
+// segmento que puede tener "t" >= t. Usa el índice .IDX y, sin comprimir,
+// lo reconstruye si falta o está incompleto. Con el mutex tomado.
+static bool index_seek(uint32_t seq, uint32_t t, uint32_t *off) {
+  sdseg_hdr_t hdr;
+  if (seq == s_active_seq || !sdseg_read_hdr(seq, &hdr) ||
+      !sdseg_is_binary(&hdr))
+    return false;
+  uint32_t data_end = SDSEG_HDR_SIZE + hdr.data_len;
+
+  char idx[SDSEG_PATH_MAX];
+  sdseg_idx_path(seq, idx, sizeof(idx));
+  if (sdtidx_lookup(idx, data_end, t, off)) {
+    if (*off < sdseg_data_start(&hdr)) *off = sdseg_data_start(&hdr);
+    return true;
+  }
+  // El de packs solo lo escribe la compresión: sin él no se busca
+  if (sdseg_is_lz(&hdr)) return false;
+
+  char path[SDSEG_PATH_MAX];
+  sdseg_path(seq, path, sizeof(path));
+  FILE *f = open_data(path, &hdr);
+  bool ok = f && sdtidx_build(f, sdseg_is_framed(&hdr), sdseg_crc_seed(&hdr),
+                              SDSEG_HDR_SIZE, data_end, idx);
+  if (f) fclose(f);
+  if (ok) ESP_LOGI(TAG, "sdseg: rebuilt index for %08lX", (unsigned long)seq);
+  if (!ok || !sdtidx_lookup(idx, data_end, t, off)) return false;
+  if (*off < sdseg_data_start(&hdr)) *off = sdseg_data_start(&hdr);
+  return true;
+}
+
+uint32_t sdseg_json_ts(const char *obj, size_t len) {
+  const char *end = obj + len;
+  const char *p = obj;
+  // Busca la clave "t" (el objeto no tiene por qué acabar en '\0')
+  for (; p + 3 <= end; p++) {
+    if (p[0] == '"' && p[1] == 't' && p[2] == '"') break;
+  }
+  if (p + 3 > end) return 0;
+  p += 3;
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  if (p >= end || *p != ':') return 0;
+  p++;
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  unsigned long long v = 0;
+  bool any = false;
+  while (p < end && *p >= '0' && *p <= '9') {
+    v = v * 10ULL + (unsigned)(*p++ - '0');
+    any = true;
+  }
+  if (!any) return 0;
+  if (v > 100000000000ULL) v /= 1000ULL; // ms -> s
+  return (uint32_t)v;
+}
+
+#endif // HAS_SDCARD
@@ -0,0 +1,131 @@
+#ifdef HAS_SDCARD
+
+#include "sdtindex.h"
+#include "sdrecord.h"
+#include "sdsegment.h" // sdseg_json_ts, SDSEG_MIN_VALID_T
+#include "sdacct.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void entry_reset(sdtidx_entry_t *e, uint32_t off) {
+  e->off = off;
+  e->min_t = 0;
+  e->max_t = 0;
+}
+
+static void entry_note(sdtidx_entry_t *e, uint32_t t) {
+  if (t < SDSEG_MIN_VALID_T) return;
+  if (e->min_t == 0 || t < e->min_t) e->min_t = t;
+  if (t > e->max_t) e->max_t = t;
+}
+
+static inline uint32_t next_block(uint32_t off) {
+  return (off / SDTIDX_BLOCK + 1) * SDTIDX_BLOCK;
+}
+
+/* ================= Escritura incremental ================= */
+
+bool sdtidx_writer_open(sdtidx_writer_t *w, const char *path) {
+  w->f = fopen(path, "wb");
+  w->have = false;
+  w->next_blk = 0;
+  return w->f != NULL;
+}
+
+void sdtidx_line_start(sdtidx_writer_t *w, uint32_t off) {
+  if (!w->f) return;
+  if (w->have && off < w->next_blk) return; // sigue el mismo bloque
+  if (w->have) fwrite(&w->cur, 1, sizeof(w->cur), w->f);
+  entry_reset(&w->cur, off);
+  w->have = true;
+  w->next_blk = next_block(off);
+}
+
+void sdtidx_note_ts(sdtidx_writer_t *w, uint32_t t) {
+  if (w->f && w->have) entry_note(&w->cur, t);
+}
+
+void sdtidx_writer_close(sdtidx_writer_t *w, uint32_t data_end) {
+  if (!w->f) return;
+  if (w->have && w->cur.off < data_end)
+    fwrite(&w->cur, 1, sizeof(w->cur), w->f);
+  sdtidx_entry_t end;
+  entry_reset(&end, data_end);
+  fwrite(&end, 1, sizeof(end), w->f);
+  sdacct_write(SDACCT_APPEND, 0, (size_t)ftell(w->f));
+  fclose(w->f);
+  w->f = NULL;
+  w->have = false;
+}
+
+void sdtidx_writer_abort(sdtidx_writer_t *w) {
+  if (w->f) fclose(w->f);
+  w->f = NULL;
+  w->have = false;
+}
+
+/* ================= Reconstrucción ================= */
+
+bool sdtidx_build(FILE *seg, bool framed, uint32_t seed, uint32_t data_start,
+                  uint32_t data_end, const char *path) {
+  sdtidx_writer_t w;
+  if (!sdtidx_writer_open(&w, path)) return false;
+  sdrec_reader_t *r = (sdrec_reader_t *)malloc(sizeof(sdrec_reader_t));
+  if (!r) {
+    sdtidx_writer_abort(&w);
+    remove(path);
+    return false;
+  }
+
+  sdrec_reader_init(r, seg, data_start, data_end, framed, seed);
+  sdtidx_line_start(&w, data_start);
+  int x;
+  while ((x = sdrec_next(r)) > 0) {
+    if (x == SDREC_R_LINE) sdtidx_line_start(&w, r->pos);
+    else sdtidx_note_ts(&w, sdseg_json_ts(r->json, r->json_len));
+  }
+  free(r);
+  sdtidx_writer_close(&w, data_end);
+  return true;
+}
+
+/* ================= Búsqueda ================= */
+
+bool sdtidx_lookup(const char *path, uint32_t data_end, uint32_t t,
+                   uint32_t *off) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long sz = ftell(f);
+  size_t n = (sz > 0) ? (size_t)sz / sizeof(sdtidx_entry_t) : 0;
+
+  sdtidx_entry_t e;
+  bool ok = n > 0 && (size_t)sz == n * sizeof(e) &&
+            fseek(f, (long)((n - 1) * sizeof(e)), SEEK_SET) == 0 &&
+            fread(&e, 1, sizeof(e), f) == sizeof(e) && e.off == data_end;
+  if (!ok) {
+    fclose(f);
+    return false;
+  }
+
+  // Primera entrada con max_t >= t (la hora crece dentro del segmento)
+  size_t lo = 0, hi = n - 1; // hi = terminador
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (fseek(f, (long)(mid * sizeof(e)), SEEK_SET) != 0 ||
+        fread(&e, 1, sizeof(e), f) != sizeof(e)) {
+      fclose(f);
+      return false;
+    }
+    if (e.max_t >= t) hi = mid;
+    else lo = mid + 1;
+  }
+  fseek(f, (long)(lo * sizeof(e)), SEEK_SET);
+  ok = fread(&e, 1, sizeof(e), f) == sizeof(e);
+  fclose(f);
+  if (ok) *off = e.off;
+  return ok;
+}
+
+#endif // HAS_SDCARD
@@ -9,13 +9,20 @@
 #include "freertos/task.h"
 
 #include "net_time.h"
-#include "sdcard.h"     // sdjson_delete_first_lines()
+#include "sdcard.h"     // sdjson_*() del logger
+#include "sdrecord.h"   // segmentos binarios -> JSON
+#include "sdlz.h"       // segmentos comprimidos
+#include "sdflash.h"    // trozos de la flash interna
+#include "sdrtc.h"      // recuentos en RTC con SLEEPCYCLE
+#include "sdacct.h"     // contabilidad de escrituras de la tarjeta
+#include "configmanager.h" // cfg.sleepcycle
 
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <ctype.h>      // isspace
 #include <stdlib.h>     // malloc/realloc/free
+#include <sys/stat.h>   // stat
 
 #include <esp_heap_caps.h>
 extern "C" {
@@ -25,14 +32,13 @@ extern "C" {
 
 /* ── PROTOTIPOS DEL LOGGER SD ───────────────────────────────────────────── */
 extern bool sdjson_logger_start(void);
-extern void sdjson_logger_stop(void);
-extern "C" bool sdjson_delete_first_lines(size_t n);
 /* Cerrar la línea actual de forma SÍNCRONA antes de postear (NO usado) */
 extern "C" bool sdcard_newline_sync(uint32_t timeout_ms);
 /* Cerrar la línea actual (asíncrono) */
 extern "C" void sdcard_newline(void);
 /* APPEND de objetos crudos NDJSON */
 extern "C" void sdcard_append_jsonl(const char *chunk);
+extern "C" void sdcard_append_jsonl_critical(const char *chunk);
 /* Solicitar purga de líneas antiguas al writer (seguro y sin carreras) */
 extern "C" void sdjson_request_purge_older_than(uint32_t max_age_sec);
 /* ¿Hora real disponible? (NTP listo) */
@@ -73,10 +79,20 @@ extern "C" bool netTimeReady(void);
 #define SDCARD_MACLOG_BASENAME "mac_events"
 #endif
 
+// Segmentos comprimidos: 1 = se mandan los packs tal cual (Content-Encoding:
+// gzip), 0 = se descomprimen al vuelo y el servidor recibe JSON plano
+#ifndef SDLZ_POST_GZIP
+#define SDLZ_POST_GZIP 1
+#endif
+
 // ── NUEVO: vaciado por offset (rápido)
 #ifndef MAX_LINES_PER_POST
 #define MAX_LINES_PER_POST 25      // ajustable
 #endif
+#ifndef MAX_BYTES_PER_POST
+#define MAX_BYTES_PER_POST (16UL * 1024UL) // bytes de segmento por POST
+#endif
+#define ACK_TIMEOUT_MS 2000        // acuse del activo: espera a la writer
 #define SENDING_PATH  MOUNT_POINT "/" SDCARD_MACLOG_BASENAME "_sending.jsonl"
 #define INDEX_PATH    MOUNT_POINT "/" SDCARD_MACLOG_BASENAME "_sending.idx"
 #define CHUNK_PATH    MOUNT_POINT "/" SDCARD_MACLOG_BASENAME "_chunk.jsonl"
@@ -104,7 +120,8 @@ static volatile bool gRebootScheduled = false;
 struct NdjsonStats { size_t lines=0; size_t bytes=0; };
 static bool compute_ndjson_stats(const char* path, NdjsonStats& st);
 static char last_non_ws_char_in_file(const char* path);
-static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t* out_dropped);
+static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t* out_dropped,
+                                      NdjsonStats* out_st = nullptr);
 class NdjsonArrayStream;
 static bool wait_file_stable_closed(const char* path, uint32_t timeout_ms , uint32_t settle_ms );
 
@@ -167,6 +184,12 @@ static bool compute_ndjson_stats(const char* path, NdjsonStats& st) {
   st.lines = lines; st.bytes = bytes; return true;
 }
 
+// Tamaño sin recorrer el fichero (-1 si no existe)
+static long file_size(const char* path) {
+  struct stat st;
+  return (stat(path, &st) == 0) ? (long)st.st_size : -1;
+}
+
 static char last_non_ws_char_in_file(const char* path) {
   FILE* f = fopen(path, "rb"); if (!f) return '\0';
   if (fseek(f, 0, SEEK_END) != 0) { fclose(f); return '\0'; }
@@ -194,9 +217,13 @@ static void sb_append(char** buf, size_t* cap, size_t* len, char c) {
   (*buf)[*len] = '\0';
 }
 
-static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t* out_dropped) {
+// 'out_st' recibe líneas y bytes de lo que queda (lo que daría
+// compute_ndjson_stats), así no hay que volver a leerlo
+static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t* out_dropped,
+                                      NdjsonStats* out_st) {
   if (out_kept)    *out_kept = 0;
   if (out_dropped) *out_dropped = 0;
+  if (out_st)      *out_st = NdjsonStats();
 
   FILE* fi = fopen(path, "rb");
   if (!fi) return false;
@@ -205,6 +232,7 @@ static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t
   FILE* fo = fopen(tmpPath, "wb"); if (!fo) { fclose(fi); return false; }
 
   size_t kept_total = 0, dropped_total = 0;
+  NdjsonStats st;
   bool in_string=false, esc=false, have_obj=false; int depth=0;
   char* objbuf=nullptr; size_t obcap=0, oblen=0; bool wrote_any_in_line=false;
 
@@ -215,7 +243,7 @@ static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t
       if (ch == '{') { in_string=false; esc=false; depth=1; have_obj=true; oblen=0; sb_append(&objbuf,&obcap,&oblen,'{'); }
       else if (ch == '\n') {
         if (have_obj && depth > 0) { dropped_total++; have_obj=false; depth=0; in_string=false; esc=false; oblen=0; }
-        if (wrote_any_in_line) { fputc('\n', fo); wrote_any_in_line=false; }
+        if (wrote_any_in_line) { fputc('\n', fo); st.lines++; wrote_any_in_line=false; }
       } else { /* basura fuera de objeto: ignorar */ }
     } else {
       sb_append(&objbuf,&obcap,&oblen,(char)ch);
@@ -228,8 +256,9 @@ static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t
         else if (ch=='{') depth++;
         else if (ch=='}') {
           if (--depth == 0) {
-            if (wrote_any_in_line) fputc(',', fo);
+            if (wrote_any_in_line) { fputc(',', fo); st.bytes++; }
             if (oblen>0) fwrite(objbuf,1,oblen,fo);
+            st.bytes += oblen;
             kept_total++; wrote_any_in_line=true; have_obj=false; oblen=0;
           }
         }
@@ -237,8 +266,9 @@ static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t
     }
   }
   if (have_obj && depth>0) { dropped_total++; have_obj=false; oblen=0; }
-  if (wrote_any_in_line) fputc('\n', fo);
+  if (wrote_any_in_line) { fputc('\n', fo); st.lines++; }
 
+  sdacct_write(SDACCT_SANITIZE, 0, (size_t)ftell(fo));
   free(objbuf); fclose(fi); fclose(fo);
 
   if (kept_total == 0) {
@@ -254,6 +284,7 @@ static bool sanitize_snapshot_inplace(const char* path, size_t* out_kept, size_t
   }
   Serial.printf("[SAN] '%s': kept=%u dropped=%u -> OK\n",
                 path, (unsigned)kept_total, (unsigned)dropped_total);
+  if (out_st) *out_st = st;
   return true;
 }
 
@@ -358,22 +389,185 @@ private:
   uint8_t _buf[STREAM_CHUNK_MAX]; size_t _buf_len, _buf_pos;
 };
 
-/* ── Utilidades de envío ─────────────────────────────────────────────────── */
+/* ── Stream para POST de registros binarios de un segmento ─────────────── */
 
-static size_t count_events_in_file(const char* path) {
-  FILE* f = fopen(path, "rb"); if (!f) return 0;
-  bool in_string=false, esc=false; int depth=0; size_t count=0; int ch;
-  while ((ch=fgetc(f))!=EOF) {
-    if (in_string) { if (esc) esc=false; else if (ch=='\\') esc=true; else if (ch=='"') in_string=false; continue; }
-    if (ch=='{') depth++;
-    else if (ch=='}') { if (depth>0 && --depth==0) count++; }
+// Decodifica los registros [start, end) y emite prefix + obj,obj,... + suffix:
+// el mismo cuerpo que NdjsonArrayStream con el NDJSON de texto, sin pasar
+// por ficheros intermedios.
+class SegmentJsonStream : public Stream {
+public:
+  SegmentJsonStream(sdrec_reader_t* rd,
+                    const char* prefix, size_t prefix_len,
+                    const char* suffix, size_t suffix_len)
+  : _rd(rd), _prefix(prefix), _prefix_len(prefix_len),
+    _suffix(suffix), _suffix_len(suffix_len),
+    _state(STATE_PREFIX), _first(true), _cur(nullptr), _len(0), _pos(0) {}
+
+  int available() override {
+    while (_pos >= _len) {
+      if (_state == STATE_PREFIX) {
+        set(_prefix, _prefix_len); _state = STATE_RECORDS;
+      } else if (_state == STATE_OBJ) {
+        set(_rd->json, _rd->json_len); _state = STATE_RECORDS;
+      } else if (_state == STATE_RECORDS) {
+        int x = sdrec_next(_rd);
+        if (x == SDREC_R_LINE) continue;
+        if (x == SDREC_R_JSON) {
+          if (_first) { _first = false; set(_rd->json, _rd->json_len); }
+          else { set(",", 1); _state = STATE_OBJ; }
+        } else {
+          set(_suffix, _suffix_len); _state = STATE_DONE;
+        }
+      } else {
+        return 0;
+      }
+    }
+    return (int)(_len - _pos);
   }
-  fclose(f); return count;
-}
+
+  int read() override { if (available() <= 0) return -1; return (uint8_t)_cur[_pos++]; }
+  int peek() override { if (available() <= 0) return -1; return (uint8_t)_cur[_pos]; }
+  size_t readBytes(char* buffer, size_t length) override {
+    size_t n = 0;
+    while (n < length && available() > 0) {
+      size_t k = _len - _pos; if (k > length - n) k = length - n;
+      memcpy(buffer + n, _cur + _pos, k);
+      _pos += k; n += k;
+    }
+    return n;
+  }
+  void flush() override {}
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  enum State { STATE_PREFIX, STATE_RECORDS, STATE_OBJ, STATE_DONE };
+  void set(const char* p, size_t n) { _cur = p; _len = n; _pos = 0; }
+
+  sdrec_reader_t* _rd;
+  const char* _prefix; size_t _prefix_len;
+  const char* _suffix; size_t _suffix_len;
+  State _state; bool _first;
+  const char* _cur; size_t _len, _pos;
+};
+
+// Lector de segmentos binarios y buffer de sdjson_read_spans (solo los usa
+// wifi_http_task)
+static sdrec_reader_t s_seg_reader;
+static uint8_t s_span_buf[SDSEG_SCAN_BUF];
+
+/* ── Stream para POST de un pack comprimido ────────────────────────────── */
+
+// Emite prefix + "obj,obj,..." del pack + suffix. Con gzip=true el pack va
+// tal cual dentro de un gzip: prefix y suffix como bloques stored y el
+// crc32 combinado con el del pack. Con gzip=false se descomprime al vuelo.
+class SegmentPackStream : public Stream {
+public:
+  SegmentPackStream(FILE* f, const sdseg_pack_t& pk, bool gzip,
+                    const char* prefix, size_t prefix_len,
+                    const char* suffix, size_t suffix_len)
+  : _f(f), _comp_left(pk.comp_len), _gzip(gzip),
+    _prefix(prefix), _prefix_len(prefix_len),
+    _suffix(suffix), _suffix_len(suffix_len),
+    _state(STATE_HEAD), _cur(nullptr), _len(0), _pos(0) {
+    if (_gzip) {
+      uint32_t crc = sdrec_crc32(0, (const uint8_t*)prefix, prefix_len);
+      crc = sdlz_crc32_combine(crc, pk.crc, pk.json_len);
+      crc = sdrec_crc32(crc, (const uint8_t*)suffix, suffix_len);
+      sdlz_gzip_trailer(_trailer, crc, (uint32_t)(prefix_len + pk.json_len + suffix_len));
+    } else {
+      sdlz_dec_init(&_dec, file_getc, f);
+    }
+  }
+
+  // Bytes totales del cuerpo (Content-Length)
+  static size_t body_len(const sdseg_pack_t& pk, bool gzip, size_t prefix_len, size_t suffix_len) {
+    if (!gzip) return prefix_len + pk.json_len + suffix_len;
+    return SDLZ_GZIP_HDR + SDLZ_STORED_HDR + prefix_len + pk.comp_len +
+           SDLZ_STORED_HDR + suffix_len + SDLZ_GZIP_TRAILER;
+  }
+
+  int available() override {
+    while (_pos >= _len) {
+      switch (_state) {
+        case STATE_HEAD:
+          if (_gzip) {
+            size_t n = sdlz_gzip_header(_hdr);
+            n += sdlz_stored_hdr(_hdr + n, (uint16_t)_prefix_len, false);
+            set(_hdr, n);
+          }
+          _state = STATE_PREFIX; break;
+        case STATE_PREFIX:
+          set((const uint8_t*)_prefix, _prefix_len); _state = STATE_PACK; break;
+        case STATE_PACK:
+          if (_gzip ? !fill_raw() : !fill_inflate()) {
+            if (_gzip) set(_hdr, sdlz_stored_hdr(_hdr, (uint16_t)_suffix_len, true));
+            _state = STATE_SUFFIX;
+          }
+          break;
+        case STATE_SUFFIX:
+          set((const uint8_t*)_suffix, _suffix_len); _state = STATE_TRAILER; break;
+        case STATE_TRAILER:
+          if (_gzip) set(_trailer, SDLZ_GZIP_TRAILER);
+          _state = STATE_DONE; break;
+        default:
+          return 0;
+      }
+    }
+    return (int)(_len - _pos);
+  }
+
+  int read() override { if (available() <= 0) return -1; return _cur[_pos++]; }
+  int peek() override { if (available() <= 0) return -1; return _cur[_pos]; }
+  size_t readBytes(char* buffer, size_t length) override {
+    size_t n = 0;
+    while (n < length && available() > 0) {
+      size_t k = _len - _pos; if (k > length - n) k = length - n;
+      memcpy(buffer + n, _cur + _pos, k);
+      _pos += k; n += k;
+    }
+    return n;
+  }
+  void flush() override {}
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  enum State { STATE_HEAD, STATE_PREFIX, STATE_PACK, STATE_SUFFIX, STATE_TRAILER, STATE_DONE };
+  void set(const uint8_t* p, size_t n) { _cur = p; _len = n; _pos = 0; }
+  static int file_getc(void* ctx) { return fgetc((FILE*)ctx); }
+
+  bool fill_raw() {
+    if (_comp_left == 0) return false;
+    size_t k = (_comp_left > STREAM_CHUNK_MAX) ? STREAM_CHUNK_MAX : _comp_left;
+    k = fread(_buf, 1, k, _f);
+    if (k == 0) return false; // truncado: el servidor verá el gzip incompleto
+    _comp_left -= k;
+    set(_buf, k);
+    return true;
+  }
+  bool fill_inflate() {
+    int k = sdlz_dec_read(&_dec, _buf, STREAM_CHUNK_MAX);
+    if (k <= 0) return false;
+    set(_buf, (size_t)k);
+    return true;
+  }
+
+  FILE* _f; size_t _comp_left; bool _gzip;
+  const char* _prefix; size_t _prefix_len;
+  const char* _suffix; size_t _suffix_len;
+  State _state;
+  const uint8_t* _cur; size_t _len, _pos;
+  uint8_t _hdr[SDLZ_GZIP_HDR + SDLZ_STORED_HDR];
+  uint8_t _trailer[SDLZ_GZIP_TRAILER];
+  uint8_t _buf[STREAM_CHUNK_MAX];
+  sdlz_dec_t _dec;
+};
+
+/* ── Utilidades de envío ─────────────────────────────────────────────────── */
 
 static void rebooter_task(void *arg) {
   (void)arg;
-  for (int i=0;i<5;++i) { Serial.println("[WATCHDOG] Reinicio programado..."); vTaskDelay(pdMS_TO_TICKS(200)); }
+  Serial.println("[WATCHDOG] Reinicio programado...");
+  sdjson_shutdown(SDJSON_SHUTDOWN_MS); // vacía la writer y sella el log
   esp_restart();
 }
 
@@ -381,7 +575,6 @@ static void schedule_reboot_nonblocking(const char* reason) {
   if (gRebootScheduled) return;
   gRebootScheduled = true;
   Serial.printf("[WATCHDOG] %s\n", reason ? reason : "Reinicio solicitado");
-  sdcard_newline();
   xTaskCreatePinnedToCore(rebooter_task, "rebooter", 3072, NULL, configMAX_PRIORITIES-1, NULL, tskNO_AFFINITY);
 }
 
@@ -399,6 +592,7 @@ static bool save_cursor(size_t off) {
   FILE* f = fopen(INDEX_PATH, "w");
   if (!f) return false;
   fprintf(f, "%lu\n", (unsigned long)off);
+  sdacct_write(SDACCT_CURSOR, 0, (size_t)ftell(f));
   fclose(f); return true;
 }
 static void reset_cursor() {
@@ -433,6 +627,7 @@ static bool make_chunk_from_offset(const char* src, const char* dst,
     fputc(ch, fo); bytes++;
     if (ch == '\n') lines++;
   }
+  sdacct_write(SDACCT_SANITIZE, 0, bytes);
   fclose(fo); fclose(fi);
 
   if (out_lines) *out_lines = lines;
@@ -451,6 +646,7 @@ static bool compact_file_from_offset(const char* path, size_t offset) {
   FILE* fo = fopen(tmp, "wb"); if (!fo) { fclose(fi); return false; }
 
   int ch; while ((ch=fgetc(fi)) != EOF) fputc(ch, fo);
+  sdacct_write(SDACCT_COMPACT, 0, (size_t)ftell(fo));
   fclose(fi); fclose(fo);
 
   remove(path);
@@ -458,22 +654,8 @@ static bool compact_file_from_offset(const char* path, size_t offset) {
   return true;
 }
 
-// POST de un chunk NDJSON envuelto
-static int post_chunk(const char* chunk_path, int wifiCount, time_t ts) {
-  NdjsonStats st = {}; (void)compute_ndjson_stats(chunk_path, st);
-  if (st.lines == 0 || st.bytes == 0) return 204;
-
-  char prefix[128];
-  snprintf(prefix, sizeof(prefix),
-           "{\"recuento_max\":%d,\"ts\":%lu,\"events\":[",
-           wifiCount, (unsigned long)ts);
-  const size_t prefix_len = strlen(prefix);
-  static const char suffix[] = "]}";
-  const size_t suffix_len = sizeof(suffix) - 1;
-
-  size_t commas_between_lines = (st.lines > 0) ? (st.lines - 1) : 0;
-  size_t content_len = prefix_len + st.bytes + commas_between_lines + suffix_len;
-
+// POST del cuerpo ya preparado (chunk NDJSON o registros de segmento)
+static int post_body(Stream& body, size_t content_len, const char* content_encoding = nullptr) {
   if (!have_tls_memory()) { Serial.println("[HTTP] Heap insuficiente TLS (chunk)"); return -1; }
 
   WiFiClientSecure client; client.setInsecure(); client.setTimeout(8000);
@@ -481,12 +663,11 @@ static int post_chunk(const char* chunk_path, int wifiCount, time_t ts) {
 
   if (!http.begin(client, POST_URL)) { Serial.println("[HTTP] begin() falló (chunk)"); return -2; }
   http.addHeader("Content-Type", "application/json");
+  if (content_encoding) http.addHeader("Content-Encoding", content_encoding);
 
-  NdjsonArrayStream streamer(chunk_path, prefix, prefix_len, suffix, suffix_len);
-  streamer.begin();
   gLastPostTryTick = xTaskGetTickCount();
-  int code = http.sendRequest("POST", &streamer, content_len);
-  streamer.end(); http.end();
+  int code = http.sendRequest("POST", &body, content_len);
+  http.end();
 
   if (code > 0 && code < 400) {
     gLastPostOkTick = xTaskGetTickCount();
@@ -501,15 +682,85 @@ static int post_chunk(const char* chunk_path, int wifiCount, time_t ts) {
   return code;
 }
 
+// POST de un chunk NDJSON envuelto. 'known' son sus líneas/bytes si ya se
+// saben (saneado, trozos de flash); si no, se cuentan leyéndolo.
+static int post_chunk(const char* chunk_path, int wifiCount, time_t ts,
+                      const NdjsonStats* known = nullptr) {
+  NdjsonStats st = {};
+  if (known) st = *known;
+  else (void)compute_ndjson_stats(chunk_path, st);
+  if (st.lines == 0 || st.bytes == 0) return 204;
+
+  char prefix[128];
+  snprintf(prefix, sizeof(prefix),
+           "{\"recuento_max\":%d,\"ts\":%lu,\"events\":[",
+           wifiCount, (unsigned long)ts);
+  const size_t prefix_len = strlen(prefix);
+  static const char suffix[] = "]}";
+  const size_t suffix_len = sizeof(suffix) - 1;
+
+  size_t commas_between_lines = (st.lines > 0) ? (st.lines - 1) : 0;
+  size_t content_len = prefix_len + st.bytes + commas_between_lines + suffix_len;
+
+  NdjsonArrayStream streamer(chunk_path, prefix, prefix_len, suffix, suffix_len);
+  streamer.begin();
+  int code = post_body(streamer, content_len);
+  streamer.end();
+  return code;
+}
+
+// POST de los registros [start, end) de un segmento binario. 'objs' y
+// 'json_bytes' vienen de scan_seg_records() y fijan el Content-Length.
+static int post_seg_records(FILE* f, const sdseg_hdr_t& hdr, uint32_t start, uint32_t end,
+                            size_t objs, size_t json_bytes,
+                            int wifiCount, time_t ts) {
+  if (objs == 0) return 204;
+
+  char prefix[128];
+  snprintf(prefix, sizeof(prefix),
+           "{\"recuento_max\":%d,\"ts\":%lu,\"events\":[",
+           wifiCount, (unsigned long)ts);
+  const size_t prefix_len = strlen(prefix);
+  static const char suffix[] = "]}";
+  const size_t suffix_len = sizeof(suffix) - 1;
+
+  size_t content_len = prefix_len + json_bytes + (objs - 1) + suffix_len;
+
+  if (!sdrec_reader_init(&s_seg_reader, f, start, end, sdseg_is_framed(&hdr), sdseg_crc_seed(&hdr))) return -1;
+  SegmentJsonStream streamer(&s_seg_reader, prefix, prefix_len, suffix, suffix_len);
+  return post_body(streamer, content_len);
+}
+
+// POST de un pack de un segmento comprimido; 'f' queda tras su cabecera
+static int post_seg_pack(FILE* f, const sdseg_pack_t& pk, int wifiCount, time_t ts) {
+  if (pk.objs == 0) return 204;
+
+  char prefix[128];
+  snprintf(prefix, sizeof(prefix),
+           "{\"recuento_max\":%d,\"ts\":%lu,\"events\":[",
+           wifiCount, (unsigned long)ts);
+  const size_t prefix_len = strlen(prefix);
+  static const char suffix[] = "]}";
+  const size_t suffix_len = sizeof(suffix) - 1;
+
+  // El stream lleva la ventana del descompresor (~2.5 KB): fuera de la pila
+  SegmentPackStream* streamer = new SegmentPackStream(f, pk, SDLZ_POST_GZIP,
+                                                      prefix, prefix_len, suffix, suffix_len);
+  if (!streamer) return -1;
+  size_t content_len = SegmentPackStream::body_len(pk, SDLZ_POST_GZIP, prefix_len, suffix_len);
+  int code = post_body(*streamer, content_len, SDLZ_POST_GZIP ? "gzip" : nullptr);
+  delete streamer;
+  return code;
+}
+
 /* ── (Legacy) enviar archivo entero (queda sin usar) ─────────────────────── */
 static bool post_file_and_delete_on_ok(const char* fullpath, int wifiCount, time_t ts) {
-  NdjsonStats st = {}; (void)compute_ndjson_stats(fullpath, st);
+  NdjsonStats st = {};
   size_t kept=0, dropped=0;
-  bool saneado_ok = sanitize_snapshot_inplace(fullpath,&kept,&dropped);
+  bool saneado_ok = sanitize_snapshot_inplace(fullpath,&kept,&dropped,&st);
   if (!saneado_ok) return false;
   if (kept==0) { gLastPostOkTick = xTaskGetTickCount(); return true; }
 
-  (void)compute_ndjson_stats(fullpath, st);
   if (st.lines==0 || st.bytes==0) { remove(fullpath); gLastPostOkTick = xTaskGetTickCount(); return true; }
 
   char prefix[128];
@@ -539,6 +790,265 @@ static bool post_file_and_delete_on_ok(const char* fullpath, int wifiCount, time
   return ok;
 }
 
+/* ── Vaciado del backlog ─────────────────────────────────────────────────── */
+
+// Backlog heredado de versiones anteriores (mac_events.jsonl / _sending.jsonl):
+// se mueve a SENDING_PATH y se vacía por chunks con compactación, como antes.
+static void drain_legacy_backlog(const char* live_path, const http_msg_t& m) {
+    bool pending_exists = false;
+    { FILE* f = fopen(SENDING_PATH, "r"); if (f) { fclose(f); pending_exists = true; } }
+
+    bool renamed_ok = false;
+    if (!pending_exists) {
+        FILE* f_live = fopen(live_path, "r");
+        if (!f_live) return; // nada heredado
+        fclose(f_live);
+        if (rename(live_path, SENDING_PATH) == 0) {
+            renamed_ok = true;
+            reset_cursor(); // Empezamos a enviar el snapshot desde el principio
+            Serial.printf("[HTTP] Snapshot heredado: '%s' -> '%s'\n", live_path, SENDING_PATH);
+        } else {
+            Serial.println("[HTTP] ERROR: Falló el renombrado del backlog heredado.");
+        }
+    }
+    if (!renamed_ok && !pending_exists) return;
+
+    size_t cursor = 0;
+    load_cursor(cursor);
+
+    // El snapshot ya no crece: su tamaño se mira una vez y se ajusta al compactar
+    long filesize = file_size(SENDING_PATH);
+    if (filesize < 0) { remove(INDEX_PATH); return; }
+
+    for (;;) {
+        if (WiFi.status() != WL_CONNECTED) break;
+
+        if ((long)cursor >= filesize) {
+            remove(SENDING_PATH); remove(INDEX_PATH);
+            Serial.println("[HTTP] Cola de envío vaciada con éxito.");
+            break;
+        }
+
+        size_t lines_read = 0, bytes_read = 0;
+        if (!make_chunk_from_offset(SENDING_PATH, CHUNK_PATH, MAX_LINES_PER_POST, cursor, &lines_read, &bytes_read)) {
+            if ((long)cursor >= filesize) {
+                remove(SENDING_PATH); remove(INDEX_PATH);
+                Serial.println("[HTTP] Cola vacía (alcanzado EOF).");
+            }
+            break;
+        }
+
+        // El saneado del chunk es opcional pero recomendable; de paso cuenta
+        // líneas y bytes para el Content-Length
+        size_t kept = 0, dropped = 0;
+        NdjsonStats cst = {};
+        sanitize_snapshot_inplace(CHUNK_PATH, &kept, &dropped, &cst);
+        if (cst.lines == 0 || cst.bytes == 0) {
+            cursor += bytes_read; save_cursor(cursor);
+            remove(CHUNK_PATH);
+            continue;
+        }
+
+        int code = post_chunk(CHUNK_PATH, m.wifi, m.ts, &cst);
+        remove(CHUNK_PATH);
+        if (code <= 0 || code >= 400) break; // se reintenta desde el cursor guardado
+
+        cursor += bytes_read;
+        save_cursor(cursor);
+
+        // Compactación ocasional
+        if (cursor > COMPACT_MIN_BYTES && (cursor * COMPACT_FRAC_DEN) > ((size_t)filesize * COMPACT_FRAC_NUM)) {
+            Serial.printf("[HTTP] Compactando cola: cursor=%lu filesize=%ld\n", (unsigned long)cursor, filesize);
+            if (compact_file_from_offset(SENDING_PATH, cursor)) {
+                filesize -= (long)cursor;
+                cursor = 0; save_cursor(cursor);
+            } else {
+                Serial.println("[HTTP] WARNING: compactación fallida.");
+            }
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(10)); // ceder CPU
+    }
+}
+
+// Resultado de leer un trozo de un segmento sellado
+enum SegRead { SEG_READ_ERROR = -1, SEG_READ_END = 0, SEG_READ_CHUNK = 1 };
+
+// Un fallo de lectura se reintenta en el siguiente ciclo; si se repite en el
+// mismo sitio es que ahí no hay nada legible y se salta
+static uint32_t s_bad_seq = 0, s_bad_off = 0;
+
+static bool read_failed_again(uint32_t seq, uint32_t off) {
+  bool again = s_bad_seq == seq && s_bad_off == off;
+  s_bad_seq = seq; s_bad_off = off;
+  return again;
+}
+
+// Primera pasada sobre hasta 'max_lines' líneas de [start, end): dónde acaba
+// el trozo y cuántos objetos/bytes JSON generará. Solo decodifica binario.
+// SEG_READ_END solo con un fin de datos limpio en 'start'.
+static int scan_seg_records(FILE* f, const sdseg_hdr_t& hdr, uint32_t start, uint32_t end,
+                            size_t max_lines, uint32_t* out_end, size_t* out_objs,
+                            size_t* out_json_bytes) {
+  *out_end = start; *out_objs = 0; *out_json_bytes = 0;
+  if (!sdrec_reader_init(&s_seg_reader, f, start, end, sdseg_is_framed(&hdr), sdseg_crc_seed(&hdr)))
+    return SEG_READ_ERROR;
+  size_t lines = 0;
+  int x = SDREC_R_END;
+  while (lines < max_lines && (x = sdrec_next(&s_seg_reader)) != SDREC_R_END) {
+    if (x == SDREC_R_BAD) {
+      Serial.printf("[HTTP] Registro corrupto en offset %lu\n", (unsigned long)s_seg_reader.pos);
+      // Registro ilegible dentro de un frame: el resto del frame se salta
+      if (s_seg_reader.next_pos > s_seg_reader.pos) continue;
+      break; // frame cortado: no se puede pasar de aquí
+    }
+    if (x == SDREC_R_LINE) {
+      lines++;
+      *out_end = s_seg_reader.pos; // solo se corta en fin de línea
+    } else {
+      (*out_objs)++;
+      *out_json_bytes += s_seg_reader.json_len;
+    }
+  }
+  if (s_seg_reader.skipped)
+    Serial.printf("[HTTP] Frames corruptos descartados: %lu bytes\n", (unsigned long)s_seg_reader.skipped);
+  if (x == SDREC_R_END && lines < max_lines) {
+    // Los sellados acaban en fin de línea; si no, contamos lo leído
+    *out_end = s_seg_reader.pos;
+    return (*out_end > start) ? SEG_READ_CHUNK : SEG_READ_END;
+  }
+  if (x == SDREC_R_BAD && lines == 0) return SEG_READ_ERROR;
+  return SEG_READ_CHUNK;
+}
+
+// Acuse de un span enviado: la cabeza del segmento pasa a 'off'. Si falla,
+// el span se reenvía en el siguiente ciclo (duplicado, no perdido).
+static bool ack_span(uint32_t seq, uint32_t off) {
+  if (sdjson_consume(seq, off, ACK_TIMEOUT_MS)) return true;
+  Serial.printf("[HTTP] No se pudo consumir %08lX hasta %lu, se reenviará\n",
+                (unsigned long)seq, (unsigned long)off);
+  return false;
+}
+
+// Resultado de mandar un span
+enum SpanSend { SPAN_STOP = 0, SPAN_SENT = 1, SPAN_STALE = 2 };
+
+// Span que no se puede leer: se reintenta en el siguiente ciclo y, si vuelve
+// a fallar en el mismo sitio, se da por consumido hasta 'end'
+static int span_unreadable(const sdjson_span_t& sp, uint32_t end) {
+    if (!read_failed_again(sp.seq, sp.off)) {
+        Serial.printf("[HTTP] Error leyendo %08lX en %lu, se reintenta\n",
+                      (unsigned long)sp.seq, (unsigned long)sp.off);
+        return SPAN_STOP;
+    }
+    Serial.printf("[HTTP] %08lX ilegible desde %lu, se salta (%lu bytes)\n",
+                  (unsigned long)sp.seq, (unsigned long)sp.off,
+                  (unsigned long)(end - sp.off));
+    return ack_span(sp.seq, end) ? SPAN_SENT : SPAN_STOP;
+}
+
+// Un POST con el principio del span y su acuse. Los segmentos binarios se
+// decodifican al vuelo, sin chunk ni saneado en SD; de uno comprimido va un
+// pack por POST; los NDJSON de versión 1 van por chunk + saneado.
+static int post_span(FILE* f, const sdseg_hdr_t& hdr, const sdjson_span_t& sp,
+                     const http_msg_t& m) {
+    const uint32_t end = sp.off + sp.len;
+    uint32_t ack = end;
+    int code = 204;
+    if (sp.len == 0) {
+        // Sellado sin nada por enviar: el acuse lo borra
+    } else if (sdseg_is_lz(&hdr)) {
+        sdseg_pack_t pk;
+        if (!sdseg_read_pack(f, sp.off, &pk) || sp.off + sizeof(pk) + pk.comp_len > end)
+            return span_unreadable(sp, end);
+        code = post_seg_pack(f, pk, m.wifi, m.ts);
+        ack = sp.off + sizeof(pk) + pk.comp_len;
+    } else if (sdseg_is_binary(&hdr)) {
+        size_t objs = 0, json_bytes = 0;
+        int r = scan_seg_records(f, hdr, sp.off, end, SIZE_MAX, &ack, &objs, &json_bytes);
+        if (r == SEG_READ_ERROR) return span_unreadable(sp, end);
+        if (r == SEG_READ_END) ack = end;
+        code = post_seg_records(f, hdr, sp.off, ack, objs, json_bytes, m.wifi, m.ts);
+    } else {
+        char seg_path[SDSEG_PATH_MAX];
+        sdseg_path(sp.seq, seg_path, sizeof(seg_path));
+        size_t lines_read = 0, bytes_read = 0;
+        if (sp.lines == 0 ||
+            !make_chunk_from_offset(seg_path, CHUNK_PATH, sp.lines, sp.off, &lines_read, &bytes_read) ||
+            lines_read != sp.lines)
+            return span_unreadable(sp, end);
+        size_t kept = 0, dropped = 0;
+        NdjsonStats cst = {};
+        sanitize_snapshot_inplace(CHUNK_PATH, &kept, &dropped, &cst);
+        if (cst.lines > 0 && cst.bytes > 0) code = post_chunk(CHUNK_PATH, m.wifi, m.ts, &cst);
+        remove(CHUNK_PATH);
+    }
+    if (code <= 0 || code >= 400) return SPAN_STOP; // se reintenta desde la cabeza
+    if (!ack_span(sp.seq, ack)) return SPAN_STOP;
+    if ((hdr.flags & SDSEG_FLAG_SEALED) && ack >= SDSEG_HDR_SIZE + hdr.data_len)
+        Serial.printf("[HTTP] Segmento %08lX enviado y borrado.\n", (unsigned long)sp.seq);
+    return SPAN_SENT;
+}
+
+// Manda un span leído con sdjson_read_spans. Se fija el segmento para que
+// la compresión no lo cambie mientras se envía; si ya cambió desde que se
+// leyó (comprimido o consumido), SPAN_STALE y se vuelve a leer.
+static int send_span(const sdjson_span_t& sp, const http_msg_t& m) {
+    sdseg_pin(sp.seq);
+    sdseg_hdr_t hdr;
+    FILE* f = sdseg_fopen(sp.seq, &hdr); // descifra si está cifrado
+    int r = SPAN_STALE;
+    if (f && !((hdr.flags ^ sp.flags) & SDSEG_FLAG_LZ) && sdseg_data_start(&hdr) == sp.off)
+        r = post_span(f, hdr, sp, m);
+    if (f) fclose(f);
+    sdseg_pin(0);
+    return r;
+}
+
+// Vacía el log de segmentos desde la cabeza: los sellados en orden y después
+// el activo hasta su final estable, sin parar la writer. Cada POST aceptado
+// consume su span, así que siempre se vuelve a leer desde la cabeza (una
+// recuperación de espacio mueve los offsets).
+static void drain_segments(const http_msg_t& m) {
+    int stale = 0;
+    while (WiFi.status() == WL_CONNECTED) {
+        sdjson_pos_t from = {0, 0};
+        sdjson_span_t sp;
+        if (!sdjson_read_spans(&from, MAX_LINES_PER_POST, MAX_BYTES_PER_POST,
+                               s_span_buf, sizeof(s_span_buf), &sp, 1))
+            break;
+        int r = send_span(sp, m);
+        if (r == SPAN_STOP) break;
+        if (r == SPAN_STALE) {
+            if (++stale > 3) break;
+            continue;
+        }
+        stale = 0;
+        vTaskDelay(pdMS_TO_TICKS(10)); // ceder CPU
+    }
+}
+
+// Sin tarjeta: los trozos NDJSON de la flash interna se mandan tal cual
+static void drain_flash_chunks(const http_msg_t& m) {
+    uint32_t id;
+    char path[48];
+    while (WiFi.status() == WL_CONNECTED && sdflash_oldest(&id)) {
+        sdflash_path(id, path, sizeof(path));
+        sdflash_pin(id); // que no lo borre la vuelta del anillo mientras se envía
+        uint32_t lines = 0, bytes = 0;
+        NdjsonStats st;
+        bool known = sdflash_chunk_stats(id, &lines, &bytes);
+        st.lines = lines;
+        st.bytes = bytes;
+        int code = post_chunk(path, m.wifi, m.ts, known ? &st : nullptr);
+        sdflash_pin(0);
+        if (code <= 0 || code >= 400) break;
+        sdflash_remove(id, false);
+        Serial.printf("[HTTP] Trozo de flash %08lX enviado\n", (unsigned long)id);
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
 /* ── Task principal ──────────────────────────────────────────────────────── */
 
 static void wifi_http_task(void *pvParameters) {
@@ -557,16 +1067,29 @@ static void wifi_http_task(void *pvParameters) {
 
         if (xQueueReceive(gWifiHttpQueue, &m, portMAX_DELAY) != pdTRUE) continue;
 
-        // 1. LÓGICA UNIFICADA: Crear y sellar el lote SIEMPRE
-        if (netTimeReady()) {
+        // 1. LÓGICA UNIFICADA: Crear y sellar el lote SIEMPRE. Con ciclos
+        //    de sueño y sin Wi-Fi el recuento se queda en RTC y la SD solo
+        //    se toca cada SDRTC_FLUSH_CYCLES (o si el anillo se llena).
+        const bool keep_rtc = cfg.sleepcycle && WiFi.status() != WL_CONNECTED;
+        if (!netTimeReady()) {
+            Serial.println("[HTTP] Sin hora real: NO se guarda {t,w}.");
+        } else if (keep_rtc) {
+            sdrtc_push((uint32_t)m.ts, (uint32_t)m.wifi);
+        }
+        size_t flushed = 0;
+        if (sdrtc_pending() && (!keep_rtc || sdrtc_due())) flushed = sdjson_flush_rtc();
+        if (netTimeReady() && !keep_rtc) {
             char line[64];
             snprintf(line, sizeof(line), "{\"t\":%lu,\"w\":%d}", (unsigned long)m.ts, m.wifi);
-            sdcard_append_jsonl(line);
+            sdcard_append_jsonl_critical(line);
+        }
+        if (keep_rtc && !flushed) {
+            Serial.printf("[HTTP] Recuento guardado en RTC (%u pendientes)\n",
+                          (unsigned)sdrtc_pending());
         } else {
-            Serial.println("[HTTP] Sin hora real: NO se guarda {t,w}.");
+            if (!keep_rtc) sdcard_newline(); // Sellamos la línea actual para definir el lote.
+            Serial.printf("[HTTP] Lote sellado en SD con ts=%lu\n", (unsigned long)m.ts);
         }
-        sdcard_newline(); // Sellamos la línea actual para definir el lote.
-        Serial.printf("[HTTP] Lote sellado en SD con ts=%lu\n", (unsigned long)m.ts);
 
         // 2. PARTE CONDICIONAL: Si no hay Wi-Fi, el trabajo de este ciclo termina aquí.
         if (WiFi.status() != WL_CONNECTED) {
@@ -575,98 +1098,25 @@ static void wifi_http_task(void *pvParameters) {
         }
 
         // --- HAY WI-FI: PROCEDEMOS A ENVIAR EL BACKLOG ---
-        
-        vTaskDelay(pdMS_TO_TICKS(150)); // Pequeño respiro para que el writer de la SD actúe
-
-        // 3. CREAR SNAPSHOT
-        // Congelar y mover live->sending si no hay un envío pendiente
-        sdjson_logger_stop();
-
-        bool pending_exists = false;
-        { FILE* f = fopen(SENDING_PATH, "r"); if (f) { fclose(f); pending_exists = true; } }
-
-        bool renamed_ok = false;
-        {
-            FILE* f_live = fopen(live_path, "r");
-            if (f_live) {
-                fclose(f_live);
-                if (!pending_exists) {
-                    if (rename(live_path, SENDING_PATH) == 0) {
-                        renamed_ok = true;
-                        reset_cursor(); // Empezamos a enviar el nuevo snapshot desde el principio
-                        Serial.printf("[HTTP] Snapshot creado: '%s' -> '%s'\n", live_path, SENDING_PATH);
-                    } else {
-                        Serial.println("[HTTP] ERROR: Falló el renombrado del backlog.");
-                    }
-                } else {
-                    Serial.println("[HTTP] Hay un archivo de cola pendiente; se prioriza ese.");
-                }
-            } else {
-                Serial.println("[HTTP] No hay backlog 'en vivo' para enviar.");
-            }
+
+        // Despertar con el montaje aplazado: hace falta la tarjeta para enviar
+        const bool have_sd = sdcard_mount_now(SDCARD_MOUNT_TIMEOUT_MS);
+        if (!have_sd) {
+            Serial.println("[HTTP] SD no disponible: solo se envía lo de la flash.");
         }
-        sdjson_logger_start();
-
-        // 4. VACIAR SNAPSHOT POR CHUNKS
-        if (renamed_ok || pending_exists) {
-            size_t cursor = 0; 
-            load_cursor(cursor);
-
-            for (;;) {
-                if (WiFi.status() != WL_CONNECTED) break;
-
-                FILE* fsz = fopen(SENDING_PATH, "rb");
-                if (!fsz) { remove(INDEX_PATH); break; }
-                fseek(fsz, 0, SEEK_END);
-                long filesize = ftell(fsz);
-                fclose(fsz);
-
-                if ((long)cursor >= filesize) {
-                    remove(SENDING_PATH); remove(INDEX_PATH);
-                    Serial.println("[HTTP] Cola de envío vaciada con éxito.");
-                    break;
-                }
-
-                size_t lines_read = 0, bytes_read = 0;
-                if (!make_chunk_from_offset(SENDING_PATH, CHUNK_PATH, MAX_LINES_PER_POST, cursor, &lines_read, &bytes_read)) {
-                    if ((long)cursor >= filesize) {
-                        remove(SENDING_PATH); remove(INDEX_PATH);
-                        Serial.println("[HTTP] Cola vacía (alcanzado EOF).");
-                    }
-                    break;
-                }
-
-                // El saneado del chunk es opcional pero recomendable
-                size_t kept = 0, dropped = 0;
-                sanitize_snapshot_inplace(CHUNK_PATH, &kept, &dropped);
-
-                NdjsonStats cst = {};
-                compute_ndjson_stats(CHUNK_PATH, cst);
-                if (cst.lines == 0 || cst.bytes == 0) {
-                    cursor += bytes_read; save_cursor(cursor);
-                    remove(CHUNK_PATH);
-                    continue;
-                }
-                
-                post_chunk(CHUNK_PATH, m.wifi, m.ts);
-                remove(CHUNK_PATH);
-
-                cursor += bytes_read;
-                save_cursor(cursor);
-
-                // Compactación ocasional
-                if (cursor > COMPACT_MIN_BYTES && (cursor * COMPACT_FRAC_DEN) > ((size_t)filesize * COMPACT_FRAC_NUM)) {
-                    Serial.printf("[HTTP] Compactando cola: cursor=%lu filesize=%ld\n", (unsigned long)cursor, filesize);
-                    if (compact_file_from_offset(SENDING_PATH, cursor)) {
-                        cursor = 0; save_cursor(cursor);
-                    } else {
-                        Serial.println("[HTTP] WARNING: compactación fallida.");
-                    }
-                }
-
-                vTaskDelay(pdMS_TO_TICKS(10)); // ceder CPU
-            }
+
+        // 3. PUNTO DE ENVÍO: el activo se lee hasta su final estable, así que
+        //    basta con que la línea de este ciclo esté en la tarjeta; el
+        //    segmento se sigue sellando por hora o tamaño. De la flash solo
+        //    salen trozos cerrados: ahí sí se cierra el abierto.
+        if (have_sd ? !sdcard_flush_sync(2000) : !sdjson_rotate_sync(2000)) {
+            Serial.println("[HTTP] WARNING: la writer no confirmó; se envía lo ya estable.");
         }
+
+        // 4. VACIAR: primero el backlog heredado, luego los segmentos
+        drain_legacy_backlog(live_path, m);
+        drain_segments(m);
+        drain_flash_chunks(m);
     }
 }
 
@@ -680,6 +1130,15 @@ static void backlog_purge_task(void *pvParameters) {
   for (;;) {
     vTaskDelay(pdMS_TO_TICKS(kIntervalMs));
     if (WiFi.status() != WL_CONNECTED) {
+      // Con los contadores de la writer: si lo más antiguo tiene menos de
+      // 48h no hay nada que purgar (sin recorrer la tarjeta)
+      sdjson_backlog_t bl;
+      sdjson_get_backlog(&bl);
+      time_t now = time(nullptr);
+      if (bl.seg.lines == 0 ||
+          (bl.seg.first_t >= SDSEG_MIN_VALID_T && now >= (time_t)bl.seg.first_t &&
+           (uint32_t)(now - bl.seg.first_t) <= kMaxAgeSecs))
+        continue;
       Serial.println("[PURGE] Offline: solicitando purga de líneas > 48h...");
       sdjson_request_purge_older_than(kMaxAgeSecs);
     }
@@ -719,6 +1178,9 @@ static void post_reset_watchdog_task(void *pvParameters) {
       FILE* f = fopen(SENDING_PATH, "r");
       bool has_pending_file = (f != NULL);
       if (f) fclose(f);
+      sdjson_backlog_t bl;
+      sdjson_get_backlog(&bl);
+      if (bl.seg.segments || bl.seg.lines || bl.flash_chunks) has_pending_file = true;
       if (lastTry > lastOk || qdepth > 0 || has_pending_file) {
         schedule_reboot_nonblocking("10 min sin POST OK con Wi-Fi y datos pendientes");
       }
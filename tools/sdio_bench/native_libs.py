@@ -0,0 +1,7 @@
+# native_libs.py
+# extra script for env:native: links the host benchmark against the system's
+# mbedcrypto (AES-CTR of src/sdenc.cpp). Debian/Ubuntu: apt install libmbedtls-dev
+
+Import("env")
+
+env.Append(LIBS=["mbedcrypto"])
@@ -0,0 +1,401 @@
+/* Benchmark en host de la E/S del log de eventos en la SD (env:native).
+
+   Reproduce lo que hacen la writer (src/sdcard.cpp) y el uploader de
+   segmentos (src/wifi_post.cpp) sobre los mismos módulos de src/
+   (sdsegment, sdrecord, sdlz, sdtindex, sdenc, sdacct), con shims de
+   FreeRTOS/ESP-IDF (tools/sdio_bench/shim) y un directorio en tmpfs o en
+   una imagen FAT montada en loop en lugar de la tarjeta:
+
+   - append: eventos sintéticos al estilo de libpax a un ritmo dado, en
+     líneas de un ciclo de conteo, sellando cada tantas líneas. El reloj de
+     FreeRTOS es simulado (avanza 1/ritmo por evento) para que la política
+     de durabilidad vea el ritmo real; los tiempos medidos son de verdad.
+     Da eventos/s, MB/s de JSON, latencia de sellado, fsyncs y WAF.
+   - compresión (-z): sdseg_compress de los sellados, ms/MB de JSON.
+   - trozos: lo que hace el uploader por POST (scan_seg_records y el
+     cuerpo {"recuento_max":..,"events":[...]}), ms/MB de cuerpo.
+   - purga: arranque (sdseg_init) y sdseg_purge_older_than frente al
+     tamaño del backlog, de 1 segmento hasta -b.
+
+   Compilar desde la raíz del repo (libmbedtls-dev), o pio run -e native:
+     g++ -std=gnu++17 -O2 -Itools/sdio_bench/shim -Iinclude -DHAS_SDCARD=2 \
+         -o sdio_bench tools/sdio_bench/sdio_bench.cpp tools/sdio_bench/shim/shim.cpp \
+         src/sdsegment.cpp src/sdrecord.cpp src/sdlz.cpp src/sdtindex.cpp \
+         src/sdenc.cpp src/sdacct.cpp -lmbedcrypto
+
+   Uso: ./sdio_bench [-d dir] [-r eventos/s] [-t segundos simulados]
+                     [-c segundos por línea] [-k líneas por segmento]
+                     [-u dispositivos] [-p record|line|interval|seal]
+                     [-b segmentos máx. en la purga] [-z] [-v]
+   El directorio se vacía al empezar (por defecto /dev/shm/sdio_bench). */
+
+#include "sdacct.h"
+#include "sdrecord.h"
+#include "sdsegment.h"
+#include "shim.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point t0) {
+  return std::chrono::duration<double>(bench_clock::now() - t0).count();
+}
+
+static const double MB = 1024.0 * 1024.0;
+
+typedef struct {
+  const char *dir;
+  double rate;        // eventos/s
+  uint32_t seconds;   // duración simulada
+  uint32_t cycle_s;   // una línea por ciclo de conteo
+  uint32_t seg_lines; // líneas por segmento (ROTATE)
+  uint32_t devices;   // MACs distintas
+  uint32_t max_backlog;
+  sdseg_durability_t dur;
+  bool compress;
+} bench_opts_t;
+
+// Epoch de partida de los eventos: con hora real, pero en el pasado
+static const uint32_t T0 = 1735689600UL; // 2025-01-01
+
+static void clear_dir(const char *dir) {
+  std::string cmd = std::string("rm -rf '") + dir + "'/* 2>/dev/null";
+  if (system(cmd.c_str()) != 0) {
+    // directorio vacío o inexistente: nada que borrar
+  }
+}
+
+static int percentile_ms(std::vector<double> &v, double p, double *out) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  *out = v[(size_t)(p * (double)(v.size() - 1))] * 1000.0;
+  return 1;
+}
+
+/* ==================== Append ==================== */
+
+typedef struct {
+  uint64_t events;
+  uint64_t json_bytes;
+  uint32_t lines;
+  uint32_t seals;
+  double secs;
+  std::vector<double> seal_s;
+} append_result_t;
+
+// Como seg_append_obj: binario al segmento activo y punto de commit
+static bool append_obj(sdrec_ctx_t *ctx, bool *line_open, const char *json,
+                       size_t len) {
+  static uint8_t enc[SDREC_REC_MAX];
+  if (!sdseg_open_active()) return false;
+  if (!*line_open) sdrec_ctx_reset(ctx);
+  size_t n = sdrec_encode(ctx, json, len, enc, sizeof(enc));
+  if (n == 0) return false;
+  sdseg_append((const char *)enc, n);
+  *line_open = true;
+  sdseg_note_obj(sdseg_json_ts(json, len), 1);
+  sdseg_commit_point(false);
+  return true;
+}
+
+static void bench_append(const bench_opts_t &o, append_result_t *res) {
+  sdrec_ctx_t ctx;
+  bool line_open = false;
+  char json[160];
+  const uint64_t total = (uint64_t)(o.rate * o.seconds);
+  const double step_ms = 1000.0 / o.rate;
+  double clock_ms = 0.0; // reloj simulado ya avanzado
+  uint32_t next_line_s = o.cycle_s;
+  srand(7);
+
+  bench_clock::time_point t0 = bench_clock::now();
+  for (uint64_t i = 0; i < total; i++) {
+    double now_ms = (double)i * step_ms;
+    uint32_t adv = (uint32_t)(now_ms - clock_ms);
+    if (adv) {
+      shim_clock_advance_ms(adv);
+      clock_ms += adv;
+      // La writer duerme como mucho commit_due_ms entre registros
+      if (sdseg_commit_due_ms() == 0) sdseg_commit_tick();
+    }
+
+    // Fin de ciclo: registro de recuento y salto de línea (NEWLINE)
+    uint32_t sim_s = (uint32_t)(now_ms / 1000.0);
+    while (sim_s >= next_line_s) {
+      int n = snprintf(json, sizeof(json), "{\"t\":%lu,\"w\":%u}",
+                       (unsigned long)(T0 + next_line_s),
+                       (unsigned)(o.devices / 2));
+      append_obj(&ctx, &line_open, json, (size_t)n);
+      res->json_bytes += (uint64_t)n;
+      sdseg_end_line();
+      sdseg_commit_point(true);
+      line_open = false;
+      res->lines++;
+      next_line_s += o.cycle_s;
+
+      if (res->lines % o.seg_lines == 0) { // ROTATE
+        bench_clock::time_point ts = bench_clock::now();
+        if (sdseg_seal_active()) {
+          res->seal_s.push_back(seconds_since(ts));
+          res->seals++;
+        }
+      }
+    }
+
+    // Evento de libpax: t en ms, MAC, canal y RSSI
+    uint32_t dev = (uint32_t)rand() % o.devices;
+    uint64_t t_ms = (uint64_t)T0 * 1000 + (uint64_t)now_ms;
+    int n = snprintf(json, sizeof(json),
+                     "{\"t\":%llu,\"m\":\"%02X%02X%02X%02X%02X%02X\",\"w\":%u,\"r\":%d}",
+                     (unsigned long long)t_ms, 0x3C, 0x71, 0xBF,
+                     (unsigned)(dev >> 16) & 0xFF, (unsigned)(dev >> 8) & 0xFF,
+                     (unsigned)dev & 0xFF, 1 + (unsigned)(dev % 13),
+                     -40 - (int)(rand() % 50));
+    if (!append_obj(&ctx, &line_open, json, (size_t)n)) break;
+    res->events++;
+    res->json_bytes += (uint64_t)n;
+  }
+  if (line_open) {
+    sdseg_end_line();
+    res->lines++;
+  }
+  bench_clock::time_point ts = bench_clock::now();
+  if (sdseg_seal_active()) {
+    res->seal_s.push_back(seconds_since(ts));
+    res->seals++;
+  }
+  res->secs = seconds_since(t0);
+}
+
+/* ==================== Trozos del uploader ==================== */
+
+typedef struct {
+  uint32_t posts;
+  uint64_t body_bytes;
+  double secs;
+} chunk_result_t;
+
+// scan_seg_records + post_seg_records sin la red: cuenta un trozo y genera
+// el cuerpo que se mandaría
+static sdrec_reader_t s_reader;
+
+static uint32_t scan_chunk(FILE *f, const sdseg_hdr_t &hdr, uint32_t start,
+                           size_t max_lines, size_t *objs, size_t *json_bytes) {
+  uint32_t end = start;
+  *objs = 0;
+  *json_bytes = 0;
+  if (!sdrec_reader_init(&s_reader, f, start, 0, sdseg_is_framed(&hdr),
+                         sdseg_crc_seed(&hdr)))
+    return start;
+  size_t lines = 0;
+  int x = SDREC_R_END;
+  while (lines < max_lines && (x = sdrec_next(&s_reader)) > 0) {
+    if (x == SDREC_R_LINE) {
+      lines++;
+      end = s_reader.pos;
+    } else {
+      (*objs)++;
+      *json_bytes += s_reader.json_len;
+    }
+  }
+  if (x != SDREC_R_LINE && lines < max_lines) end = s_reader.pos;
+  return end;
+}
+
+static size_t build_body(FILE *f, const sdseg_hdr_t &hdr, uint32_t start,
+                         uint32_t end, std::string &body) {
+  char prefix[128];
+  snprintf(prefix, sizeof(prefix), "{\"recuento_max\":%d,\"ts\":%lu,\"events\":[",
+           10, (unsigned long)T0);
+  body.assign(prefix);
+  if (!sdrec_reader_init(&s_reader, f, start, end, sdseg_is_framed(&hdr),
+                         sdseg_crc_seed(&hdr)))
+    return 0;
+  bool first = true;
+  int x;
+  while ((x = sdrec_next(&s_reader)) > 0) {
+    if (x != SDREC_R_JSON) continue;
+    if (!first) body += ',';
+    body.append(s_reader.json, s_reader.json_len);
+    first = false;
+  }
+  body += "]}";
+  return body.size();
+}
+
+static void bench_chunks(size_t max_lines, chunk_result_t *res) {
+  std::vector<uint32_t> seqs(4096);
+  seqs.resize(sdseg_list(seqs.data(), seqs.size()));
+  std::string body;
+  bench_clock::time_point t0 = bench_clock::now();
+  for (uint32_t seq : seqs) {
+    sdseg_hdr_t hdr;
+    FILE *f = sdseg_fopen(seq, &hdr);
+    if (!f) continue;
+    if (sdseg_is_lz(&hdr)) { // los packs van tal cual (un POST por pack)
+      fclose(f);
+      continue;
+    }
+    uint32_t cursor = sdseg_data_start(&hdr);
+    for (;;) {
+      size_t objs, json_bytes;
+      uint32_t end = scan_chunk(f, hdr, cursor, max_lines, &objs, &json_bytes);
+      if (end <= cursor) break;
+      if (objs) {
+        res->body_bytes += build_body(f, hdr, cursor, end, body);
+        res->posts++;
+      }
+      cursor = end;
+    }
+    fclose(f);
+  }
+  res->secs = seconds_since(t0);
+}
+
+/* ==================== Purga frente al backlog ==================== */
+
+static void bench_purge(const bench_opts_t &o) {
+  printf("purga     : segmentos  MB      arranque  purga\n");
+  bench_opts_t p = o;
+  p.seconds = p.seg_lines * p.cycle_s; // un segmento por vuelta
+  // Cada vuelta deja un segmento (o más si pasa de SDSEG_MAX_BYTES)
+  for (uint32_t n = 1;; n *= 2) {
+    clear_dir(o.dir);
+    sdseg_init(o.dir);
+    for (uint32_t i = 0; i < n; i++) {
+      append_result_t r = {};
+      bench_append(p, &r);
+    }
+    sdseg_backlog_t b;
+    sdseg_backlog(&b);
+
+    bench_clock::time_point t0 = bench_clock::now();
+    sdseg_init(o.dir); // inventario al montar
+    double t_init = seconds_since(t0);
+    t0 = bench_clock::now();
+    size_t gone = sdseg_purge_older_than((time_t)T0 + 100L * 86400L);
+    double t_purge = seconds_since(t0);
+    printf("            %9lu  %6.1f  %6.1f ms %6.1f ms (%zu borrados)\n",
+           (unsigned long)b.segments, (double)b.bytes / MB, t_init * 1000.0,
+           t_purge * 1000.0, gone);
+    if (b.segments >= o.max_backlog) break;
+  }
+}
+
+/* ==================== main ==================== */
+
+static bool parse_dur(const char *s, sdseg_durability_t *d) {
+  if (!strcmp(s, "record")) *d = SDSEG_DUR_RECORD;
+  else if (!strcmp(s, "line")) *d = SDSEG_DUR_LINE;
+  else if (!strcmp(s, "interval")) *d = SDSEG_DUR_INTERVAL;
+  else if (!strcmp(s, "seal")) *d = SDSEG_DUR_SEAL;
+  else return false;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bench_opts_t o = {"/dev/shm/sdio_bench", 50.0, 6 * 3600, 60, 60, 500, 64,
+                    SDSEG_DURABILITY_DEFAULT, false};
+  int c;
+  shim_log_level = 'E';
+  while ((c = getopt(argc, argv, "d:r:t:c:k:u:p:b:zv")) != -1) {
+    switch (c) {
+    case 'd': o.dir = optarg; break;
+    case 'r': o.rate = atof(optarg); break;
+    case 't': o.seconds = (uint32_t)atoi(optarg); break;
+    case 'c': o.cycle_s = (uint32_t)atoi(optarg); break;
+    case 'k': o.seg_lines = (uint32_t)atoi(optarg); break;
+    case 'u': o.devices = (uint32_t)atoi(optarg); break;
+    case 'b': o.max_backlog = (uint32_t)atoi(optarg); break;
+    case 'z': o.compress = true; break;
+    case 'v': shim_log_level = 'I'; break;
+    case 'p':
+      if (parse_dur(optarg, &o.dur)) break;
+      // fall through
+    default:
+      fprintf(stderr, "uso: %s [-d dir] [-r ev/s] [-t s] [-c s/línea] "
+                      "[-k líneas/seg] [-u disp] [-p record|line|interval|seal] "
+                      "[-b segs] [-z] [-v]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (o.rate <= 0 || o.cycle_s == 0 || o.seg_lines == 0 || o.devices == 0) {
+    fprintf(stderr, "parámetros fuera de rango\n");
+    return 2;
+  }
+
+  std::string mk = std::string("mkdir -p '") + o.dir + "'";
+  if (system(mk.c_str()) != 0 || access(o.dir, W_OK) != 0) {
+    perror(o.dir);
+    return 2;
+  }
+  clear_dir(o.dir);
+  if (!sdseg_init(o.dir)) {
+    fprintf(stderr, "sdseg_init(%s) falla\n", o.dir);
+    return 1;
+  }
+  sdseg_set_durability(o.dur, SDSEG_COMMIT_INTERVAL_MS);
+  sdacct_open(o.dir, 0xBE0C0001UL);
+
+  append_result_t ar = {};
+  bench_append(o, &ar);
+  sdseg_commit_stats_t cs;
+  sdseg_get_commit_stats(&cs);
+  sdacct_totals_t acct;
+  sdacct_get(&acct);
+  uint32_t waf = sdacct_waf_x100(&acct);
+  double p50 = 0, pmax = 0;
+  percentile_ms(ar.seal_s, 0.5, &p50);
+  percentile_ms(ar.seal_s, 1.0, &pmax);
+
+  printf("directorio: %s, %.0f ev/s durante %lu s simulados, línea cada %lu s\n",
+         o.dir, o.rate, (unsigned long)o.seconds, (unsigned long)o.cycle_s);
+  printf("append    : %llu eventos, %lu líneas en %.2f s: %.0f ev/s, %.1f MB/s de JSON\n",
+         (unsigned long long)ar.events, (unsigned long)ar.lines, ar.secs,
+         (double)ar.events / ar.secs, (double)ar.json_bytes / MB / ar.secs);
+  printf("            margen x%.0f sobre el ritmo pedido\n",
+         (double)ar.events / ar.secs / o.rate);
+  printf("tarjeta   : %llu B de datos, %llu B físicos, %lu commits, %lu fsync, WAF %lu.%02lu\n",
+         (unsigned long long)cs.bytes, (unsigned long long)cs.phys_bytes,
+         (unsigned long)cs.commits, (unsigned long)acct.fsyncs,
+         (unsigned long)(waf / 100), (unsigned long)(waf % 100));
+  printf("sellado   : %lu segmentos, p50 %.2f ms, máx %.2f ms\n",
+         (unsigned long)ar.seals, p50, pmax);
+
+  if (o.compress) {
+    bench_clock::time_point t0 = bench_clock::now();
+    while (sdseg_compress_next()) {
+    }
+    double t = seconds_since(t0);
+    sdseg_lz_stats_t lz;
+    sdseg_get_lz_stats(&lz);
+    double mb = (double)lz.json_bytes / MB;
+    if (lz.segments && mb > 0)
+      printf("compresión: %lu segmentos, %.1f MB JSON -> %.2f MB, %.1f ms/MB\n",
+             (unsigned long)lz.segments, mb, (double)lz.comp_bytes / MB,
+             t * 1000.0 / mb);
+  }
+
+  chunk_result_t cr = {0, 0, 0.0};
+  bench_chunks(25, &cr); // MAX_LINES_PER_POST
+  if (cr.posts)
+    printf("trozos    : %lu POST, %.1f MB de cuerpo, %.1f ms/MB\n",
+           (unsigned long)cr.posts, (double)cr.body_bytes / MB,
+           cr.secs * 1000.0 / ((double)cr.body_bytes / MB));
+  else if (o.compress)
+    printf("trozos    : sin segmentos binarios (los packs se envían tal cual)\n");
+
+  sdacct_close();
+  if (o.max_backlog) bench_purge(o);
+  clear_dir(o.dir);
+  return ar.events ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdarg.h>
+
+// Salida por stderr a partir del nivel de shim_log_level ('E', 'W', 'I')
+void shim_log(char level, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+#define ESP_LOGE(tag, fmt, ...) shim_log('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) shim_log('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) shim_log('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ((void)(tag))
+#define ESP_LOGV(tag, fmt, ...) ((void)(tag))
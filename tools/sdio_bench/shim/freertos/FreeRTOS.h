@@ -0,0 +1,34 @@
+#pragma once
+/* Lo justo de FreeRTOS para compilar el almacenamiento de la SD en host
+   (env:native, tools/sdio_bench). Las secciones críticas son un único
+   mutex recursivo y los ticks un reloj simulado que avanza el benchmark. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFFu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+typedef struct {
+  int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+#define portENTER_CRITICAL(m) vPortEnterCritical(m)
+#define portEXIT_CRITICAL(m) vPortExitCritical(m)
+#define portENTER_CRITICAL_ISR(m) vPortEnterCritical(m)
+#define portEXIT_CRITICAL_ISR(m) vPortExitCritical(m)
+#define portENTER_CRITICAL_SAFE(m) vPortEnterCritical(m)
+#define portEXIT_CRITICAL_SAFE(m) vPortExitCritical(m)
+
+static inline BaseType_t xPortInIsrContext(void) { return pdFALSE; }
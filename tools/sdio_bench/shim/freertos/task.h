@@ -0,0 +1,5 @@
+#pragma once
+#include "FreeRTOS.h"
+
+TickType_t xTaskGetTickCount(void); // reloj simulado (shim_clock_advance_ms)
+void vTaskDelay(TickType_t ticks);  // solo avanza el reloj simulado
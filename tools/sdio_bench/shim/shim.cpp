@@ -0,0 +1,68 @@
+#include "shim.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <stdio.h>
+
+char shim_log_level = 'W';
+
+static std::recursive_mutex s_critical;
+static std::atomic<uint32_t> s_ticks{1};
+static std::mt19937 s_rng(12345);
+
+void shim_clock_advance_ms(uint32_t ms) { s_ticks += ms; }
+
+void vPortEnterCritical(portMUX_TYPE *) { s_critical.lock(); }
+void vPortExitCritical(portMUX_TYPE *) { s_critical.unlock(); }
+
+TickType_t xTaskGetTickCount(void) { return s_ticks; }
+void vTaskDelay(TickType_t ticks) { s_ticks += ticks; }
+
+struct shim_mutex {
+  std::timed_mutex m;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return new shim_mutex; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+  if (ticks == portMAX_DELAY) {
+    sem->m.lock();
+    return pdTRUE;
+  }
+  return sem->m.try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  sem->m.unlock();
+  return pdTRUE;
+}
+
+int64_t esp_timer_get_time(void) {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t esp_random(void) {
+  std::lock_guard<std::recursive_mutex> lock(s_critical);
+  return s_rng();
+}
+
+static int level_rank(char l) { return l == 'E' ? 1 : l == 'W' ? 2 : l == 'I' ? 3 : 0; }
+
+void shim_log(char level, const char *tag, const char *fmt, ...) {
+  if (level_rank(level) > level_rank(shim_log_level)) return;
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%c %s: ", level, tag);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+}
@@ -0,0 +1,7 @@
+#pragma once
+/* Control de los shims desde el benchmark */
+
+#include <stdint.h>
+
+extern char shim_log_level; // 'E', 'W' o 'I'; 0 = nada
+void shim_clock_advance_ms(uint32_t ms);
@@ -0,0 +1,160 @@
+/* Benchmark en host del compresor de segmentos (src/sdlz.cpp).
+
+   Lee un log capturado en NDJSON (p.ej. un mac_events.jsonl sacado de la SD),
+   lo trocea en packs como sdseg_compress() (objetos unidos por ',' y corte en
+   fin de línea al pasar de SDSEG_LZ_PACK_BYTES) y mide ratio y tiempo de
+   compresión/descompresión. Comprueba el round-trip y, con -o, escribe el
+   primer pack como el gzip que manda el uploader para probarlo con gzip -t.
+
+   Compilar desde la raíz del repo:
+     g++ -O2 -Iinclude -o sdlz_bench tools/sdlz_bench/sdlz_bench.cpp \
+         src/sdlz.cpp src/sdrecord.cpp
+
+   Uso: ./sdlz_bench captura.jsonl [-o pack0.gz] */
+
+#include "sdlz.h"
+#include "sdrecord.h"  // sdrec_crc32
+#include "sdsegment.h" // SDSEG_LZ_PACK_BYTES, sdseg_pack_t
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point t0) {
+  return std::chrono::duration<double>(bench_clock::now() - t0).count();
+}
+
+static bool out_append(void *ctx, const uint8_t *p, size_t n) {
+  ((std::string *)ctx)->append((const char *)p, n);
+  return true;
+}
+
+struct mem_reader {
+  const std::string *s;
+  size_t pos;
+};
+
+static int mem_getc(void *ctx) {
+  mem_reader *r = (mem_reader *)ctx;
+  return (r->pos < r->s->size()) ? (uint8_t)(*r->s)[r->pos++] : -1;
+}
+
+// Texto "obj,obj,..." de cada pack, como lo genera write_packs()
+static std::vector<std::string> split_packs(FILE *f) {
+  std::vector<std::string> packs(1);
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    size_t n = strlen(line);
+    while (n && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ' ')) n--;
+    if (n == 0) continue;
+    std::string &cur = packs.back();
+    if (!cur.empty()) cur += ',';
+    cur.append(line, n);
+    if (cur.size() >= SDSEG_LZ_PACK_BYTES) packs.emplace_back();
+  }
+  if (packs.back().empty()) packs.pop_back();
+  return packs;
+}
+
+static bool write_gzip(const char *path, const std::string &json,
+                       const std::string &comp, uint32_t crc) {
+  static const char prefix[] = "{\"recuento_max\":0,\"ts\":0,\"events\":[";
+  static const char suffix[] = "]}";
+  const size_t pl = sizeof(prefix) - 1, sl = sizeof(suffix) - 1;
+  uint8_t hdr[SDLZ_GZIP_HDR + SDLZ_STORED_HDR], tr[SDLZ_GZIP_TRAILER];
+
+  uint32_t gcrc = sdrec_crc32(0, (const uint8_t *)prefix, pl);
+  gcrc = sdlz_crc32_combine(gcrc, crc, (uint32_t)json.size());
+  gcrc = sdrec_crc32(gcrc, (const uint8_t *)suffix, sl);
+
+  FILE *f = fopen(path, "wb");
+  if (!f) return false;
+  size_t n = sdlz_gzip_header(hdr);
+  n += sdlz_stored_hdr(hdr + n, (uint16_t)pl, false);
+  fwrite(hdr, 1, n, f);
+  fwrite(prefix, 1, pl, f);
+  fwrite(comp.data(), 1, comp.size(), f);
+  fwrite(hdr, 1, sdlz_stored_hdr(hdr, (uint16_t)sl, true), f);
+  fwrite(suffix, 1, sl, f);
+  fwrite(tr, 1, sdlz_gzip_trailer(tr, gcrc, (uint32_t)(pl + json.size() + sl)), f);
+  return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+  const char *in_path = NULL, *gz_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) gz_path = argv[++i];
+    else in_path = argv[i];
+  }
+  if (!in_path) {
+    fprintf(stderr, "uso: %s captura.jsonl [-o pack0.gz]\n", argv[0]);
+    return 2;
+  }
+  FILE *f = fopen(in_path, "rb");
+  if (!f) {
+    perror(in_path);
+    return 2;
+  }
+  std::vector<std::string> packs = split_packs(f);
+  fclose(f);
+  if (packs.empty()) {
+    fprintf(stderr, "%s: sin datos\n", in_path);
+    return 2;
+  }
+
+  static sdlz_enc_t enc;
+  static sdlz_dec_t dec;
+  std::vector<std::string> comp(packs.size());
+  std::vector<uint32_t> crcs(packs.size());
+  uint64_t json_bytes = 0, comp_bytes = 0;
+
+  bench_clock::time_point t0 = bench_clock::now();
+  for (size_t i = 0; i < packs.size(); i++) {
+    sdlz_enc_init(&enc, out_append, &comp[i]);
+    sdlz_enc_write(&enc, packs[i].data(), packs[i].size());
+    sdlz_enc_end_pack(&enc);
+    crcs[i] = enc.crc;
+    json_bytes += packs[i].size();
+    comp_bytes += sizeof(sdseg_pack_t) + comp[i].size();
+  }
+  double t_comp = seconds_since(t0);
+
+  bool ok = true;
+  std::string out;
+  uint8_t buf[512];
+  t0 = bench_clock::now();
+  for (size_t i = 0; i < packs.size() && ok; i++) {
+    mem_reader r = {&comp[i], 0};
+    sdlz_dec_init(&dec, mem_getc, &r);
+    out.clear();
+    int n;
+    while ((n = sdlz_dec_read(&dec, buf, sizeof(buf))) > 0) out.append((const char *)buf, n);
+    ok = n == 0 && out == packs[i] &&
+         crcs[i] == sdrec_crc32(0, (const uint8_t *)out.data(), out.size());
+    if (!ok) fprintf(stderr, "pack %zu: round-trip FALLA\n", i);
+  }
+  double t_dec = seconds_since(t0);
+
+  const double mb = (double)json_bytes / (1024.0 * 1024.0);
+  printf("entrada   : %s\n", in_path);
+  printf("packs     : %zu (%lu B de JSON por pack)\n", packs.size(), (unsigned long)SDSEG_LZ_PACK_BYTES);
+  printf("ventana   : %u B, hash %u bits, cadena %u\n", (unsigned)SDLZ_WINDOW,
+         (unsigned)SDLZ_HASH_BITS, (unsigned)SDLZ_CHAIN);
+  printf("json      : %llu B\n", (unsigned long long)json_bytes);
+  printf("packs     : %llu B (con cabeceras)\n", (unsigned long long)comp_bytes);
+  printf("ratio     : x%.2f\n", (double)json_bytes / (double)comp_bytes);
+  printf("compresión: %.1f MB/s, %.1f ms/MB\n", mb / t_comp, t_comp * 1000.0 / mb);
+  printf("inflado   : %.1f MB/s, %.1f ms/MB\n", mb / t_dec, t_dec * 1000.0 / mb);
+  printf("round-trip: %s\n", ok ? "OK" : "FALLA");
+
+  if (ok && gz_path) {
+    ok = write_gzip(gz_path, packs[0], comp[0], crcs[0]);
+    printf("gzip      : %s %s\n", gz_path, ok ? "escrito" : "FALLA");
+  }
+  return ok ? 0 : 1;
+}